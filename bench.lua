@@ -0,0 +1,115 @@
+
+-- Usage: lua bench.lua [iterations]
+--
+-- Measures the cost of the luachild primitives. The child process is
+-- bench_child, compiled from bench_child.c on the first run.
+
+local lc = require "luachild"
+
+local iterations = tonumber(arg[1]) or 1000
+local child = './bench_child'
+
+-- utility
+
+local function report(name, value, unit)
+  print(string.format('%-40s %14.3f %s', name, value, unit))
+end
+
+local function percentile(sorted, p)
+  local i = math.ceil(#sorted * p)
+  if i < 1 then i = 1 end
+  return sorted[i]
+end
+
+local function run(cmd)
+  local p = lc.spawn(cmd)
+  if not p then return nil end
+  return p:wait()
+end
+
+if not io.open(child, 'rb') then
+  if run{'cc', '-O2', '-o', child, 'bench_child.c'} ~= 0 then
+    error('can not compile bench_child.c')
+  end
+end
+
+print('luachild benchmark - ' .. (jit and jit.version or _VERSION) .. ' - ' .. lc.spawn_backend)
+print('iterations: ' .. iterations)
+print()
+
+-- Spawn to exit latency
+
+local lat = {}
+local start = lc.clock()
+for i = 1, iterations do
+  local t = lc.clock()
+  lc.spawn{child}:wait()
+  lat[i] = lc.clock() - t
+end
+local total = lc.clock() - start
+table.sort(lat)
+
+report('sequential spawns', iterations / total, 'spawn/s')
+report('spawn to exit p50', percentile(lat, 0.50) * 1e6, 'us')
+report('spawn to exit p99', percentile(lat, 0.99) * 1e6, 'us')
+
+-- Parallel spawn rate
+
+local jobs = {}
+for i = 1, iterations do jobs[i] = {child} end
+start = lc.clock()
+lc.pool{jobs = jobs}
+report('parallel spawns (lc.pool)', iterations / (lc.clock() - start), 'spawn/s')
+
+-- Environment conversion
+
+local function spawn_time(env)
+  local t = lc.clock()
+  for i = 1, iterations do
+    lc.spawn{child, env = env}:wait()
+  end
+  return (lc.clock() - t) / iterations
+end
+
+report('spawn without env table', spawn_time(nil) * 1e6, 'us')
+for _, size in ipairs{10, 100, 1000} do
+  local env = {}
+  for i = 1, size do
+    env['BENCH_VARIABLE_' .. i] = string.rep('v', 32)
+  end
+  report('spawn with env table of ' .. size, spawn_time(env) * 1e6, 'us')
+  report('spawn with envblock of ' .. size, spawn_time(lc.envblock(env)) * 1e6, 'us')
+end
+
+-- Pipe throughput
+
+local bytes = 64 * 1024 * 1024
+
+local r, w = lc.pipe()
+start = lc.clock()
+local p = lc.spawn{child, tostring(bytes), stdout = w}
+w:close()
+local out = r:read('*a')
+p:wait()
+r:close()
+report('lc.pipe read throughput', #out / (lc.clock() - start) / 1048576, 'MiB/s')
+
+start = lc.clock()
+out = lc.spawn{child, tostring(bytes), stdout = 'capture'}:communicate()
+report('capture throughput', #out / (lc.clock() - start) / 1048576, 'MiB/s')
+
+-- Message round trip
+
+local ch = lc.shmchannel()
+if ch then
+  local messages = iterations * 100
+  p = lc.spawn{child, 'shm', fds = {[3] = ch:fileno()}}
+  start = lc.clock()
+  for i = 1, messages do
+    ch:send('ping')
+    ch:recv()
+  end
+  report('lc.shmchannel round trips', messages / (lc.clock() - start), 'msg/s')
+  ch:close()
+  p:wait()
+end
@@ -0,0 +1,45 @@
+/*
+Minimal child process for bench.lua. Without arguments it exits at once, so
+that the spawn cost is not hidden by the startup of an interpreter. With a
+numeric argument it writes that amount of bytes on stdout. With the shm
+argument it echoes the messages of the lc.shmchannel mapped on its fd 3.
+
+  cc -O2 -o bench_child bench_child.c
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include "luachild_shm.h"
+
+static int shm_echo(void)
+{
+  static char buf[65536];
+  struct lc_shm ch;
+  int n;
+  if (lc_shm_attach(&ch, 3, LC_SHM_PEER)) return 1;
+  while ((n = lc_shm_recv(&ch, buf, sizeof buf, -1)) >= 0)
+    if (lc_shm_send(&ch, buf, n, -1)) break;
+  lc_shm_detach(&ch);
+  return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  static char buf[65536];
+  long left;
+  if (argc < 2) return 0;
+#ifdef __linux__
+  if (!strcmp(argv[1], "shm")) return shm_echo();
+#endif
+  memset(buf, 'x', sizeof buf);
+  for (left = atol(argv[1]); left > 0;) {
+    ssize_t done = write(STDOUT_FILENO, buf, left < (long)sizeof buf ? (size_t)left : sizeof buf);
+    if (done <= 0) return 1;
+    left -= done;
+  }
+  return 0;
+}
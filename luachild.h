@@ -22,17 +22,114 @@
 #endif
 
 #define PROCESS_HANDLE "process"
+#define ENVBLOCK_HANDLE "envblock"
+#define TEMPLATE_HANDLE "template"
+#define FD_HANDLE "fd"
+#define POLLER_HANDLE "poller"
+#define LOOP_HANDLE "loop"
+#define SHMCHANNEL_HANDLE "shmchannel"
+#define WORKER_HANDLE "worker"
+#define FORKSERVER_HANDLE "forkserver"
+#define TRACE_HANDLE "trace"
 
 int lc_pipe(lua_State *L);
 int lc_setenv(lua_State *L);
 int lc_environ(lua_State *L);
 int lc_spawn(lua_State *L);
+int lc_prepare(lua_State *L);
+int lc_waitany(lua_State *L);
+int lc_waitall(lua_State *L);
+int lc_pool(lua_State *L);
+int lc_pipeline(lua_State *L);
+int lc_splice(lua_State *L);
+int lc_tee(lua_State *L);
+int lc_fileno(lua_State *L);
+int lc_poller(lua_State *L);
+int lc_loop(lua_State *L);
+int lc_shmchannel(lua_State *L);
+int lc_shmattach(lua_State *L);
+int lc_worker(lua_State *L);
+int lc_forkserver(lua_State *L);
+int lc_forkserver_serve(lua_State *L);
+int lc_clock(lua_State *L);
+int lc_envblock(lua_State *L);
+int lc_stats(lua_State *L);
+int lc_stats_reset(lua_State *L);
+int lc_trace_start(lua_State *L);
+int lc_trace_stop(lua_State *L);
 int process_wait(lua_State *L);
+int process_poll(lua_State *L);
+int process_gc(lua_State *L);
+int process_communicate(lua_State *L);
+int process_fd(lua_State *L);
+int process_usage(lua_State *L);
+int process_lines(lua_State *L);
+int process_kill(lua_State *L);
+int process_killtree(lua_State *L);
 int diriter_close(lua_State *L);
 int process_tostring(lua_State *L);
+int envblock_set(lua_State *L);
+int envblock_unset(lua_State *L);
+int envblock_get(lua_State *L);
+int envblock_gc(lua_State *L);
+int template_spawn(lua_State *L);
+int template_gc(lua_State *L);
+int rawfd_read(lua_State *L);
+int rawfd_write(lua_State *L);
+int rawfd_fileno(lua_State *L);
+int rawfd_close(lua_State *L);
+int rawfd_gc(lua_State *L);
+int rawfd_tostring(lua_State *L);
+int poller_add(lua_State *L);
+int poller_remove(lua_State *L);
+int poller_wait(lua_State *L);
+int poller_close(lua_State *L);
+int loop_go(lua_State *L);
+int loop_run(lua_State *L);
+int loop_read(lua_State *L);
+int loop_write(lua_State *L);
+int loop_wait(lua_State *L);
+int loop_communicate(lua_State *L);
+int loop_sleep(lua_State *L);
+int loop_gc(lua_State *L);
+int shmchannel_send(lua_State *L);
+int shmchannel_recv(lua_State *L);
+int shmchannel_fileno(lua_State *L);
+int shmchannel_close(lua_State *L);
+int worker_send(lua_State *L);
+int worker_receive(lua_State *L);
+int worker_call(lua_State *L);
+int worker_close(lua_State *L);
+int worker_gc(lua_State *L);
+int forkserver_spawn(lua_State *L);
+int forkserver_close(lua_State *L);
+int forkserver_gc(lua_State *L);
+int trace_gc(lua_State *L);
+
+struct envblock;
+struct envblock *check_envblock(lua_State *L, int idx);
+const char **envblock_vector(struct envblock *e);
+const char *envblock_string(struct envblock *e);
+struct envblock *state_envblock(lua_State *L, int create);
 
 int lua_report_type_error(lua_State *L, int narg, const char * tname);
 size_t lua_value_length(lua_State *L, int index);
+int lua_resume_thread(lua_State *co, lua_State *from, int nargs);
+
+extern const char spawn_backend[];
+
+double monotonic_time(void);
+int cpu_count(void);
+void stats_spawn(double start, const char *command, long pid, int ok);
+void stats_exit(long pid, int code);
+void stats_wait(double start, long pid, int timedout);
+void stats_pipe(int ok);
+void trace_spawn(double start, const char *command, long pid, int ok);
+void trace_exit(long pid, int code);
+void trace_wait(double start, long pid, int timedout);
+void trace_pipe(void);
+int process_captured(lua_State *L, int idx, int stream);
+long process_read(lua_State *L, int idx, int stream, char *buf, size_t len);
 
 int file_handler_creator(lua_State *L, const char * file_path, int get_path_from_env);
 
@@ -26,12 +26,213 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, process_tostring);
   set_table_field(L, "__tostring");
 
+  lua_pushcfunction(L, process_gc);
+  set_table_field(L, "__gc");
+
   lua_pushcfunction(L, process_wait);
   set_table_field(L, "wait");
 
+  lua_pushcfunction(L, process_poll);
+  set_table_field(L, "poll");
+
+  lua_pushcfunction(L, process_communicate);
+  set_table_field(L, "communicate");
+
+  lua_pushcfunction(L, process_fd);
+  set_table_field(L, "fd");
+
+  lua_pushcfunction(L, process_usage);
+  set_table_field(L, "usage");
+
+  lua_pushcfunction(L, process_lines);
+  set_table_field(L, "lines");
+
+  lua_pushcfunction(L, process_kill);
+  set_table_field(L, "kill");
+
+  lua_pushcfunction(L, process_killtree);
+  set_table_field(L, "killtree");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Environment block methods */
+
+  luaL_newmetatable(L, ENVBLOCK_HANDLE);
+
+  lua_pushcfunction(L, envblock_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, envblock_set);
+  set_table_field(L, "set");
+
+  lua_pushcfunction(L, envblock_unset);
+  set_table_field(L, "unset");
+
+  lua_pushcfunction(L, envblock_get);
+  set_table_field(L, "get");
+
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
 
+  /* Spawn template methods */
+
+  luaL_newmetatable(L, TEMPLATE_HANDLE);
+
+  lua_pushcfunction(L, template_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, template_spawn);
+  set_table_field(L, "spawn");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Raw pipe methods */
+
+  luaL_newmetatable(L, FD_HANDLE);
+
+  lua_pushcfunction(L, rawfd_tostring);
+  set_table_field(L, "__tostring");
+
+  lua_pushcfunction(L, rawfd_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, rawfd_read);
+  set_table_field(L, "read");
+
+  lua_pushcfunction(L, rawfd_write);
+  set_table_field(L, "write");
+
+  lua_pushcfunction(L, rawfd_fileno);
+  set_table_field(L, "fileno");
+
+  lua_pushcfunction(L, rawfd_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Poller methods */
+
+  luaL_newmetatable(L, POLLER_HANDLE);
+
+  lua_pushcfunction(L, poller_close);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, poller_add);
+  set_table_field(L, "add");
+
+  lua_pushcfunction(L, poller_remove);
+  set_table_field(L, "remove");
+
+  lua_pushcfunction(L, poller_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, poller_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Loop methods */
+
+  luaL_newmetatable(L, LOOP_HANDLE);
+
+  lua_pushcfunction(L, loop_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, loop_go);
+  set_table_field(L, "go");
+
+  lua_pushcfunction(L, loop_run);
+  set_table_field(L, "run");
+
+  lua_pushcfunction(L, loop_read);
+  set_table_field(L, "read");
+
+  lua_pushcfunction(L, loop_write);
+  set_table_field(L, "write");
+
+  lua_pushcfunction(L, loop_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, loop_communicate);
+  set_table_field(L, "communicate");
+
+  lua_pushcfunction(L, loop_sleep);
+  set_table_field(L, "sleep");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Shared memory channel methods */
+
+  luaL_newmetatable(L, SHMCHANNEL_HANDLE);
+
+  lua_pushcfunction(L, shmchannel_close);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, shmchannel_send);
+  set_table_field(L, "send");
+
+  lua_pushcfunction(L, shmchannel_recv);
+  set_table_field(L, "recv");
+
+  lua_pushcfunction(L, shmchannel_fileno);
+  set_table_field(L, "fileno");
+
+  lua_pushcfunction(L, shmchannel_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Worker methods */
+
+  luaL_newmetatable(L, WORKER_HANDLE);
+
+  lua_pushcfunction(L, worker_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, worker_send);
+  set_table_field(L, "send");
+
+  lua_pushcfunction(L, worker_receive);
+  set_table_field(L, "receive");
+
+  lua_pushcfunction(L, worker_call);
+  set_table_field(L, "call");
+
+  lua_pushcfunction(L, worker_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Fork server methods */
+
+  luaL_newmetatable(L, FORKSERVER_HANDLE);
+
+  lua_pushcfunction(L, forkserver_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, forkserver_spawn);
+  set_table_field(L, "spawn");
+
+  lua_pushcfunction(L, forkserver_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Trace sentinel */
+
+  luaL_newmetatable(L, TRACE_HANDLE);
+
+  lua_pushcfunction(L, trace_gc);
+  set_table_field(L, "__gc");
+
   /* Top module functions */
 
   lua_newtable(L);
@@ -39,6 +240,36 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, lc_pipe);
   set_table_field(L, "pipe");
 
+  lua_pushcfunction(L, lc_splice);
+  set_table_field(L, "splice");
+
+  lua_pushcfunction(L, lc_tee);
+  set_table_field(L, "tee");
+
+  lua_pushcfunction(L, lc_fileno);
+  set_table_field(L, "fileno");
+
+  lua_pushcfunction(L, lc_poller);
+  set_table_field(L, "poller");
+
+  lua_pushcfunction(L, lc_loop);
+  set_table_field(L, "loop");
+
+  lua_pushcfunction(L, lc_shmchannel);
+  set_table_field(L, "shmchannel");
+
+  lua_pushcfunction(L, lc_shmattach);
+  set_table_field(L, "shmattach");
+
+  lua_pushcfunction(L, lc_worker);
+  set_table_field(L, "worker");
+
+  lua_pushcfunction(L, lc_forkserver);
+  set_table_field(L, "forkserver");
+
+  lua_pushcfunction(L, lc_forkserver_serve);
+  set_table_field(L, "forkserver_serve");
+
   lua_pushcfunction(L, lc_setenv);
   set_table_field(L, "setenv");
 
@@ -48,9 +279,48 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, lc_spawn);
   set_table_field(L, "spawn");
 
+  lua_pushcfunction(L, lc_prepare);
+  set_table_field(L, "prepare");
+
   lua_pushcfunction(L, process_wait);
   set_table_field(L, "wait");
 
+  lua_pushcfunction(L, process_poll);
+  set_table_field(L, "poll");
+
+  lua_pushcfunction(L, lc_waitany);
+  set_table_field(L, "waitany");
+
+  lua_pushcfunction(L, lc_waitall);
+  set_table_field(L, "waitall");
+
+  lua_pushcfunction(L, lc_pool);
+  set_table_field(L, "pool");
+
+  lua_pushcfunction(L, lc_pipeline);
+  set_table_field(L, "pipeline");
+
+  lua_pushcfunction(L, lc_clock);
+  set_table_field(L, "clock");
+
+  lua_pushcfunction(L, lc_envblock);
+  set_table_field(L, "envblock");
+
+  lua_pushcfunction(L, lc_stats);
+  set_table_field(L, "stats");
+
+  lua_pushcfunction(L, lc_stats_reset);
+  set_table_field(L, "stats_reset");
+
+  lua_pushcfunction(L, lc_trace_start);
+  set_table_field(L, "trace_start");
+
+  lua_pushcfunction(L, lc_trace_stop);
+  set_table_field(L, "trace_stop");
+
+  lua_pushstring(L, spawn_backend);
+  set_table_field(L, "spawn_backend");
+
   return 1;
 }
 
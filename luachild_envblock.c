@@ -0,0 +1,232 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luachild.h"
+
+/* A native environment, kept ready to be passed to the spawn functions, so
+ * that the conversion from a lua table is done once and not at each spawn.
+ */
+struct envblock {
+  char **vars;                  /* null terminated "name=value" strings */
+  size_t n, cap;
+  char *block;                  /* windows style environment, on demand */
+};
+
+struct envblock *check_envblock(lua_State *L, int idx)
+{
+  return luaL_checkudata(L, idx, ENVBLOCK_HANDLE);
+}
+
+const char **envblock_vector(struct envblock *e)
+{
+  return (const char **)e->vars;
+}
+
+/* "name=value\0name=value\0\0" */
+const char *envblock_string(struct envblock *e)
+{
+  if (!e->block) {
+    size_t i, len = 1;
+    char *t;
+    for (i = 0; i < e->n; i++)
+      len += strlen(e->vars[i]) + 1;
+    if (!(t = e->block = malloc(len + 1))) return 0;
+    for (i = 0; i < e->n; i++) {
+      size_t l = strlen(e->vars[i]) + 1;
+      memcpy(t, e->vars[i], l);
+      t += l;
+    }
+    t[0] = t[1] = '\0';
+  }
+  return e->block;
+}
+
+static int envblock_find(struct envblock *e, const char *name, size_t len)
+{
+  size_t i;
+  for (i = 0; i < e->n; i++)
+    if (!strncmp(e->vars[i], name, len) && e->vars[i][len] == '=')
+      return i;
+  return -1;
+}
+
+static void envblock_put(lua_State *L, struct envblock *e,
+                         const char *name, size_t nlen,
+                         const char *val, size_t vlen)
+{
+  int i = envblock_find(e, name, nlen);
+  char *s = malloc(nlen + vlen + 2);
+  if (!s) {
+    luaL_error(L, "not enough memory");
+    return;
+  }
+  memcpy(s, name, nlen);
+  s[nlen] = '=';
+  memcpy(s + nlen + 1, val, vlen);
+  s[nlen + vlen + 1] = '\0';
+  if (i >= 0) {
+    free(e->vars[i]);
+    e->vars[i] = s;
+  } else {
+    if (e->n == e->cap) {
+      char **vars = realloc(e->vars, (2 * e->cap + 1) * sizeof *vars);
+      if (!vars) {
+        free(s);
+        luaL_error(L, "not enough memory");
+        return;
+      }
+      e->vars = vars;
+      e->cap *= 2;
+    }
+    e->vars[e->n++] = s;
+    e->vars[e->n] = 0;
+  }
+  free(e->block);
+  e->block = 0;
+}
+
+static void envblock_remove(struct envblock *e, const char *name, size_t nlen)
+{
+  int i = envblock_find(e, name, nlen);
+  if (i < 0) return;
+  free(e->vars[i]);
+  e->vars[i] = e->vars[--e->n];
+  e->vars[e->n] = 0;
+  free(e->block);
+  e->block = 0;
+}
+
+static const char *check_name(lua_State *L, int idx, size_t *len)
+{
+  const char *name = luaL_checklstring(L, idx, len);
+  luaL_argcheck(L, *len > 0 && !strchr(name, '='), idx,
+                "invalid environment variable name");
+  return name;
+}
+
+/* [envtab] -- envblock */
+int lc_envblock(lua_State *L)
+{
+  struct envblock *e;
+  if (lua_isnoneornil(L, 1)) {
+    lua_settop(L, 0);
+    lc_environ(L);
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);
+  e = lua_newuserdata(L, sizeof *e);
+  e->n = 0;
+  e->cap = 16;
+  e->block = 0;
+  e->vars = 0;
+  luaL_getmetatable(L, ENVBLOCK_HANDLE);
+  lua_setmetatable(L, -2);
+  e->vars = malloc((e->cap + 1) * sizeof *e->vars);
+  if (!e->vars) return luaL_error(L, "not enough memory");
+  e->vars[0] = 0;
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    size_t nlen, vlen;
+    const char *name, *val;
+    if (lua_type(L, -2) != LUA_TSTRING)
+      return luaL_error(L, "expected string for environment variable name, got %s",
+                        luaL_typename(L, -2));
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "expected string for environment variable value, got %s",
+                        luaL_typename(L, -1));
+    name = lua_tolstring(L, -2, &nlen);
+    val = lua_tolstring(L, -1, &vlen);
+    envblock_put(L, e, name, nlen, val, vlen);
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+/* envblock name value -- true
+ * envblock name nil -- true */
+int envblock_set(lua_State *L)
+{
+  struct envblock *e = check_envblock(L, 1);
+  size_t nlen, vlen;
+  const char *name = check_name(L, 2, &nlen);
+  const char *val = lua_tolstring(L, 3, &vlen);
+  if (val) envblock_put(L, e, name, nlen, val, vlen);
+  else envblock_remove(e, name, nlen);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* envblock name -- true */
+int envblock_unset(lua_State *L)
+{
+  lua_settop(L, 2);
+  lua_pushnil(L);
+  return envblock_set(L);
+}
+
+/* envblock name -- value/nil */
+int envblock_get(lua_State *L)
+{
+  struct envblock *e = check_envblock(L, 1);
+  size_t nlen;
+  const char *name = check_name(L, 2, &nlen);
+  int i = envblock_find(e, name, nlen);
+  if (i < 0) lua_pushnil(L);
+  else lua_pushstring(L, e->vars[i] + nlen + 1);
+  return 1;
+}
+
+/* Each state has its own environment for the children, so that lc.setenv
+ * does not change the one of the process, that other threads may be reading.
+ * It is a copy of the process environment made at the first lc.setenv, kept
+ * in the registry. Returns null, if create is false, while the state still
+ * uses the process environment.
+ */
+#define STATE_ENVIRON "luachild.environ"
+
+struct envblock *state_envblock(lua_State *L, int create)
+{
+  struct envblock *e;
+  lua_getfield(L, LUA_REGISTRYINDEX, STATE_ENVIRON);
+  e = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (e || !create) return e;
+  lua_pushcfunction(L, lc_envblock);
+  lua_call(L, 0, 1);                    /* envblock */
+  e = lua_touserdata(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, STATE_ENVIRON);
+  return e;
+}
+
+/* name value -- true
+ * name nil -- true */
+int lc_setenv(lua_State *L)
+{
+  size_t nlen, vlen;
+  const char *name = check_name(L, 1, &nlen);
+  const char *val = lua_tolstring(L, 2, &vlen);
+  struct envblock *e = state_envblock(L, 1);
+  if (val) envblock_put(L, e, name, nlen, val, vlen);
+  else envblock_remove(e, name, nlen);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* envblock -- */
+int envblock_gc(lua_State *L)
+{
+  struct envblock *e = check_envblock(L, 1);
+  size_t i;
+  for (i = 0; i < e->n; i++)
+    free(e->vars[i]);
+  free(e->vars);
+  free(e->block);
+  e->vars = 0;
+  e->block = 0;
+  e->n = 0;
+  return 0;
+}
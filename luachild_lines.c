@@ -0,0 +1,123 @@
+
+#include <string.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luachild.h"
+
+#define LINES_CHUNK 65536
+
+/* The state of an iterator of process:lines. The data read but not yet
+ * returned is buf[off] to buf[len - 1]. The buffer is the userdatum in the
+ * third upvalue, replaced by a larger one when a line does not fit.
+ */
+struct lines {
+  size_t off, len, cap;
+  int stream;
+  int batch;                /* 0 for a line at time */
+  int eof;
+};
+
+/* Reads a chunk after the pending data, moved to the start of the buffer */
+static void lines_fill(lua_State *L, struct lines *s)
+{
+  char *buf = lua_touserdata(L, lua_upvalueindex(3));
+  long n;
+  if (s->off > 0) {
+    memmove(buf, buf + s->off, s->len - s->off);
+    s->len -= s->off;
+    s->off = 0;
+  }
+  if (s->len == s->cap) {
+    char *larger = lua_newuserdata(L, 2 * s->cap);
+    memcpy(larger, buf, s->len);
+    lua_replace(L, lua_upvalueindex(3));
+    buf = larger;
+    s->cap *= 2;
+  }
+  n = process_read(L, lua_upvalueindex(1), s->stream, buf + s->len,
+                   s->cap - s->len);
+  if (n == 0) s->eof = 1;
+  else s->len += n;
+}
+
+/* Pushes the next line, without the newline. If wait is false, it does not
+ * read more data to find it. Returns 0 if there is no line.
+ */
+/* -- line/ */
+static int lines_next(lua_State *L, struct lines *s, int wait)
+{
+  for (;;) {
+    const char *buf = lua_touserdata(L, lua_upvalueindex(3));
+    const char *nl = memchr(buf + s->off, '\n', s->len - s->off);
+    if (nl) {
+      lua_pushlstring(L, buf + s->off, nl - (buf + s->off));
+      s->off = nl - buf + 1;
+      return 1;
+    }
+    if (s->eof) {
+      if (s->off == s->len) return 0;
+      lua_pushlstring(L, buf + s->off, s->len - s->off);
+      s->off = s->len;
+      return 1;
+    }
+    if (!wait) return 0;
+    lines_fill(L, s);
+  }
+}
+
+/* A batch waits only for its first line, then takes the lines already read,
+ * so that a slow writer does not delay them.
+ */
+/* -- line/lines/nil */
+static int lines_iter(lua_State *L)
+{
+  struct lines *s = lua_touserdata(L, lua_upvalueindex(2));
+  int n = 0;
+  if (!s->batch) {
+    if (!lines_next(L, s, 1)) lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, s->batch, 0);
+  while (n < s->batch && lines_next(L, s, n == 0))
+    lua_rawseti(L, -2, ++n);
+  if (n == 0) lua_pushnil(L);
+  return 1;
+}
+
+/* proc [{stream=name, batch=n}] -- iterator */
+int process_lines(lua_State *L)
+{
+  const char *stream = "stdout";
+  struct lines *s;
+  int batch = 0, which;
+  luaL_checkudata(L, 1, PROCESS_HANDLE);
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "stream");
+    if (!lua_isnil(L, -1)) stream = lua_tostring(L, -1);
+    lua_getfield(L, 2, "batch");
+    if (!lua_isnil(L, -1)) {
+      batch = (int)lua_tonumber(L, -1);
+      if (batch < 1)
+        return luaL_error(L, "bad batch option (positive number expected)");
+    }
+  }
+  if (!stream || (strcmp(stream, "stdout") && strcmp(stream, "stderr")))
+    return luaL_error(L, "bad stream option ('stdout' or 'stderr' expected)");
+  which = stream[3] == 'o' ? 1 : 2;
+  if (!process_captured(L, 1, which))
+    return luaL_error(L, "%s is not captured", stream);
+  lua_settop(L, 1);                     /* proc */
+  s = lua_newuserdata(L, sizeof *s);    /* proc state */
+  s->off = s->len = 0;
+  s->cap = LINES_CHUNK;
+  s->stream = which;
+  s->batch = batch;
+  s->eof = 0;
+  lua_newuserdata(L, LINES_CHUNK);      /* proc state buf */
+  lua_pushcclosure(L, lines_iter, 3);   /* iterator */
+  return 1;
+}
@@ -18,6 +18,10 @@ size_t lua_value_length(lua_State *L, int index) {
   return lua_rawlen(L, index);
 }
 
+int lua_resume_thread(lua_State *co, lua_State *from, int nargs) {
+  return lua_resume(co, from, nargs);
+}
+
 static int file_close(lua_State *L) {
   int result = 1;
   FILE **p = (FILE **)luaL_checkudata(L, 1, LUA_FILEHANDLE);
@@ -18,36 +18,50 @@ size_t lua_value_length(lua_State *L, int index) {
   return lua_objlen(L, index);
 }
 
-static int (*lua_open_func)(lua_State *L) = 0;
-static char * temp_file_path = 0;
+int lua_resume_thread(lua_State *co, lua_State *from, int nargs) {
+  return lua_resume(co, nargs);
+}
+
+/* io.open and the path of a file to open, to make file handles. They are
+ * kept in the registry, so that each state has its own.
+ */
+#define IO_OPEN_KEY "luachild.io_open"
+#define NULL_PATH_KEY "luachild.null_path"
 
 int file_handler_creator(lua_State *L, const char * file_path, int get_path_from_env){
+  int ready;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, IO_OPEN_KEY);
+  lua_getfield(L, LUA_REGISTRYINDEX, NULL_PATH_KEY);
+  ready = lua_tocfunction(L, -2) && lua_isstring(L, -1);
+  lua_pop(L, 2);
 
   if (!file_path)
-    return !lua_open_func || !temp_file_path;
+    return !ready;
+  if (ready)
+    return 1;
 
-  if (!lua_open_func) {
-    lua_getglobal(L, "io");
-    lua_getfield(L, -1, "open");
-    lua_open_func = lua_tocfunction(L, -1);
+  lua_getglobal(L, "io");
+  lua_getfield(L, -1, "open");
+  if (!lua_tocfunction(L, -1)) {
     lua_pop(L, 2);
-    if (!lua_open_func) return 0;
+    return 0;
   }
+  lua_setfield(L, LUA_REGISTRYINDEX, IO_OPEN_KEY);
+  lua_pop(L, 1);
 
-  if (!temp_file_path) {
-    if (get_path_from_env)
-      temp_file_path = strdup(getenv(file_path));
-    else
-      temp_file_path = strdup(file_path);
-    if (!temp_file_path) return 0;
-  }
+  if (get_path_from_env)
+    file_path = getenv(file_path);
+  if (!file_path) return 0;
+  lua_pushstring(L, file_path);
+  lua_setfield(L, LUA_REGISTRYINDEX, NULL_PATH_KEY);
 
   return 1;
 }
 
 static int push_null_file_handler(lua_State *L){
-  lua_pushcfunction(L, lua_open_func);
-  lua_pushstring(L, temp_file_path);
+  lua_getfield(L, LUA_REGISTRYINDEX, IO_OPEN_KEY);
+  lua_getfield(L, LUA_REGISTRYINDEX, NULL_PATH_KEY);
   lua_pushstring(L, "r");
   lua_call(L, 2, LUA_MULTRET);
 
@@ -0,0 +1,106 @@
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luachild.h"
+
+/* Runs a spawn spec with lc_spawn, or a template prepared by lc_prepare, in
+ * protected mode so that a bad spec does not stop the pool.
+ */
+/* spec/template -- proc/nil error */
+static int pool_spawn(lua_State *L)
+{
+  if (lua_type(L, -1) == LUA_TUSERDATA)
+    lua_pushcfunction(L, template_spawn);
+  else
+    lua_pushcfunction(L, lc_spawn);
+  lua_insert(L, -2);
+  if (lua_pcall(L, 1, 2, 0)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+  }
+  return 2;
+}
+
+/* Removes the i-th of the n elements of the array at index t, moving the last
+ * one in its place.
+ */
+static void array_swap_remove(lua_State *L, int t, int i, int n)
+{
+  lua_rawgeti(L, t, n);
+  lua_rawseti(L, t, i);
+  lua_pushnil(L);
+  lua_rawseti(L, t, n);
+}
+
+/* {jobs=specs, max=n} -- results/nil error */
+int lc_pool(lua_State *L)
+{
+  int njobs, max, next, running = 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "jobs");           /* opts jobs */
+  if (!lua_istable(L, 2))
+    return luaL_error(L, "bad jobs option (table expected, got %s)",
+                      luaL_typename(L, 2));
+  lua_getfield(L, 1, "max");            /* opts jobs max */
+  max = lua_isnil(L, 3) ? cpu_count() : (int)lua_tonumber(L, 3);
+  if (max < 1)
+    return luaL_error(L, "bad max option (positive number expected)");
+  njobs = lua_value_length(L, 2);
+  lua_createtable(L, njobs, 0);         /* opts jobs max results */
+  lua_newtable(L);                      /* opts jobs max results procs */
+  lua_newtable(L);                      /* opts jobs max results procs idxs */
+  for (next = 1; next <= njobs || running > 0;) {
+    int i, job;
+    while (running < max && next <= njobs) {
+      lua_rawgeti(L, 2, next);          /* ... spec */
+      pool_spawn(L);                    /* ... proc/nil error */
+      if (lua_isnil(L, -2)) {
+        lua_createtable(L, 0, 1);       /* ... nil error res */
+        lua_insert(L, -2);              /* ... nil res error */
+        lua_setfield(L, -2, "error");   /* ... nil res */
+        lua_rawseti(L, 4, next);        /* ... nil */
+        lua_pop(L, 1);
+      } else {
+        lua_pop(L, 1);                  /* ... proc */
+        running++;
+        lua_rawseti(L, 5, running);
+        lua_pushnumber(L, next);
+        lua_rawseti(L, 6, running);
+      }
+      next++;
+    }
+    if (!running) continue;
+    lua_pushcfunction(L, lc_waitany);
+    lua_pushvalue(L, 5);
+    lua_call(L, 1, 3);                  /* ... proc exitcode i/nil error */
+    if (lua_isnil(L, -3)) {
+      lua_pop(L, 1);
+      return 2;
+    }
+    i = lua_tonumber(L, -1);
+    lua_rawgeti(L, 6, i);
+    job = lua_tonumber(L, -1);
+    lua_createtable(L, 0, 4);           /* ... proc exitcode i job res */
+    lua_pushvalue(L, -5);
+    lua_setfield(L, -2, "process");
+    lua_pushvalue(L, -4);
+    lua_setfield(L, -2, "exitcode");
+    /* the time is the one of the exit, not of this loop noticing it */
+    lua_pushcfunction(L, process_usage);
+    lua_pushvalue(L, -6);
+    lua_call(L, 1, 1);                  /* ... res usage */
+    lua_getfield(L, -1, "wall");
+    lua_setfield(L, -3, "time");
+    lua_setfield(L, -2, "usage");
+    lua_rawseti(L, 4, job);
+    lua_pop(L, 4);
+    array_swap_remove(L, 5, i, running);
+    array_swap_remove(L, 6, i, running);
+    running--;
+  }
+  lua_pushvalue(L, 4);
+  return 1;
+}
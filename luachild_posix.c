@@ -27,6 +27,10 @@ THE SOFTWARE.
 
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* posix_spawn_file_actions_addclosefrom_np */
+#endif
+
 #include "luachild.h"
 #ifdef USE_POSIX
 
@@ -34,9 +38,33 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+#endif
 
 #include "lua.h"
 #include "lualib.h"
@@ -73,16 +101,11 @@ extern int push_error(lua_State *L)
 
 /* ----------------------------------------------------------------------------- */
 
-/* name value -- true/nil error
- * name nil -- true/nil error */
-int lc_setenv(lua_State *L)
+/* The environment of the children of this state, see state_envblock */
+static const char **state_environ(lua_State *L)
 {
-  const char *nam = luaL_checkstring(L, 1);
-  const char *val = lua_tostring(L, 2);
-  int err = val ? setenv(nam, val, 1) : unsetenv(nam);
-  if (err == -1) return push_error(L);
-  lua_pushboolean(L, 1);
-  return 1;
+  struct envblock *e = state_envblock(L, 0);
+  return e ? envblock_vector(e) : (const char **)environ;
 }
 
 /* -- environment-table */
@@ -91,7 +114,7 @@ int lc_environ(lua_State *L)
   const char *nam, *val, *end;
   const char **env;
   lua_newtable(L);
-  for (env = (const char **)environ; (nam = *env); env++) {
+  for (env = state_environ(L); (nam = *env); env++) {
     end = strchr(val = strchr(nam, '=') + 1, '\0');
     lua_pushlstring(L, nam, val - nam - 1);
     lua_pushlstring(L, val, end - val);
@@ -108,41 +131,295 @@ static int closeonexec(int d)
   return fl;
 }
 
+/* A pipe with both sides closed on exec. pipe2 sets the flag atomically, so
+ * that a spawn from another thread does not inherit the pipe.
+ */
+static int cloexec_pipe(int fd[2])
+{
+#ifdef __linux__
+  return pipe2(fd, O_CLOEXEC);
+#else
+  if (-1 == pipe(fd)) return -1;
+  closeonexec(fd[0]);
+  closeonexec(fd[1]);
+  return 0;
+#endif
+}
+
+/* A pipe side without the stdio buffering, see lc_pipe */
+struct rawfd {
+  int fd;
+  char *buf;
+  size_t cap;
+};
+
+/* -- rawfd */
+static struct rawfd *rawfd_new(lua_State *L, int fd)
+{
+  struct rawfd *f = lua_newuserdata(L, sizeof *f);
+  f->fd = fd;
+  f->buf = 0;
+  f->cap = 0;
+  luaL_getmetatable(L, FD_HANDLE);
+  lua_setmetatable(L, -2);
+  return f;
+}
+
+static struct rawfd *check_rawfd(lua_State *L, int idx)
+{
+  struct rawfd *f = luaL_checkudata(L, idx, FD_HANDLE);
+  if (f->fd < 0) return luaL_error(L, "attempt to use a closed fd"), NULL;
+  return f;
+}
+
+/* Returns the rawfd at index idx, or null if it is something else. */
+static struct rawfd *to_rawfd(lua_State *L, int idx)
+{
+  struct rawfd *f = lua_touserdata(L, idx);
+  idx = absindex(L, idx);
+  if (!f || !lua_getmetatable(L, idx)) return 0;
+  luaL_getmetatable(L, FD_HANDLE);
+  if (!lua_rawequal(L, -1, -2)) f = 0;
+  lua_pop(L, 2);
+  return f;
+}
+
 /* -- in out/nil error */
+/* {raw=bool, nonblock=bool} -- in out/nil error */
 int lc_pipe(lua_State *L)
 {
-  if (!file_handler_creator(L, "/dev/null", 0)) return 0;
-  int fd[2];
-  if (-1 == pipe(fd))
+  int fd[2], raw = 0, nonblock = 0, ret;
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "raw");
+    raw = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "nonblock");
+    nonblock = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  if (!raw && !file_handler_creator(L, "/dev/null", 0)) return 0;
+  stats_pipe(-1 != (ret = cloexec_pipe(fd)));
+  if (-1 == ret)
     return push_error(L);
-  closeonexec(fd[0]);
-  closeonexec(fd[1]);
+  if (raw) {
+    if (nonblock) {
+      fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+      fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+    }
+    rawfd_new(L, fd[0]);
+    rawfd_new(L, fd[1]);
+    return 2;
+  }
   lua_pushcfile(L, fdopen(fd[0], "r"));
   lua_pushcfile(L, fdopen(fd[1], "w"));
   return 2;
 }
 
+/* The buffer of the handle is reused by all the reads, so only the lua
+ * string is allocated.
+ */
+/* rawfd [n] -- data/nil [error] */
+int rawfd_read(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  lua_Integer size = luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
+  size_t n;
+  ssize_t r;
+  luaL_argcheck(L, size > 0, 2, "positive size expected");
+  n = (size_t)size;
+  if (n > f->cap) {
+    char *buf = realloc(f->buf, n);
+    if (!buf) return luaL_error(L, "not enough memory");
+    f->buf = buf;
+    f->cap = n;
+  }
+  do r = read(f->fd, f->buf, n);
+  while (r == -1 && errno == EINTR);
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
+  if (r == -1) return push_error(L);
+  if (r == 0) return lua_pushnil(L), 1;
+  lua_pushlstring(L, f->buf, r);
+  return 1;
+}
+
+/* rawfd data -- n/nil error */
+int rawfd_write(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  size_t len, done = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+  while (done < len) {
+    ssize_t w = write(f->fd, data + done, len - done);
+    if (w == -1 && errno == EINTR) continue;
+    if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* non blocking: report what was written */
+      if (done > 0) break;
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
+    }
+    if (w == -1) return push_error(L);
+    done += w;
+  }
+  lua_pushnumber(L, done);
+  return 1;
+}
+
+/* rawfd -- fd */
+int rawfd_fileno(lua_State *L)
+{
+  lua_pushnumber(L, check_rawfd(L, 1)->fd);
+  return 1;
+}
+
+/* rawfd -- true */
+int rawfd_close(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  close(f->fd);
+  f->fd = -1;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* rawfd -- */
+int rawfd_gc(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (f->fd >= 0) close(f->fd);
+  f->fd = -1;
+  free(f->buf);
+  f->buf = 0;
+  f->cap = 0;
+  return 0;
+}
+
+/* rawfd -- str */
+int rawfd_tostring(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (f->fd < 0) lua_pushliteral(L, "fd (closed)");
+  else lua_pushfstring(L, "fd (%d)", f->fd);
+  return 1;
+}
+
 /* ----------------------------------------------------------------------------- */
 
 #ifndef INTERNAL_SPAWN_API
 #include <spawn.h>
+
+/* glibc and musl already implement posix_spawn with clone(CLONE_VM|CLONE_VFORK) */
+const char spawn_backend[] = "posix_spawn";
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_SPAWN_CLOSEFROM
+#endif
+
 #else
 
-typedef void *posix_spawnattr_t;
+#ifdef USE_VFORK
+const char spawn_backend[] = "vfork";
+#else
+const char spawn_backend[] = "fork";
+#endif
 
-typedef struct posix_spawn_file_actions posix_spawn_file_actions_t;
-struct posix_spawn_file_actions {
-  int dups[3];
+#define HAVE_SPAWN_CLOSEFROM
+
+#endif // INTERNAL_SPAWN_API
+
+/* The internal spawner: it forks (or vforks, with USE_VFORK), does the file
+ * actions and the setup of the child, then execs. It replaces posix_spawn
+ * with INTERNAL_SPAWN_API, and it is used anyway for the spawns with a setup
+ * that posix_spawn can not do, like the resource limits.
+ */
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+#define CHILD_MAX_LIMITS 16
+
+#define PGROUP_NEW 1
+#define PGROUP_SESSION 2
+
+/* Process attributes set in the child before the exec */
+struct child_setup {
+  int pgroup;           /* PGROUP_NEW, PGROUP_SESSION, or 0 */
+  const char *cgroup;   /* path of the cgroup.procs file to join */
+  int set_nice, nice;
+  int ioprio;           /* -1 to keep the one of the parent */
+  int nlimits;
+  struct {
+    int resource;
+    struct rlimit value;
+  } limits[CHILD_MAX_LIMITS];
+#ifdef __linux__
+  int set_cpus;
+  cpu_set_t cpus;
+#endif
+};
+
+static void child_setup_init(struct child_setup *s)
+{
+  s->pgroup = 0;
+  s->cgroup = 0;
+  s->set_nice = s->nice = 0;
+  s->ioprio = -1;
+  s->nlimits = 0;
+#ifdef __linux__
+  s->set_cpus = 0;
+  CPU_ZERO(&s->cpus);
+#endif
+}
+
+/* dup2 fd to newfd, or close newfd if fd is -1 */
+struct child_action {
+  int fd, newfd;
 };
 
-static int posix_spawn_file_actions_destroy(
-  posix_spawn_file_actions_t *act)
+typedef struct child_actions child_actions_t;
+struct child_actions {
+  struct child_action *ops;
+  int n, size;
+  int closefrom;
+};
+
+static int child_actions_destroy(
+  child_actions_t *act)
+{
+  free(act->ops);
+  act->ops = 0;
+  act->n = act->size = 0;
+  return 0;
+}
+
+static int child_actions_add(
+  child_actions_t *act,
+  int fd,
+  int newfd)
 {
+  if (act->n == act->size) {
+    int size = act->size ? 2 * act->size : 8;
+    struct child_action *ops = realloc(act->ops, size * sizeof *ops);
+    if (!ops) {
+      errno = ENOMEM;
+      return -1;
+    }
+    act->ops = ops;
+    act->size = size;
+  }
+  act->ops[act->n].fd = fd;
+  act->ops[act->n].newfd = newfd;
+  act->n++;
   return 0;
 }
 
-static int posix_spawn_file_actions_adddup2(
-  posix_spawn_file_actions_t *act,
+static int child_actions_adddup2(
+  child_actions_t *act,
   int d,
   int n)
 {
@@ -151,185 +428,1722 @@ static int posix_spawn_file_actions_adddup2(
     errno = EBADF;
     return -1;
   }
-  /* we only support duplication to 0,1,2 */
-  if (2 < n) {
-    errno = EINVAL;
+  return child_actions_add(act, d, n);
+}
+
+static int child_actions_addclose(
+  child_actions_t *act,
+  int n)
+{
+  if (n < 0 || OPEN_MAX < n) {
+    errno = EBADF;
     return -1;
   }
-  act->dups[n] = d;
+  return child_actions_add(act, -1, n);
+}
+
+static int child_actions_addclosefrom(
+  child_actions_t *act,
+  int from)
+{
+  act->closefrom = from;
   return 0;
 }
 
-static int posix_spawn_file_actions_init(
-  posix_spawn_file_actions_t *act)
+static int child_actions_init(
+  child_actions_t *act)
+{
+  act->ops = 0;
+  act->n = act->size = 0;
+  act->closefrom = -1;
+  return 0;
+}
+
+#ifndef USE_VFORK
+/* The highest descriptor the actions refer to */
+static int child_actions_top(const child_actions_t *act)
+{
+  int i, top = act->closefrom;
+  for (i = 0; i < act->n; i++) {
+    if (act->ops[i].fd > top) top = act->ops[i].fd;
+    if (act->ops[i].newfd > top) top = act->ops[i].newfd;
+  }
+  return top;
+}
+#endif
+
+/* Only async-signal-safe calls are allowed from here to child_spawnp, since
+ * with vfork the child shares the memory of the parent until the exec.
+ */
+static void spawn_child_close_range(int from, unsigned last, long max)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+  if (0 == syscall(SYS_close_range, from, last, 0)) return;
+#endif
+  for (; (unsigned)from <= last && from < max; from++) close(from);
+}
+
+/* Closes the descriptors from the given one on, but keep. */
+static void spawn_child_closefrom(int from, long max, int keep)
+{
+  if (keep >= from) {
+    if (keep > from) spawn_child_close_range(from, keep - 1, max);
+    from = keep + 1;
+  }
+  spawn_child_close_range(from, ~0U, max);
+}
+
+/* Leaves the process group first, so that a kill of the new group can not
+ * miss the child, then joins the cgroup, so that the limits of the cgroup
+ * cover all the life of the child, then sets the other attributes. Returns
+ * -1 on error.
+ */
+static int spawn_child_setup(const struct child_setup *s)
 {
-  act->dups[0] = act->dups[1] = act->dups[2] = -1;
+  int i;
+  if (s->pgroup == PGROUP_SESSION && -1 == setsid())
+    return -1;
+  if (s->pgroup == PGROUP_NEW && -1 == setpgid(0, 0))
+    return -1;
+  if (s->cgroup) {
+    int fd = open(s->cgroup, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    if (1 != write(fd, "0", 1)) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    close(fd);
+  }
+  for (i = 0; i < s->nlimits; i++)
+    if (-1 == setrlimit(s->limits[i].resource, &s->limits[i].value))
+      return -1;
+  if (s->set_nice && -1 == setpriority(PRIO_PROCESS, 0, s->nice))
+    return -1;
+#ifdef __linux__
+  if (s->ioprio >= 0
+      && -1 == syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, s->ioprio))
+    return -1;
+  if (s->set_cpus && -1 == sched_setaffinity(0, sizeof s->cpus, &s->cpus))
+    return -1;
+#endif
   return 0;
 }
 
-static int posix_spawnp(
+/* The child side of child_spawnp: it returns only on failure, with the errno
+ * value. keep is a descriptor that closefrom must not close.
+ */
+static int spawn_child_run(const char *path, const child_actions_t *act,
+                           const struct child_setup *setup,
+                           char *const argv[], char *const envp[],
+                           long max, int keep)
+{
+  if (setup && -1 == spawn_child_setup(setup))
+    return errno;
+  if (act) {
+    int i;
+    for (i = 0; i < act->n; i++) {
+      const struct child_action *a = &act->ops[i];
+      if (a->fd == -1)
+        close(a->newfd);
+      else if (-1 == dup2(a->fd, a->newfd))
+        return errno;
+    }
+    if (act->closefrom >= 0)
+      spawn_child_closefrom(act->closefrom, max, keep);
+  }
+  execve(path, argv, envp);
+  return errno;
+}
+
+/* Like posix_spawnp, with the setup in place of the attributes. A failure of
+ * the setup or of the exec is reported like posix_spawn does. The PATH is not
+ * searched: path is the file found by resolve_command, since the PATH of the
+ * children may not be the one of this process.
+ */
+static int child_spawnp(
   pid_t *restrict ppid,
   const char *restrict path,
-  const posix_spawn_file_actions_t *act,
-  const posix_spawnattr_t *restrict attrp,
+  const child_actions_t *act,
+  const struct child_setup *setup,
   char *const argv[restrict],
   char *const envp[restrict])
 {
+  long max = OPEN_MAX;
+  volatile int err = 0;
+#ifndef USE_VFORK
+  int report[2], e;
+  ssize_t n;
+#endif
   if (!ppid || !path || !argv || !envp)
     return EINVAL;
-  if (attrp)
-    return EINVAL;
-  switch (*ppid = fork()) {
-  case -1: return -1;
-  default: return 0;
-  case 0:
-    if (act) {
-      int i;
-      for (i = 0; i < 3; i++)
-        if (act->dups[i] != -1 && -1 == dup2(act->dups[i], i))
-          _exit(111);
-    }
-    environ = (char **)envp;
-    execvp(path, argv);
+#ifdef USE_VFORK
+  /* the child reports here the reason of a failure */
+  *ppid = vfork();
+  if (*ppid == 0) {
+    err = spawn_child_run(path, act, setup, argv, envp, max, -1);
+    _exit(111);
+  }
+  if (*ppid == -1) return -1;
+#else
+  /* the child reports the reason of a failure on a pipe closed by the exec */
+  if (-1 == cloexec_pipe(report)) return -1;
+  /* the actions must not overwrite the reporting side */
+  if (act && report[1] <= child_actions_top(act)) {
+    e = fcntl(report[1], F_DUPFD_CLOEXEC, child_actions_top(act) + 1);
+    if (e == -1) {
+      e = errno;
+      close(report[0]);
+      close(report[1]);
+      errno = e;
+      return -1;
+    }
+    close(report[1]);
+    report[1] = e;
+  }
+  *ppid = fork();
+  if (*ppid == 0) {
+    e = spawn_child_run(path, act, setup, argv, envp, max, report[1]);
+    if (write(report[1], &e, sizeof e)) {}
     _exit(111);
-    /*NOTREACHED*/
   }
+  e = errno;
+  close(report[1]);
+  if (*ppid == -1) {
+    close(report[0]);
+    errno = e;
+    return -1;
+  }
+  while (-1 == (n = read(report[0], &e, sizeof e)) && errno == EINTR);
+  close(report[0]);
+  if (n == sizeof e) err = e;
+#endif
+  if (err) {
+    waitpid(*ppid, 0, 0);
+    return err;
+  }
+  return 0;
 }
 
+#ifdef INTERNAL_SPAWN_API
+
+typedef void *posix_spawnattr_t;
+typedef child_actions_t posix_spawn_file_actions_t;
+
+#define posix_spawn_file_actions_init child_actions_init
+#define posix_spawn_file_actions_destroy child_actions_destroy
+#define posix_spawn_file_actions_adddup2 child_actions_adddup2
+#define posix_spawn_file_actions_addclose child_actions_addclose
+#define posix_spawn_file_actions_addclosefrom_np child_actions_addclosefrom
+#define posix_spawnp(ppid, path, act, attrp, argv, envp) \
+  ((attrp) ? EINVAL : child_spawnp(ppid, path, act, 0, argv, envp))
+
 #endif // INTERNAL_SPAWN_API
 
 struct process {
   int status;
   pid_t pid;
+  int pidfd;
+  int pipes[3];
+  double start, end;
+  struct rusage usage;
+  struct forkserver *server;  /* the fork server that started it, if any */
+  int server_ref;
+  double deadline;            /* when it is killed, 0 for never */
+  int group;                  /* it leads its own process group */
+  int timedout;               /* it was killed at the deadline */
+  int reported;               /* it was returned by waitany */
 };
 
-/* proc -- exitcode/nil error */
-int process_wait(lua_State *L)
+#define PIDFD_NONE (-1)
+#define PIDFD_UNSUPPORTED (-2)
+
+static void process_close_pidfd(struct process *p)
 {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  if (p->status == -1) {
-    int status;
-    if (-1 == waitpid(p->pid, &status, 0))
-      return push_error(L);
-    p->status = WEXITSTATUS(status);
+  if (p->pidfd >= 0) close(p->pidfd);
+  p->pidfd = PIDFD_NONE;
+}
+
+/* Returns a descriptor that becomes readable when the process exits, or -1
+ * when the system does not support it (only linux >= 5.3 does).
+ */
+static int process_pidfd(struct process *p)
+{
+#ifdef __linux__
+  if (p->pidfd == PIDFD_NONE && p->status == -1) {
+    int fd = syscall(SYS_pidfd_open, p->pid, 0);
+    p->pidfd = fd >= 0 ? fd : PIDFD_UNSUPPORTED;
   }
-  lua_pushnumber(L, p->status);
-  return 1;
+  return p->pidfd >= 0 ? p->pidfd : -1;
+#else
+  return -1;
+#endif
 }
 
-/* proc -- string */
-int process_tostring(lua_State *L)
+#ifdef __linux__
+/* Reads the parent of pid from /proc, or returns -1 */
+static pid_t proc_parent(pid_t pid)
 {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  char buf[40];
-  lua_pushlstring(L, buf,
-    sprintf(buf, "process (%lu, %s)", (unsigned long)p->pid,
-      p->status==-1 ? "running" : "terminated"));
-  return 1;
+  char path[32], buf[512], *s;
+  ssize_t n;
+  int fd;
+  sprintf(path, "/proc/%d/stat", (int)pid);
+  if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) return -1;
+  n = read(fd, buf, sizeof buf - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = 0;
+  /* "pid (name) state ppid ...", where the name can contain anything */
+  if (!(s = strrchr(buf, ')'))) return -1;
+  return (pid_t)strtol(s + 3, 0, 10);
 }
 
-struct spawn_params {
-  lua_State *L;
-  const char *command, **argv, **envp;
-  posix_spawn_file_actions_t redirect;
+struct proc_entry {
+  pid_t pid, ppid;
 };
 
-struct spawn_params *spawn_param_init(lua_State *L)
+/* Reads the pid and the parent of all the processes from /proc. Returns
+ * their number, or -1 on error.
+ */
+static long proc_table(struct proc_entry **table)
 {
-  struct spawn_params *p = lua_newuserdata(L, sizeof *p);
-  p->L = L;
-  p->command = 0;
-  p->argv = p->envp = 0;
-  posix_spawn_file_actions_init(&p->redirect);
-  return p;
+  size_t n = 0, cap = 256;
+  struct proc_entry *t = malloc(cap * sizeof *t), *larger;
+  DIR *d = t ? opendir("/proc") : 0;
+  struct dirent *de;
+  if (!d) {
+    free(t);
+    return -1;
+  }
+  while ((de = readdir(d))) {
+    char *end;
+    pid_t pid = (pid_t)strtol(de->d_name, &end, 10);
+    if (*end || pid <= 0) continue;
+    if (n == cap) {
+      if (!(larger = realloc(t, 2 * cap * sizeof *t))) {
+        free(t);
+        closedir(d);
+        return -1;
+      }
+      t = larger;
+      cap *= 2;
+    }
+    t[n].pid = pid;
+    t[n++].ppid = proc_parent(pid);
+  }
+  closedir(d);
+  *table = t;
+  return (long)n;
 }
 
-static void spawn_param_filename(struct spawn_params *p, const char *filename)
+struct tree_member {
+  pid_t pid;
+  int own;                  /* signalled by itself, not with the group */
+};
+
+static int tree_find(const struct tree_member *tree, size_t n, pid_t pid)
 {
-  p->command = filename;
+  while (n-- > 0)
+    if (tree[n].pid == pid) return 1;
+  return 0;
 }
 
-static void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+/* Sends sig once to each member, the first being root: to the group of root
+ * with killpg, and to the others one by one. Returns the result for root.
+ */
+static int tree_signal(pid_t root, int group, const struct tree_member *tree,
+                       size_t n, int sig)
 {
-  int d;
-  switch (stdname[3]) {
-  case 'i': d = STDIN_FILENO; break;
-  case 'o': d = STDOUT_FILENO; break;
-  case 'e': d = STDERR_FILENO; break;
-  }
-  posix_spawn_file_actions_adddup2(&p->redirect, fd, d);
+  int ret = group ? killpg(root, sig) : kill(root, sig), err = errno;
+  size_t i;
+  for (i = 1; i < n; i++)
+    if (tree[i].own) kill(tree[i].pid, sig);
+  errno = err;
+  return ret;
 }
 
-static int spawn_param_execute(struct spawn_params *p)
+/* Sends sig to root and to its descendants, or to the group root leads and
+ * to the descendants that left it. They are stopped while they are searched,
+ * so that none of them can start a child that is missed or react to the
+ * death of another, and they are resumed after the signal. /proc is read
+ * again only when new processes were stopped, as they could have forked in
+ * the meantime. If the search fails, they are resumed and only root, or its
+ * group, gets the signal.
+ */
+static int kill_tree(pid_t root, int sig, int group)
 {
-  lua_State *L = p->L;
-  int ret;
-  struct process *proc;
-  if (!p->argv) {
-    p->argv = lua_newuserdata(L, 2 * sizeof *p->argv);
-    p->argv[0] = p->command;
-    p->argv[1] = 0;
-  }
-  if (!p->envp)
-    p->envp = (const char **)environ;
-  proc = lua_newuserdata(L, sizeof *proc);
-  luaL_getmetatable(L, PROCESS_HANDLE);
-  lua_setmetatable(L, -2);
-  proc->status = -1;
-  ret = posix_spawnp(&proc->pid, p->command, &p->redirect, 0,
-                     (char *const *)p->argv, (char *const *)p->envp);
-  posix_spawn_file_actions_destroy(&p->redirect);
-  return ret != 0 ? push_error(L) : 1;
+  struct tree_member *tree, *larger;
+  struct proc_entry *procs;
+  size_t n = 1, cap = 64, i;
+  long m;
+  int grown = 1, added, failed = 0, ret;
+  if (!(tree = malloc(cap * sizeof *tree)))
+    return group ? killpg(root, sig) : kill(root, sig);
+  tree[0].pid = root;
+  tree[0].own = !group;
+  tree_signal(root, group, tree, 1, SIGSTOP);
+  while (grown && !failed) {
+    grown = 0;
+    if (-1 == (m = proc_table(&procs))) {
+      failed = 1;
+      break;
+    }
+    do {
+      added = 0;
+      for (i = 0; i < (size_t)m && !failed; i++) {
+        if (tree_find(tree, n, procs[i].pid)
+            || !tree_find(tree, n, procs[i].ppid))
+          continue;
+        if (n == cap) {
+          if (!(larger = realloc(tree, 2 * cap * sizeof *tree))) {
+            failed = 1;
+            break;
+          }
+          tree = larger;
+          cap *= 2;
+        }
+        tree[n].pid = procs[i].pid;
+        /* the members of the group were stopped with it */
+        tree[n].own = !group || getpgid(procs[i].pid) != root;
+        if (tree[n].own) {
+          kill(procs[i].pid, SIGSTOP);
+          grown = 1;
+        }
+        n++;
+        added = 1;
+      }
+    } while (added && !failed);
+    free(procs);
+  }
+  if (failed) {
+    tree_signal(root, group, tree, n, SIGCONT);
+    free(tree);
+    return group ? killpg(root, sig) : kill(root, sig);
+  }
+  ret = tree_signal(root, group, tree, n, sig);
+  if (sig != SIGSTOP) tree_signal(root, group, tree, n, SIGCONT);
+  free(tree);
+  return ret;
 }
+#endif
 
-/* Converts a Lua array of strings to a null-terminated array of char pointers.
- * Pops a (0-based) Lua array and replaces it with a userdatum which is the
- * null-terminated C array of char pointers.  The elements of this array point
- * to the strings in the Lua array.  These strings should be associated with
- * this userdatum via a weak table for GC purposes, but they are not here.
- * Therefore, any function which calls this must make sure that these strings
- * remain available until the userdatum is thrown away.
+/* Sends sig to the process, and with tree to its process group, if it leads
+ * one, and to all its descendants, once each. Returns -1 on error.
  */
-/* ... array -- ... vector */
-static const char **make_vector(lua_State *L)
+static int process_kill_tree(struct process *p, int sig, int tree)
 {
-  size_t i, n = lua_value_length(L, -1);
-  const char **vec = lua_newuserdata(L, (n + 2) * sizeof *vec);
-                                        /* ... arr vec */
-  for (i = 0; i <= n; i++) {
-    lua_rawgeti(L, -2, i);              /* ... arr vec elem */
-    vec[i] = lua_tostring(L, -1);
-    if (!vec[i] && i > 0) {
-      luaL_error(L, "expected string for argument %d, got %s",
-                 i, lua_typename(L, lua_type(L, -1)));
-      return 0;
-    }
-    lua_pop(L, 1);                      /* ... arr vec */
+  if (p->status != -1) {
+    errno = ESRCH;
+    return -1;
   }
-  vec[n + 1] = 0;
-  lua_replace(L, -2);                   /* ... vector */
-  return vec;
+#ifdef __linux__
+  if (tree) return kill_tree(p->pid, sig, p->group);
+#endif
+  if (tree && p->group) return killpg(p->pid, sig);
+  return kill(p->pid, sig);
 }
 
-/* ... envtab -- ... envtab vector */
-static void spawn_param_env(struct spawn_params *p)
+/* Kills the process and its descendants when its deadline has passed */
+static void process_expire(struct process *p)
 {
-  lua_State *L = p->L;
-  size_t i = 0;
-  lua_newtable(L);                      /* ... envtab arr */
-  lua_pushliteral(L, "=");              /* ... envtab arr "=" */
-  lua_pushnil(L);                       /* ... envtab arr "=" nil */
-  for (i = 0; lua_next(L, -4); i++) {   /* ... envtab arr "=" k v */
-    if (!lua_tostring(L, -2)) {
-      luaL_error(L, "expected string for environment variable name, got %s",
-                 lua_typename(L, lua_type(L, -2)));
-      return;
-    }
-    if (!lua_tostring(L, -1)) {
-      luaL_error(L, "expected string for environment variable value, got %s",
-                 lua_typename(L, lua_type(L, -1)));
-      return;
-    }
+  if (p->deadline == 0 || monotonic_time() < p->deadline) return;
+  p->deadline = 0;
+  p->timedout = 1;
+  process_kill_tree(p, SIGKILL, 1);
+}
+
+/* The timeout of poll for the given seconds, rounded up so that poll does
+ * not return before them, and -1 if negative. A long timeout is clamped, and
+ * the caller polls again.
+ */
+static int poll_ms(double seconds)
+{
+  if (seconds < 0) return -1;
+  if (seconds >= (INT_MAX - 1) / 1000.0) return INT_MAX;
+  return (int)(seconds * 1000) + 1;
+}
+
+/* The milliseconds left before the deadline of p, -1 if it has none */
+static int process_deadline_ms(struct process *p)
+{
+  double left;
+  if (p->deadline == 0) return -1;
+  left = p->deadline - monotonic_time();
+  return left <= 0 ? 0 : poll_ms(left);
+}
+
+/* The exit code, or 128 plus the signal that killed the process, as shells
+ * report it.
+ */
+static int exit_code(int status)
+{
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* A process started by a fork server is not a child of this one: its exit
+ * status is sent by the server, and kept here until it is collected.
+ */
+struct forkserver_exit {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+  int forgotten;            /* its process was collected before the exit */
+};
+
+struct forkserver {
+  int fd;                   /* the socket, -1 when closed */
+  int ref;                  /* of the server process */
+  uint32_t next_id;
+  struct forkserver_exit *exits;
+  int nexits, size;
+};
+
+#define FS_SPAWNED 1
+#define FS_EXITED 2
+
+struct forkserver_reply {
+  int32_t kind;
+  uint32_t id;              /* of the request, for FS_SPAWNED */
+  int32_t pid;              /* or -errno if the spawn failed */
+  int32_t status;
+  struct rusage usage;
+};
+
+/* Adds an entry to the exits. Returns -1 if out of memory. */
+static int forkserver_push(struct forkserver *fs, pid_t pid, int status,
+                           const struct rusage *usage, int forgotten)
+{
+  struct forkserver_exit *e;
+  if (fs->nexits == fs->size) {
+    int size = fs->size ? 2 * fs->size : 16;
+    e = realloc(fs->exits, size * sizeof *e);
+    if (!e) return -1;
+    fs->exits = e;
+    fs->size = size;
+  }
+  e = &fs->exits[fs->nexits++];
+  e->pid = pid;
+  e->status = status;
+  if (usage) e->usage = *usage;
+  else memset(&e->usage, 0, sizeof e->usage);
+  e->forgotten = forgotten;
+  return 0;
+}
+
+/* Returns the index of the exit of pid, -1 if there is none */
+static int forkserver_find(struct forkserver *fs, pid_t pid, int forgotten)
+{
+  int i;
+  for (i = 0; i < fs->nexits; i++)
+    if (fs->exits[i].pid == pid && fs->exits[i].forgotten == forgotten)
+      return i;
+  return -1;
+}
+
+/* Drops the exit of a process that will never be waited, as it was
+ * collected: if it was not received yet, it is dropped when it arrives, so
+ * that the exits do not grow without bound.
+ */
+static void forkserver_forget(struct forkserver *fs, pid_t pid)
+{
+  int i;
+  if (fs->fd < 0) return;
+  if (-1 != (i = forkserver_find(fs, pid, 0)))
+    fs->exits[i] = fs->exits[--fs->nexits];
+  else
+    forkserver_push(fs, pid, 0, 0, 1);
+}
+
+/* Receives a reply of the server, keeping the exits. Returns 1, 0 if there
+ * is none and flags has MSG_DONTWAIT, -1 on error.
+ */
+static int forkserver_recv(struct forkserver *fs, struct forkserver_reply *r,
+                           int flags)
+{
+  ssize_t n;
+  int i;
+  if (fs->fd < 0) {
+    errno = ECHILD;
+    return -1;
+  }
+  do n = recv(fs->fd, r, sizeof *r, flags);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) return errno == EAGAIN ? 0 : -1;
+  if (n != sizeof *r) {
+    errno = n == 0 ? ECHILD : EPROTO;
+    return -1;
+  }
+  if (r->kind != FS_EXITED) return 1;
+  if (-1 != (i = forkserver_find(fs, r->pid, 1))) {
+    fs->exits[i] = fs->exits[--fs->nexits];
+    return 1;
+  }
+  return forkserver_push(fs, r->pid, r->status, &r->usage, 0) ? -1 : 1;
+}
+
+static int forkserver_reap(struct process *p, int block)
+{
+  struct forkserver *fs = p->server;
+  struct forkserver_reply r;
+  for (;;) {
+    int i, ret;
+    for (i = 0; i < fs->nexits; i++) {
+      if (fs->exits[i].pid != p->pid || fs->exits[i].forgotten) continue;
+      p->end = monotonic_time();
+      p->status = exit_code(fs->exits[i].status);
+      stats_exit(p->pid, p->status);
+      p->usage = fs->exits[i].usage;
+      fs->exits[i] = fs->exits[--fs->nexits];
+      process_close_pidfd(p);
+      return 1;
+    }
+    ret = forkserver_recv(fs, &r, block ? 0 : MSG_DONTWAIT);
+    if (ret <= 0) return ret;
+  }
+}
+
+static int process_reap_timeout(struct process *p, double timeout);
+
+/* Collects the exit status if the process has terminated. It blocks only if
+ * block is true. A process past its deadline is killed first. Returns 1 if
+ * terminated, 0 if still running, -1 on error.
+ */
+static int process_reap(struct process *p, int block)
+{
+  int status;
+  pid_t ret;
+  if (p->status != -1) return 1;
+  /* a blocking wait can not go past the deadline */
+  if (block && p->deadline > 0
+      && 0 != (ret = process_reap_timeout(p, p->deadline - monotonic_time())))
+    return ret;
+  process_expire(p);
+  if (p->server) return forkserver_reap(p, block);
+  do ret = wait4(p->pid, &status, block ? 0 : WNOHANG, &p->usage);
+  while (ret == -1 && errno == EINTR);
+  if (ret == -1) return -1;
+  if (ret == 0) return 0;
+  p->end = monotonic_time();
+  p->status = exit_code(status);
+  stats_exit(p->pid, p->status);
+  process_close_pidfd(p);
+  return 1;
+}
+
+double monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -- seconds */
+int lc_clock(lua_State *L)
+{
+  lua_pushnumber(L, monotonic_time());
+  return 1;
+}
+
+int cpu_count(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+/* Sleeps until one of the n processes exits, reaches its deadline or `left`
+ * seconds elapse (forever if left is negative). pfd must have room for n entries. Without
+ * pidfds it falls back to sleeping for an exponentially growing step.
+ */
+static void process_sleep(struct process **ps, struct pollfd *pfd, size_t n,
+                          double left, double *step)
+{
+  size_t i, m = 0;
+  for (i = 0; i < n; i++) {
+    if (ps[i]->status != -1) continue;
+    if (ps[i]->deadline > 0) {
+      double d = ps[i]->deadline - monotonic_time();
+      if (left < 0 || d < left) left = d > 0 ? d : 0;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (ps[i]->status != -1) continue;
+    pfd[m].fd = process_pidfd(ps[i]);
+    pfd[m].events = POLLIN;
+    if (pfd[m++].fd < 0) break;
+  }
+  if (m > 0 && pfd[m - 1].fd >= 0) {
+    poll(pfd, m, poll_ms(left));
+  } else {
+    struct timespec ts;
+    if (left < 0 || left > *step) left = *step;
+    if (*step < 0.05) *step *= 2;
+    ts.tv_sec = (time_t)left;
+    ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+    nanosleep(&ts, 0);
+  }
+}
+
+/* Like process_reap, but waits at most timeout seconds. */
+static int process_reap_timeout(struct process *p, double timeout)
+{
+  double deadline = monotonic_time() + timeout;
+  double step = 0.001;
+  struct pollfd pfd;
+  for (;;) {
+    double left;
+    int ret = process_reap(p, 0);
+    if (ret != 0) return ret;
+    left = deadline - monotonic_time();
+    if (left <= 0) return 0;
+    process_sleep(&p, &pfd, 1, left, &step);
+  }
+}
+
+/* Reaps a helper process whose owner is collected, so that it is not left a
+ * zombie. Its input was closed, so it gets a moment to exit by itself before
+ * being killed.
+ */
+#define FINISH_GRACE 0.1
+
+static void process_finish(struct process *p)
+{
+  if (0 == process_reap_timeout(p, FINISH_GRACE)) {
+    process_kill_tree(p, SIGKILL, 0);
+    process_reap(p, 1);
+  }
+}
+
+static double timeval_seconds(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* -- usage */
+static void push_usage(lua_State *L, struct process *p)
+{
+  long maxrss = p->usage.ru_maxrss;
+#ifdef __APPLE__
+  maxrss /= 1024;                       /* bytes, not kilobytes */
+#endif
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, timeval_seconds(p->usage.ru_utime));
+  lua_setfield(L, -2, "utime");
+  lua_pushnumber(L, timeval_seconds(p->usage.ru_stime));
+  lua_setfield(L, -2, "stime");
+  lua_pushnumber(L, maxrss);
+  lua_setfield(L, -2, "maxrss");
+  lua_pushnumber(L, p->usage.ru_minflt);
+  lua_setfield(L, -2, "minflt");
+  lua_pushnumber(L, p->usage.ru_majflt);
+  lua_setfield(L, -2, "majflt");
+  lua_pushnumber(L, p->usage.ru_nvcsw);
+  lua_setfield(L, -2, "nvcsw");
+  lua_pushnumber(L, p->usage.ru_nivcsw);
+  lua_setfield(L, -2, "nivcsw");
+  lua_pushnumber(L, p->end - p->start);
+  lua_setfield(L, -2, "wall");
+  if (p->timedout) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "timedout");
+  }
+}
+
+/* proc [timeout [usage]] -- exitcode [usage]/nil error */
+int process_wait(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  double timeout = luaL_optnumber(L, 2, -1), start = monotonic_time();
+  int usage = lua_toboolean(L, 3);
+  int ret = timeout < 0 ? process_reap(p, 1) : process_reap_timeout(p, timeout);
+  if (timeout != 0) stats_wait(start, p->pid, ret == 0);
+  if (ret == -1)
+    return push_error(L);
+  if (ret == 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
+  lua_pushnumber(L, p->status);
+  if (!usage) return 1;
+  push_usage(L, p);
+  return 2;
+}
+
+/* proc -- usage/nil error */
+int process_usage(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  if (p->status == -1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "process not terminated");
+    return 2;
+  }
+  push_usage(L, p);
+  return 1;
+}
+
+/* proc [usage] -- exitcode [usage]/nil "timeout"/nil error */
+int process_poll(lua_State *L)
+{
+  int usage = lua_toboolean(L, 2);
+  lua_settop(L, 1);
+  lua_pushnumber(L, 0);
+  lua_pushboolean(L, usage);
+  return process_wait(L);
+}
+
+/* proc -- fd/nil error */
+int process_fd(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int fd = process_pidfd(p);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, p->status != -1 ? "process already terminated" : "not supported");
+    return 2;
+  }
+  lua_pushnumber(L, fd);
+  return 1;
+}
+
+static const struct {
+  const char *name;
+  int sig;
+} signal_names[] = {
+  {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+  {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"STOP", SIGSTOP},
+  {"CONT", SIGCONT}, {0, 0}
+};
+
+/* A signal number, or a name like "TERM" or "SIGTERM", SIGTERM if missing */
+static int check_signal(lua_State *L, int idx)
+{
+  const char *name;
+  int i;
+  if (lua_isnoneornil(L, idx)) return SIGTERM;
+  if (lua_type(L, idx) == LUA_TNUMBER) return (int)lua_tonumber(L, idx);
+  name = luaL_checkstring(L, idx);
+  if (!strncmp(name, "SIG", 3)) name += 3;
+  for (i = 0; signal_names[i].name; i++)
+    if (!strcmp(name, signal_names[i].name)) return signal_names[i].sig;
+  return luaL_error(L, "bad signal '%s'", lua_tostring(L, idx));
+}
+
+static int push_kill(lua_State *L, int tree)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int sig = check_signal(L, 2);
+  if (p->status != -1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "process already terminated");
+    return 2;
+  }
+  if (-1 == process_kill_tree(p, sig, tree))
+    return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* proc [signal] -- true/nil error */
+int process_kill(lua_State *L)
+{
+  return push_kill(L, 0);
+}
+
+/* proc [signal] -- true/nil error */
+int process_killtree(lua_State *L)
+{
+  return push_kill(L, 1);
+}
+
+static void close_fd(int *fd)
+{
+  if (*fd >= 0) close(*fd);
+  *fd = -1;
+}
+
+/* proc -- */
+int process_gc(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int i;
+  if (p->server && p->status == -1) {
+    forkserver_forget(p->server, p->pid);
+    p->server = 0;
+  }
+  process_close_pidfd(p);
+  for (i = 0; i < 3; i++)
+    close_fd(&p->pipes[i]);
+  luaL_unref(L, LUA_REGISTRYINDEX, p->server_ref);
+  p->server_ref = LUA_NOREF;
+  return 0;
+}
+
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+
+static int buffer_reserve(struct buffer *b, size_t n)
+{
+  if (b->cap - b->len < n) {
+    size_t cap = b->cap ? b->cap : 4096;
+    char *data;
+    while (cap - b->len < n) cap *= 2;
+    data = realloc(b->data, cap);
+    if (!data) return -1;
+    b->data = data;
+    b->cap = cap;
+  }
+  return 0;
+}
+
+/* Feeds input to the captured stdin and collects the captured stdout and
+ * stderr until all of them are closed. Returns 0 or an errno value.
+ */
+static int process_exchange(struct process *p, const char *input, size_t len,
+                            struct buffer *out)
+{
+  size_t pos = 0;
+  int ret = 0;
+  if (p->pipes[0] >= 0) {
+    if (len == 0) close_fd(&p->pipes[0]);
+    else fcntl(p->pipes[0], F_SETFL, fcntl(p->pipes[0], F_GETFL) | O_NONBLOCK);
+  }
+  while (p->pipes[0] >= 0 || p->pipes[1] >= 0 || p->pipes[2] >= 0) {
+    struct pollfd pfd[3];
+    int i, n = 0, which[3];
+    for (i = 0; i < 3; i++) {
+      if (p->pipes[i] < 0) continue;
+      pfd[n].fd = p->pipes[i];
+      pfd[n].events = i == 0 ? POLLOUT : POLLIN;
+      which[n++] = i;
+    }
+    ret = poll(pfd, n, process_deadline_ms(p));
+    if (ret == 0) process_expire(p);
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    ret = 0;
+    while (n-- > 0) {
+      ssize_t done;
+      if (!pfd[n].revents) continue;
+      i = which[n];
+      if (i == 0) {
+        done = write(p->pipes[0], input + pos, len - pos);
+        if (done > 0) pos += done;
+        /* EPIPE just means that the child does not read all the input */
+        else if (errno != EAGAIN && errno != EINTR) pos = len;
+        if (pos == len) close_fd(&p->pipes[0]);
+      } else {
+        if (buffer_reserve(&out[i], 4096)) {
+          ret = ENOMEM;
+          break;
+        }
+        done = read(p->pipes[i], out[i].data + out[i].len,
+                    out[i].cap - out[i].len);
+        if (done > 0) out[i].len += done;
+        else if (done == 0 || (errno != EAGAIN && errno != EINTR))
+          close_fd(&p->pipes[i]);
+      }
+    }
+    if (ret) return ret;
+  }
+  return 0;
+}
+
+/* proc [input] -- out err exitcode/nil error */
+int process_communicate(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  size_t len = 0;
+  const char *input = luaL_optlstring(L, 2, "", &len);
+  struct buffer out[3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+  int captured[3], i, ret, sig;
+  sigset_t set, old, pending;
+  for (i = 0; i < 3; i++)
+    captured[i] = p->pipes[i] >= 0;
+  /* a write on a pipe closed by the child must not kill this process */
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  ret = process_exchange(p, input, len, out);
+  sigpending(&pending);
+  if (sigismember(&pending, SIGPIPE) && !sigismember(&old, SIGPIPE))
+    sigwait(&set, &sig);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  if (!ret && -1 == process_reap(p, 1)) ret = errno;
+  for (i = 1; i < 3; i++) {
+    if (!ret && captured[i])
+      lua_pushlstring(L, out[i].data ? out[i].data : "", out[i].len);
+    else
+      lua_pushboolean(L, 0);
+    free(out[i].data);
+  }
+  if (ret) {
+    errno = ret;
+    return push_error(L);
+  }
+  lua_pushnumber(L, p->status);
+  return 3;
+}
+
+/* Tells if the stream (1 for stdout, 2 for stderr) of the process is captured */
+int process_captured(lua_State *L, int idx, int stream)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  return p->pipes[stream] >= 0;
+}
+
+/* Reads from a captured stream of the process, waiting for some data.
+ * Returns the bytes read, or 0 at the end of the stream, when the pipe is
+ * closed. Errors are raised.
+ */
+long process_read(lua_State *L, int idx, int stream, char *buf, size_t len)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  struct pollfd pfd;
+  ssize_t n;
+  if (p->pipes[stream] < 0) return 0;
+  for (;;) {
+    if (p->deadline > 0) {
+      int ret;
+      pfd.fd = p->pipes[stream];
+      pfd.events = POLLIN;
+      ret = poll(&pfd, 1, process_deadline_ms(p));
+      /* a signal restarts the poll, for the time left */
+      if (ret == -1 && errno == EINTR) continue;
+      if (ret == 0) {
+        process_expire(p);
+        continue;
+      }
+    }
+    n = read(p->pipes[stream], buf, len);
+    if (n >= 0) break;
+    if (errno == EAGAIN && p->deadline > 0)
+      continue;
+    if (errno == EAGAIN) {
+      /* the pipe was made non blocking, e.g. by a loop */
+      pfd.fd = p->pipes[stream];
+      pfd.events = POLLIN;
+      poll(&pfd, 1, -1);
+    }
+    else if (errno != EINTR)
+      return luaL_error(L, "%s", strerror(errno));
+  }
+  if (n == 0) close_fd(&p->pipes[stream]);
+  return n;
+}
+
+static struct process *to_process(lua_State *L, int idx)
+{
+  int top = lua_gettop(L);
+  struct process *p = lua_touserdata(L, idx);
+  idx = absindex(L, idx);
+  luaL_getmetatable(L, PROCESS_HANDLE);
+  if (!p || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
+    p = 0;
+  lua_settop(L, top);
+  return p;
+}
+
+/* Waits for the processes in the array at index 1, until one (any) or all of
+ * them are terminated.
+ */
+static int wait_processes(lua_State *L, int any)
+{
+  size_t i, n;
+  double timeout, deadline, step = 0.001;
+  struct process **ps;
+  struct pollfd *pfd;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  timeout = luaL_optnumber(L, 2, -1);
+  lua_settop(L, 2);
+  n = lua_value_length(L, 1);
+  if (any && n == 0)
+    return luaL_argerror(L, 1, "empty process list");
+  ps = lua_newuserdata(L, n * sizeof *ps + 1);
+  pfd = lua_newuserdata(L, n * sizeof *pfd + 1);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    ps[i] = to_process(L, -1);
+    if (!ps[i])
+      return luaL_error(L, "bad process at index %d (%s expected, got %s)",
+                        (int)i + 1, PROCESS_HANDLE, luaL_typename(L, -1));
+    lua_pop(L, 1);
+  }
+  deadline = monotonic_time() + timeout;
+  for (;;) {
+    double left = -1;
+    size_t running = 0;
+    for (i = 0; i < n; i++) {
+      int ret;
+      if (any && ps[i]->reported) continue;
+      ret = process_reap(ps[i], 0);
+      if (ret == -1)
+        return push_error(L);
+      if (ret == 0)
+        running++;
+      else if (any) {
+        ps[i]->reported = 1;
+        lua_rawgeti(L, 1, i + 1);
+        lua_pushnumber(L, ps[i]->status);
+        lua_pushnumber(L, i + 1);
+        return 3;
+      }
+    }
+    if (!running && any) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "no process left");
+      return 2;
+    }
+    if (!running) {
+      lua_createtable(L, n, 0);
+      for (i = 0; i < n; i++) {
+        lua_pushnumber(L, ps[i]->status);
+        lua_rawseti(L, -2, i + 1);
+      }
+      return 1;
+    }
+    if (timeout >= 0) {
+      left = deadline - monotonic_time();
+      if (left <= 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+      }
+    }
+    process_sleep(ps, pfd, n, left, &step);
+  }
+}
+
+/* procs [timeout] -- proc exitcode index/nil "timeout"/nil error */
+int lc_waitany(lua_State *L)
+{
+  return wait_processes(L, 1);
+}
+
+/* procs [timeout] -- exitcodes/nil "timeout"/nil error */
+int lc_waitall(lua_State *L)
+{
+  return wait_processes(L, 0);
+}
+
+/* proc -- string */
+int process_tostring(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  char buf[40];
+  lua_pushlstring(L, buf,
+    sprintf(buf, "process (%lu, %s)", (unsigned long)p->pid,
+      p->status==-1 ? "running" : "terminated"));
+  return 1;
+}
+
+/* The child gets fd as the descriptor target */
+struct spawn_fdmap {
+  int fd, target;
+};
+
+struct spawn_params {
+  lua_State *L;
+  const char *command, **argv, **envp;
+  struct envblock *envblock;
+  int dups[3];
+  int capture[3];
+  int close_fds;
+  double timeout;             /* seconds before the kill, -1 for none */
+  struct spawn_fdmap *fdmap;  /* the descriptors from 3 on */
+  int nfdmap;
+  int has_setup;
+  struct child_setup setup;
+};
+
+struct spawn_params *spawn_param_init(lua_State *L)
+{
+  struct spawn_params *p = lua_newuserdata(L, sizeof *p);
+  int i;
+  p->L = L;
+  p->command = 0;
+  p->argv = p->envp = 0;
+  p->envblock = 0;
+  for (i = 0; i < 3; i++) {
+    p->dups[i] = -1;
+    p->capture[i] = 0;
+  }
+  p->close_fds = 0;
+  p->timeout = -1;
+  p->fdmap = 0;
+  p->nfdmap = 0;
+  p->has_setup = 0;
+  child_setup_init(&p->setup);
+  return p;
+}
+
+static void spawn_param_filename(struct spawn_params *p, const char *filename)
+{
+  p->command = filename;
+}
+
+static int std_fileno(const char *stdname)
+{
+  switch (stdname[3]) {
+  case 'i': return STDIN_FILENO;
+  case 'o': return STDOUT_FILENO;
+  default: return STDERR_FILENO;
+  }
+}
+
+static void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+{
+  p->dups[std_fileno(stdname)] = fd;
+}
+
+static void spawn_param_capture(struct spawn_params *p, const char *stdname)
+{
+  p->capture[std_fileno(stdname)] = 1;
+}
+
+static void spawn_param_close_fds(struct spawn_params *p, int close_fds)
+{
+  p->close_fds = close_fds;
+}
+
+static int action_result(int ret)
+{
+  return ret == -1 ? errno : ret;
+}
+
+/* Creates the pipes of the captured streams. The parent side of the pipes is
+ * stored in pipes, the child side in child. Returns 0 or an errno value.
+ */
+static int spawn_param_pipes(struct spawn_params *p, int *pipes, int *child)
+{
+  int i, fd[2];
+  for (i = 0; i < 3; i++) {
+    if (!p->capture[i]) continue;
+    if (-1 == cloexec_pipe(fd)) return errno;
+    pipes[i] = fd[i == 0 ? 1 : 0];
+    child[i] = fd[i == 0 ? 0 : 1];
+  }
+  return 0;
+}
+
+static int spawn_param_source(struct spawn_params *p, const int *child, int i)
+{
+  return p->capture[i] ? child[i] : p->dups[i];
+}
+
+static int spawn_param_is_target(struct spawn_params *p, int fd)
+{
+  int k;
+  for (k = 0; k < p->nfdmap; k++)
+    if (p->fdmap[k].target == fd) return 1;
+  return 0;
+}
+
+/* Builds the file actions of the spawn: the redirections, the child side of
+ * the pipes of the captured streams, the mapped descriptors and the closing
+ * of the other descriptors, that must be the last action. With mapped
+ * descriptors all the sources are first moved above any descriptor
+ * involved, so that a mapping can not overwrite the source of another one.
+ * Returns 0 or an errno value; act must be initialized by the caller and
+ * destroyed anyway.
+ */
+static int spawn_param_actions(struct spawn_params *p,
+                               child_actions_t *act, const int *child)
+{
+  int i, k, fd, top = 2, base = 3;
+  if (!p->nfdmap) {
+    for (i = 0; i < 3; i++)
+      if ((fd = spawn_param_source(p, child, i)) >= 0
+          && -1 == child_actions_adddup2(act, fd, i))
+        return errno;
+    if (p->close_fds) child_actions_addclosefrom(act, 3);
+    return 0;
+  }
+  for (i = 0; i < 3; i++)
+    if (spawn_param_source(p, child, i) >= base)
+      base = spawn_param_source(p, child, i) + 1;
+  for (k = 0; k < p->nfdmap; k++) {
+    if (p->fdmap[k].target > top) top = p->fdmap[k].target;
+    if (p->fdmap[k].fd >= base) base = p->fdmap[k].fd + 1;
+  }
+  if (top >= base) base = top + 1;
+  for (i = 0; i < 3 + p->nfdmap; i++) {
+    fd = i < 3 ? spawn_param_source(p, child, i) : p->fdmap[i - 3].fd;
+    if (fd >= 0 && -1 == child_actions_adddup2(act, fd, base + i))
+      return errno;
+  }
+  for (i = 0; i < 3 + p->nfdmap; i++) {
+    fd = i < 3 ? spawn_param_source(p, child, i) : p->fdmap[i - 3].fd;
+    if (fd >= 0
+        && -1 == child_actions_adddup2(act, base + i,
+                                       i < 3 ? i : p->fdmap[i - 3].target))
+      return errno;
+  }
+  if (p->close_fds) {
+    for (fd = 3; fd < top; fd++)
+      if (!spawn_param_is_target(p, fd) && -1 == child_actions_addclose(act, fd))
+        return errno;
+    child_actions_addclosefrom(act, top + 1);
+    return 0;
+  }
+  for (i = 0; i < 3 + p->nfdmap; i++)
+    if (-1 == child_actions_addclose(act, base + i))
+      return errno;
+  return 0;
+}
+
+/* Converts the actions of the internal spawner to the posix_spawn ones */
+static int spawn_posix_actions(const child_actions_t *c,
+                               posix_spawn_file_actions_t *act)
+{
+  int i, ret;
+  posix_spawn_file_actions_init(act);
+  for (i = 0; i < c->n; i++) {
+    const struct child_action *a = &c->ops[i];
+    if (a->fd == -1)
+      ret = posix_spawn_file_actions_addclose(act, a->newfd);
+    else
+      ret = posix_spawn_file_actions_adddup2(act, a->fd, a->newfd);
+    if ((ret = action_result(ret)))
+      return ret;
+  }
+  if (c->closefrom < 0) return 0;
+#ifdef HAVE_SPAWN_CLOSEFROM
+  return action_result(posix_spawn_file_actions_addclosefrom_np(act, c->closefrom));
+#else
+  return ENOSYS;
+#endif
+}
+
+/* posix_spawn can not do the setup, nor close the descriptors everywhere */
+static int spawn_param_internal(struct spawn_params *p)
+{
+#ifdef HAVE_SPAWN_CLOSEFROM
+  return p->has_setup;
+#else
+  return p->has_setup || p->close_fds;
+#endif
+}
+
+static void spawn_param_deadline(struct spawn_params *p, struct process *proc,
+                                 double start)
+{
+  if (p->timeout >= 0) proc->deadline = start + p->timeout;
+  proc->group = p->setup.pgroup != 0;
+}
+
+static int spawn_param_captures(struct spawn_params *p)
+{
+  return p->capture[0] || p->capture[1] || p->capture[2];
+}
+
+static struct process *process_new(lua_State *L)
+{
+  struct process *proc = lua_newuserdata(L, sizeof *proc);
+  luaL_getmetatable(L, PROCESS_HANDLE);
+  lua_setmetatable(L, -2);
+  proc->status = -1;
+  proc->pid = -1;
+  proc->pidfd = PIDFD_NONE;
+  proc->pipes[0] = proc->pipes[1] = proc->pipes[2] = -1;
+  proc->start = proc->end = monotonic_time();
+  memset(&proc->usage, 0, sizeof proc->usage);
+  proc->server = 0;
+  proc->server_ref = LUA_NOREF;
+  proc->deadline = 0;
+  proc->group = proc->timedout = proc->reported = 0;
+  return proc;
+}
+
+/* Commands without a slash are searched in the PATH once, and the result is
+ * kept in a table of the state, so that each spawn does not repeat the
+ * failed execs of the search. The table is valid for a value of PATH; on
+ * linux it is dropped when inotify reports a change in a directory of the
+ * PATH, elsewhere a resolved file is checked with access at each use. A PATH
+ * with relative directories is not cached, as it depends on the current
+ * directory: the command is then searched at each spawn. In any case the
+ * spawn gets a file with a slash, so that the PATH of this process, which
+ * may not be the one of the children, is never searched.
+ */
+#define PATH_CACHE "luachild.pathcache"
+#define PATH_DEFAULT "/usr/bin:/bin"   /* as execvp, when there is no PATH */
+
+/* Returns the PATH of the environment of the children of this state */
+static const char *state_path(lua_State *L)
+{
+  struct envblock *e = state_envblock(L, 0);
+  const char **env;
+  if (!e) return getenv("PATH");
+  for (env = envblock_vector(e); *env; env++)
+    if (!strncmp(*env, "PATH=", 5)) return *env + 5;
+  return 0;
+}
+
+/* Calls f on each directory of path, until it returns non zero. Returns the
+ * result of f, or -1 if a directory is relative or too long.
+ */
+static int path_each(const char *path, int (*f)(const char *dir, void *arg),
+                     void *arg)
+{
+  char dir[4096];
+  int ret = 0;
+  while (!ret) {
+    const char *end = strchr(path, ':');
+    size_t len = end ? (size_t)(end - path) : strlen(path);
+    if (len == 0 || path[0] != '/' || len >= sizeof dir) return -1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    ret = f(dir, arg);
+    if (!end) break;
+    path = end + 1;
+  }
+  return ret;
+}
+
+/* Only checks that the directories are absolute */
+static int path_skip(const char *dir, void *arg)
+{
+  (void)dir;
+  (void)arg;
+  return 0;
+}
+
+#define PATH_MAX_UNWATCHED 32
+
+#ifdef __linux__
+/* The directories that can not be watched, as the ones that do not exist
+ * yet, are marked in unwatched by their position in the PATH.
+ */
+struct path_watches {
+  int fd, i;
+  unsigned long unwatched;
+};
+
+static int path_watch(const char *dir, void *arg)
+{
+  struct path_watches *w = arg;
+  int i = w->i++;
+  if (-1 != inotify_add_watch(w->fd, dir, IN_CREATE | IN_DELETE | IN_ATTRIB
+                              | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF
+                              | IN_MOVE_SELF))
+    return 0;
+  if (i >= PATH_MAX_UNWATCHED) return 1;
+  w->unwatched |= 1UL << i;
+  return 0;
+}
+#endif
+
+/* Pushes the table of the resolved commands for path, or nil if path can
+ * not be cached. watched tells if the directories are watched by inotify,
+ * and unwatched marks the ones that could not be.
+ */
+/* -- commands/nil */
+static void path_cache(lua_State *L, const char *path, int *watched,
+                       unsigned long *unwatched)
+{
+  struct rawfd *watch;
+  lua_getfield(L, LUA_REGISTRYINDEX, PATH_CACHE);   /* cache */
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "path");                    /* cache path */
+    lua_getfield(L, -2, "watch");                   /* cache path watch */
+    watch = lua_touserdata(L, -1);
+    if (!strcmp(lua_tostring(L, -2), path)) {
+      char buf[4096];
+      /* any event drops the table */
+      if (!watch || read(watch->fd, buf, sizeof buf) <= 0) {
+        *watched = watch != 0;
+        lua_pop(L, 2);                              /* cache */
+        lua_getfield(L, -1, "unwatched");           /* cache unwatched */
+        *unwatched = (unsigned long)lua_tonumber(L, -1);
+        lua_pop(L, 1);                              /* cache */
+        lua_getfield(L, -1, "commands");            /* cache commands */
+        lua_remove(L, -2);                          /* commands */
+        return;
+      }
+    }
+    lua_pop(L, 2);                                  /* cache */
+  }
+  lua_pop(L, 1);                                    /* */
+  if (path_each(path, path_skip, 0) == -1) {
+    lua_pushnil(L);
+    return;
+  }
+  *watched = 0;
+  *unwatched = 0;
+  lua_createtable(L, 0, 4);                         /* cache */
+  lua_pushstring(L, path);
+  lua_setfield(L, -2, "path");
+#ifdef __linux__
+  {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0) {
+      struct path_watches w = {fd, 0, 0};
+      *watched = 1;
+      rawfd_new(L, fd);                             /* cache watch */
+      lua_setfield(L, -2, "watch");
+      if (path_each(path, path_watch, &w)) {
+        lua_pop(L, 1);                              /* */
+        lua_pushnil(L);
+        return;
+      }
+      *unwatched = w.unwatched;
+      lua_pushnumber(L, w.unwatched);
+      lua_setfield(L, -2, "unwatched");
+    }
+  }
+#endif
+  lua_newtable(L);                                  /* cache commands */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, "commands");
+  lua_insert(L, -2);                                /* commands cache */
+  lua_setfield(L, LUA_REGISTRYINDEX, PATH_CACHE);   /* commands */
+}
+
+struct path_search {
+  const char *command;
+  char file[4096 + 256];
+};
+
+static int path_find(const char *dir, void *arg)
+{
+  struct path_search *s = arg;
+  struct stat st;
+  size_t dlen = strlen(dir), clen = strlen(s->command);
+  if (dlen + clen + 2 > sizeof s->file) return 0;
+  memcpy(s->file, dir, dlen);
+  s->file[dlen] = '/';
+  memcpy(s->file + dlen + 1, s->command, clen + 1);
+  return 0 == stat(s->file, &st) && S_ISREG(st.st_mode)
+         && 0 == access(s->file, X_OK);
+}
+
+/* A command may appear in a directory that is not watched, before the one of
+ * the cached file: those directories are searched again at each spawn.
+ */
+struct path_recheck {
+  struct path_search s;
+  const char *file;
+  unsigned long unwatched;
+  int i;
+};
+
+static int path_recheck(const char *dir, void *arg)
+{
+  struct path_recheck *r = arg;
+  size_t len = strlen(dir);
+  if (!strncmp(dir, r->file, len) && r->file[len] == '/'
+      && !strchr(r->file + len + 1, '/'))
+    return 1;
+  if ((r->unwatched >> r->i++ & 1) && path_find(dir, &r->s)) return 2;
+  return 0;
+}
+
+/* Searches the command in all the directories of path without the cache.
+ * The relative ones are taken from the current directory, so that the file
+ * found is absolute. Returns non zero if found.
+ */
+static int path_search_all(struct path_search *s, const char *path)
+{
+  char dir[4096], cwd[4096];
+  size_t clen = 0;
+  for (;;) {
+    const char *end = strchr(path, ':');
+    size_t len = end ? (size_t)(end - path) : strlen(path), off = 0;
+    int ok = len > 0 && path[0] == '/';
+    if (!ok) {
+      if (!clen && getcwd(cwd, sizeof cwd)) clen = strlen(cwd);
+      if ((ok = clen > 0)) {
+        memcpy(dir, cwd, clen);
+        off = clen;
+        if (len > 0) dir[off++] = '/';
+      }
+    }
+    if (ok && off + len < sizeof dir) {
+      memcpy(dir + off, path, len);
+      dir[off + len] = '\0';
+      if (path_find(dir, s)) return 1;
+    }
+    if (!end) return 0;
+    path = end + 1;
+  }
+}
+
+/* Returns the file to execute for command, leaving it on the stack. It is
+ * the command itself if it has a slash. Returns null, with errno set, if the
+ * command is not found.
+ */
+/* -- file/nil */
+static const char *resolve_command(lua_State *L, const char *command)
+{
+  const char *path = state_path(L);
+  struct path_search s;
+  struct path_recheck r;
+  unsigned long unwatched = 0;
+  int watched = 0;
+  if (strchr(command, '/')) {
+    lua_pushstring(L, command);
+    return lua_tostring(L, -1);
+  }
+  if (!*command || strlen(command) > 255) {
+    lua_pushnil(L);
+    errno = *command ? ENAMETOOLONG : ENOENT;
+    return 0;
+  }
+  if (!path) path = PATH_DEFAULT;
+  s.command = command;
+  path_cache(L, path, &watched, &unwatched); /* commands/nil */
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (!path_search_all(&s, path)) {
+      lua_pushnil(L);
+      errno = ENOENT;
+      return 0;
+    }
+    lua_pushstring(L, s.file);
+    return lua_tostring(L, -1);
+  }
+  /* a file found in a directory not watched could be removed unseen */
+  if (unwatched) watched = 0;
+  lua_getfield(L, -1, command);         /* commands file/nil */
+  if (lua_isstring(L, -1)
+      && (watched || 0 == access(lua_tostring(L, -1), X_OK))) {
+    r.s.command = command;
+    r.file = lua_tostring(L, -1);
+    r.unwatched = unwatched;
+    r.i = 0;
+    if (!unwatched || path_each(path, path_recheck, &r) != 2) {
+      lua_remove(L, -2);                /* file */
+      return lua_tostring(L, -1);
+    }
+    memcpy(s.file, r.s.file, sizeof s.file);
+  }
+  else if (path_each(path, path_find, &s) <= 0) {
+    lua_pop(L, 2);
+    lua_pushnil(L);
+    errno = ENOENT;
+    return 0;
+  }
+  lua_pop(L, 1);                        /* commands */
+  lua_pushstring(L, s.file);            /* commands file */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, command);
+  lua_remove(L, -2);                    /* file */
+  return lua_tostring(L, -1);
+}
+
+/* Spawns the process described by p. The params are not changed, so they can
+ * be reused. If redirect is null, the file actions are built from p.
+ */
+static int spawn_param_execute(struct spawn_params *p,
+                               const posix_spawn_file_actions_t *redirect)
+{
+  lua_State *L = p->L;
+  posix_spawn_file_actions_t act;
+  child_actions_t cact;
+  const char **argv = p->argv, **envp = p->envp, *argv0[2], *command;
+  int ret = 0, i, child[3] = {-1, -1, -1};
+  struct process *proc;
+  double start = monotonic_time();
+  if (!(command = resolve_command(L, p->command))) {
+    stats_spawn(start, p->command, 0, 0);
+    return push_error(L);
+  }
+  if (!argv) {
+    argv = argv0;
+    argv[0] = p->command;
+    argv[1] = 0;
+  }
+  if (p->envblock)
+    envp = envblock_vector(p->envblock);
+  if (!envp)
+    envp = state_environ(L);
+  proc = process_new(L);
+  child_actions_init(&cact);
+  if (!redirect || spawn_param_internal(p)) {
+    ret = spawn_param_pipes(p, proc->pipes, child);
+    if (ret == 0)
+      ret = spawn_param_actions(p, &cact, child);
+  }
+  if (ret == 0 && spawn_param_internal(p))
+    ret = child_spawnp(&proc->pid, command, &cact, &p->setup,
+                       (char *const *)argv, (char *const *)envp);
+  else if (ret == 0) {
+    if (!redirect) {
+      ret = spawn_posix_actions(&cact, &act);
+      redirect = &act;
+    }
+    if (ret == 0)
+      ret = posix_spawnp(&proc->pid, command, redirect, 0,
+                         (char *const *)argv, (char *const *)envp);
+    if (redirect == &act)
+      posix_spawn_file_actions_destroy(&act);
+  }
+  if (ret > 0) errno = ret;
+  child_actions_destroy(&cact);
+  for (i = 0; i < 3; i++) {
+    close_fd(&child[i]);
+    if (ret != 0) close_fd(&proc->pipes[i]);
+  }
+  spawn_param_deadline(p, proc, start);
+  stats_spawn(start, p->command, ret == 0 ? proc->pid : 0, ret == 0);
+  return ret != 0 ? push_error(L) : 1;
+}
+
+/* Converts a Lua array of strings to a null-terminated array of char pointers.
+ * Pops a (0-based) Lua array and replaces it with a userdatum which is the
+ * null-terminated C array of char pointers.  The elements of this array point
+ * to the strings in the Lua array.  These strings should be associated with
+ * this userdatum via a weak table for GC purposes, but they are not here.
+ * Therefore, any function which calls this must make sure that these strings
+ * remain available until the userdatum is thrown away.
+ */
+/* ... array -- ... vector */
+static const char **make_vector(lua_State *L, int base)
+{
+  size_t i, n = lua_value_length(L, -1);
+  const char **vec;
+  n = n > (size_t)base ? n - base : 0;
+  vec = lua_newuserdata(L, (n + 2) * sizeof *vec);
+                                        /* ... arr vec */
+  for (i = 0; i <= n; i++) {
+    lua_rawgeti(L, -2, base + i);       /* ... arr vec elem */
+    vec[i] = lua_tostring(L, -1);
+    if (!vec[i] && i > 0) {
+      luaL_error(L, "expected string for argument %d, got %s",
+                 i, lua_typename(L, lua_type(L, -1)));
+      return 0;
+    }
+    lua_pop(L, 1);                      /* ... arr vec */
+  }
+  vec[n + 1] = 0;
+  lua_replace(L, -2);                   /* ... vector */
+  return vec;
+}
+
+/* ... envtab -- ... envtab vector */
+static void spawn_param_env(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  size_t i = 0;
+  lua_newtable(L);                      /* ... envtab arr */
+  lua_pushliteral(L, "=");              /* ... envtab arr "=" */
+  lua_pushnil(L);                       /* ... envtab arr "=" nil */
+  for (i = 0; lua_next(L, -4); i++) {   /* ... envtab arr "=" k v */
+    if (!lua_tostring(L, -2)) {
+      luaL_error(L, "expected string for environment variable name, got %s",
+                 lua_typename(L, lua_type(L, -2)));
+      return;
+    }
+    if (!lua_tostring(L, -1)) {
+      luaL_error(L, "expected string for environment variable value, got %s",
+                 lua_typename(L, lua_type(L, -1)));
+      return;
+    }
     lua_pushvalue(L, -2);               /* ... envtab arr "=" k v k */
     lua_pushvalue(L, -4);               /* ... envtab arr "=" k v k "=" */
     lua_pushvalue(L, -3);               /* ... envtab arr "=" k v k "=" v */
@@ -338,122 +2152,2809 @@ static void spawn_param_env(struct spawn_params *p)
     lua_pop(L, 1);                      /* ... envtab arr "=" k */
   }                                     /* ... envtab arr "=" */
   lua_pop(L, 1);                        /* ... envtab arr */
-  p->envp = make_vector(L);             /* ... envtab arr vector */
+  p->envp = make_vector(L, 0);          /* ... envtab arr vector */
+}
+
+/* ... envblock -- ... envblock */
+static void spawn_param_envblock(struct spawn_params *p, struct envblock *e)
+{
+  p->envblock = e;
+}
+
+/* The array elements from index base are the arguments. */
+/* ... argtab -- ... argtab vector */
+static void spawn_param_args(struct spawn_params *p, int base)
+{
+  const char **argv = make_vector(p->L, base);
+  if (!argv[0]) argv[0] = p->command;
+  p->argv = argv;
+}
+
+static FILE *check_file(lua_State *L, int idx, const char *argname)
+{
+  FILE **pf;
+  if (idx > 0) pf = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  else {
+    idx = absindex(L, idx);
+    pf = lua_touserdata(L, idx);
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    if (!pf || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
+      luaL_error(L, "bad %s option (%s expected, got %s)",
+                 argname, LUA_FILEHANDLE, luaL_typename(L, idx));
+    lua_pop(L, 2);
+  }
+#if LUA_VERSION_NUM >= 502
+  /* a closed stream keeps its FILE pointer, but not the close function */
+  if (!((luaL_Stream *)pf)->closef) pf = 0;
+  if (!pf || !*pf) return luaL_error(L, "attempt to use a closed file"), NULL;
+#else
+  if (!*pf) return luaL_error(L, "attempt to use a closed file"), NULL;
+#endif
+  return *pf;
+}
+
+#define new_dirent(L) lua_newtable(L)
+#define DIR_HANDLE "DIR*"
+
+/* the descriptor of a file, of a raw fd, or a descriptor number */
+static int get_fd(lua_State *L, int idx, const char *name)
+{
+  if (lua_type(L, idx) == LUA_TNUMBER)
+    return (int)lua_tonumber(L, idx);
+  if (to_rawfd(L, idx))
+    return check_rawfd(L, idx)->fd;
+  return fileno(check_file(L, idx, name));
+}
+
+static void get_redirect(lua_State *L,
+                         int idx, const char *stdname, struct spawn_params *p)
+{
+  lua_getfield(L, idx, stdname);
+  if (lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "capture"))
+    spawn_param_capture(p, stdname);
+  else if (!lua_isnil(L, -1))
+    spawn_param_redirect(p, stdname, get_fd(L, -1, stdname));
+  lua_pop(L, 1);
+}
+
+/* fds={[n]=file, ...} maps the files to the descriptors n of the child, from
+ * 3 on; inherit={file, ...} keeps the descriptors of the files open in the
+ * child, with the same number. The map stays on the stack.
+ */
+static void get_fdmap(lua_State *L, int idx, struct spawn_params *p)
+{
+  int n = 0, ninherit = 0, k = 0;
+  lua_getfield(L, idx, "fds");          /* ... fds */
+  if (!lua_isnil(L, -1)) {
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad fds option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) n++;
+  }
+  lua_getfield(L, idx, "inherit");      /* ... fds inherit */
+  if (!lua_isnil(L, -1)) {
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad inherit option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    ninherit = lua_value_length(L, -1);
+  }
+  if (n + ninherit == 0) {
+    lua_pop(L, 2);                      /* ... */
+    return;
+  }
+  p->fdmap = lua_newuserdata(L, (n + ninherit) * sizeof *p->fdmap);
+  lua_insert(L, -3);                    /* ... map fds inherit */
+  for (; k < ninherit; k++) {
+    lua_rawgeti(L, -1, k + 1);          /* ... map fds inherit file */
+    p->fdmap[k].fd = p->fdmap[k].target = get_fd(L, -1, "inherit");
+    lua_pop(L, 1);                      /* ... map fds inherit */
+  }
+  lua_pop(L, 1);                        /* ... map fds */
+  if (n) {
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1), k++) {
+      lua_Number target = lua_tonumber(L, -2);
+      if (lua_type(L, -2) != LUA_TNUMBER || target < 3
+          || target != (int)target || target > OPEN_MAX)
+        luaL_error(L, "bad fds option (descriptor numbers from 3 expected)");
+      p->fdmap[k].target = (int)target;
+      p->fdmap[k].fd = get_fd(L, -1, "fds");
+    }
+  }
+  lua_pop(L, 1);                        /* ... map */
+  p->nfdmap = k;
+}
+
+static const struct {
+  const char *name;
+  int resource;
+} rlimit_names[] = {
+#ifdef RLIMIT_AS
+  {"as", RLIMIT_AS},
+#endif
+  {"core", RLIMIT_CORE},
+  {"cpu", RLIMIT_CPU},
+  {"data", RLIMIT_DATA},
+  {"fsize", RLIMIT_FSIZE},
+#ifdef RLIMIT_MEMLOCK
+  {"memlock", RLIMIT_MEMLOCK},
+#endif
+  {"nofile", RLIMIT_NOFILE},
+#ifdef RLIMIT_NPROC
+  {"nproc", RLIMIT_NPROC},
+#endif
+  {"stack", RLIMIT_STACK},
+  {0, 0}
+};
+
+/* a limit is a non-negative number or "unlimited" */
+static rlim_t get_rlimit_value(lua_State *L, int idx, const char *name)
+{
+  lua_Number v;
+  if (lua_type(L, idx) == LUA_TSTRING
+      && !strcmp(lua_tostring(L, idx), "unlimited"))
+    return RLIM_INFINITY;
+  if (lua_type(L, idx) != LUA_TNUMBER || (v = lua_tonumber(L, idx)) < 0)
+    return luaL_error(L, "bad %s limit (non-negative number or 'unlimited' expected)",
+                      name);
+  return v >= (lua_Number)RLIM_INFINITY ? RLIM_INFINITY : (rlim_t)v;
+}
+
+/* rlimits={name=limit or {soft, hard}, ...} */
+static void get_rlimits(lua_State *L, int idx, struct child_setup *s)
+{
+  lua_getfield(L, idx, "rlimits");      /* ... rlimits */
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  if (!lua_istable(L, -1))
+    luaL_error(L, "bad rlimits option (table expected, got %s)",
+               luaL_typename(L, -1));
+  lua_pushnil(L);                       /* ... rlimits nil */
+  while (lua_next(L, -2)) {             /* ... rlimits name limit */
+    const char *name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "?";
+    struct rlimit *r;
+    int i;
+    for (i = 0; rlimit_names[i].name; i++)
+      if (!strcmp(rlimit_names[i].name, name)) break;
+    if (!rlimit_names[i].name)
+      luaL_error(L, "unknown resource limit %s", name);
+    if (s->nlimits >= CHILD_MAX_LIMITS)
+      luaL_error(L, "too many resource limits (at most %d)", CHILD_MAX_LIMITS);
+    s->limits[s->nlimits].resource = rlimit_names[i].resource;
+    r = &s->limits[s->nlimits++].value;
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);            /* ... rlimits name limit soft */
+      lua_rawgeti(L, -2, 2);            /* ... rlimits name limit soft hard */
+      r->rlim_cur = get_rlimit_value(L, -2, name);
+      r->rlim_max = get_rlimit_value(L, -1, name);
+      lua_pop(L, 2);                    /* ... rlimits name limit */
+    }
+    else
+      r->rlim_cur = r->rlim_max = get_rlimit_value(L, -1, name);
+    lua_pop(L, 1);                      /* ... rlimits name */
+  }
+  lua_pop(L, 1);                        /* ... */
+}
+
+/* Reads the options set in the child before the exec. The path of the
+ * cgroup.procs file stays on the stack, like the other strings of the params.
+ */
+static void get_setup(lua_State *L, int idx, struct spawn_params *p)
+{
+  struct child_setup *s = &p->setup;
+  int n = s->nlimits;
+  get_rlimits(L, idx, s);
+  p->has_setup |= s->nlimits > n;
+  lua_getfield(L, idx, "pgroup");       /* ... pgroup */
+  if (lua_toboolean(L, -1))
+    s->pgroup = PGROUP_NEW;
+  lua_getfield(L, idx, "session");      /* ... pgroup session */
+  if (lua_toboolean(L, -1))
+    s->pgroup = PGROUP_SESSION;
+  p->has_setup |= s->pgroup != 0;
+  lua_pop(L, 2);                        /* ... */
+  lua_getfield(L, idx, "nice");         /* ... nice */
+  if (!lua_isnil(L, -1)) {
+    if (lua_type(L, -1) != LUA_TNUMBER)
+      luaL_error(L, "bad nice option (number expected, got %s)",
+                 luaL_typename(L, -1));
+    s->set_nice = p->has_setup = 1;
+    s->nice = (int)lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);                        /* ... */
+  lua_getfield(L, idx, "ioprio");       /* ... ioprio */
+  if (!lua_isnil(L, -1)) {
+#ifdef __linux__
+    if (lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "idle"))
+      s->ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    else if (lua_type(L, -1) == LUA_TNUMBER
+             && lua_tonumber(L, -1) >= 0 && lua_tonumber(L, -1) <= 7)
+      s->ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT
+                  | (int)lua_tonumber(L, -1);
+    else
+      luaL_error(L, "bad ioprio option (number from 0 to 7 or 'idle' expected)");
+    p->has_setup = 1;
+#else
+    luaL_error(L, "the ioprio option is not supported on this platform");
+#endif
+  }
+  lua_pop(L, 1);                        /* ... */
+  lua_getfield(L, idx, "cpus");         /* ... cpus */
+  if (!lua_isnil(L, -1)) {
+#ifdef __linux__
+    size_t i, n;
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad cpus option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    n = lua_value_length(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_Number cpu;
+      lua_rawgeti(L, -1, i);            /* ... cpus cpu */
+      cpu = lua_tonumber(L, -1);
+      if (lua_type(L, -1) != LUA_TNUMBER || cpu < 0 || cpu >= CPU_SETSIZE)
+        luaL_error(L, "bad cpu %d in cpus option", (int)i);
+      CPU_SET((int)cpu, &s->cpus);
+      lua_pop(L, 1);                    /* ... cpus */
+    }
+    s->set_cpus = p->has_setup = 1;
+#else
+    luaL_error(L, "the cpus option is not supported on this platform");
+#endif
+  }
+  lua_pop(L, 1);                        /* ... */
+  lua_getfield(L, idx, "cgroup");       /* ... cgroup */
+  if (!lua_isnil(L, -1)) {
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "bad cgroup option (string expected, got %s)",
+                 luaL_typename(L, -1));
+    s->cgroup = lua_pushfstring(L, "%s/cgroup.procs", lua_tostring(L, -1));
+    lua_remove(L, -2);                  /* ... procs */
+    p->has_setup = 1;
+  }
+  else
+    lua_pop(L, 1);                      /* ... */
+}
+
+/* Parses the arguments of lc_spawn. Everything the params refer to is left
+ * on the stack. Returns null if the arguments are not valid.
+ */
+/* filename [args-opts] -- cmd opts ... */
+/* args-opts -- cmd opts ... */
+static struct spawn_params *spawn_parse(lua_State *L)
+{
+  struct spawn_params *params;
+  int have_options, first = 0;
+  switch (lua_type(L, 1)) {
+  default: return lua_report_type_error(L, 1, "string or table"), NULL;
+  case LUA_TSTRING:
+    switch (lua_type(L, 2)) {
+    default: return lua_report_type_error(L, 2, "table"), NULL;
+    case LUA_TNONE: have_options = 0; break;
+    case LUA_TTABLE: have_options = 1; break;
+    }
+    break;
+  case LUA_TTABLE:
+    have_options = 1;
+    lua_getfield(L, 1, "command");      /* opts ... cmd */
+    if (lua_isnil(L, -1)) {
+      /* {arg0,arg1,...}: the command is arg0, the arguments start from it */
+      lua_pop(L, 1);                    /* opts ... */
+      lua_rawgeti(L, 1, 1);             /* opts ... cmd */
+      first = 1;
+    }
+    lua_insert(L, 1);                   /* cmd opts ... */
+    if (lua_type(L, 1) != LUA_TSTRING)
+      return luaL_error(L, "bad command option (string expected, got %s)",
+                        luaL_typename(L, 1)), NULL;
+    break;
+  }
+  params = spawn_param_init(L);
+  /* get filename to execute */
+  spawn_param_filename(params, lua_tostring(L, 1));
+  /* get arguments, environment, and redirections */
+  if (have_options) {
+    lua_getfield(L, 2, "args");         /* cmd opts ... argtab */
+    switch (lua_type(L, -1)) {
+    default:
+      return luaL_error(L, "bad args option (table expected, got %s)",
+                        luaL_typename(L, -1)), NULL;
+    case LUA_TNIL:
+      lua_pop(L, 1);                    /* cmd opts ... */
+      lua_pushvalue(L, 2);              /* cmd opts ... opts */
+      spawn_param_args(params, first);  /* cmd opts ... */
+      break;
+    case LUA_TTABLE:
+      if (lua_value_length(L, 2) > (size_t)first)
+        return
+          luaL_error(L, "cannot specify both the args option and array values"), NULL;
+      spawn_param_args(params, 0);      /* cmd opts ... */
+      break;
+    }
+    lua_getfield(L, 2, "env");          /* cmd opts ... envtab */
+    switch (lua_type(L, -1)) {
+    default:
+      return luaL_error(L, "bad env option (table or %s expected, got %s)",
+                        ENVBLOCK_HANDLE, luaL_typename(L, -1)), NULL;
+    case LUA_TNIL:
+      break;
+    case LUA_TTABLE:
+      spawn_param_env(params);          /* cmd opts ... */
+      break;
+    case LUA_TUSERDATA:
+      spawn_param_envblock(params, check_envblock(L, -1));
+      break;
+    }
+    get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
+    get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
+    get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    lua_getfield(L, 2, "close_fds");        /* cmd opts ... close_fds */
+    spawn_param_close_fds(params, lua_toboolean(L, -1));
+    lua_pop(L, 1);                          /* cmd opts ... */
+    lua_getfield(L, 2, "timeout");          /* cmd opts ... timeout */
+    if (!lua_isnil(L, -1)) {
+      if (lua_type(L, -1) != LUA_TNUMBER || lua_tonumber(L, -1) < 0)
+        return luaL_error(L, "bad timeout option (non negative number expected)"), NULL;
+      params->timeout = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);                          /* cmd opts ... */
+    get_fdmap(L, 2, params);                /* cmd opts ... */
+    get_setup(L, 2, params);                /* cmd opts ... */
+  }
+  return params;
+}
+
+/* filename [args-opts] -- proc/nil error */
+/* args-opts -- proc/nil error */
+int lc_spawn(lua_State *L)
+{
+  struct spawn_params *params = spawn_parse(L);
+  if (!params) return 0;
+  return spawn_param_execute(params, 0);   /* proc/nil error */
+}
+
+/* A spawn spec parsed once by lc_prepare, to be spawned many times */
+struct template {
+  struct spawn_params *params;
+  int argc;
+  int ref;
+  int prebuilt;
+  posix_spawn_file_actions_t redirect;
+};
+
+/* Makes the strings of the vector owned by the table at index t. */
+static void anchor_vector(lua_State *L, int t, const char **vec)
+{
+  size_t n = lua_value_length(L, t);
+  for (; *vec; vec++) {
+    lua_pushstring(L, *vec);
+    *vec = lua_tostring(L, -1);
+    lua_rawseti(L, t, ++n);
+  }
+}
+
+/* Adds the file or fd at index idx to the array at index t, with its
+ * descriptor, if it is not a descriptor number.
+ */
+static void anchor_file(lua_State *L, int t, int idx, const char *name)
+{
+  size_t n = lua_value_length(L, t);
+  t = absindex(L, t);
+  idx = absindex(L, idx);
+  if (lua_type(L, idx) != LUA_TUSERDATA) return;
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, t, n + 1);
+  lua_pushnumber(L, get_fd(L, idx, name));
+  lua_rawseti(L, t, n + 2);
+}
+
+/* Keeps the files of the redirections and of the fds and inherit options,
+ * since only their descriptors are in the params.
+ */
+/* -- files */
+static void anchor_files(lua_State *L, int opts)
+{
+  static const char *const streams[] = {"stdin", "stdout", "stderr"};
+  static const char *const maps[] = {"fds", "inherit"};
+  int i;
+  lua_newtable(L);                      /* files */
+  for (i = 0; i < 3; i++) {
+    lua_getfield(L, opts, streams[i]);  /* files file */
+    anchor_file(L, -2, -1, streams[i]);
+    lua_pop(L, 1);                      /* files */
+  }
+  for (i = 0; i < 2; i++) {
+    lua_getfield(L, opts, maps[i]);     /* files map */
+    if (lua_istable(L, -1))
+      for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1))
+        anchor_file(L, -4, -1, maps[i]);
+    lua_pop(L, 1);                      /* files */
+  }
+}
+
+/* Checks that the files of the template are still open, on the same
+ * descriptors, since the prepared redirections refer to them.
+ */
+static void check_files(lua_State *L, struct template *t)
+{
+  size_t i, n;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+  lua_getfield(L, -1, "files");         /* anchor files */
+  n = lua_value_length(L, -1);
+  for (i = 1; i < n; i += 2) {
+    lua_rawgeti(L, -1, i);              /* anchor files file */
+    lua_rawgeti(L, -2, i + 1);          /* anchor files file fd */
+    if (get_fd(L, -2, "file") != lua_tonumber(L, -1))
+      luaL_error(L, "a file of the template was closed");
+    lua_pop(L, 2);                      /* anchor files */
+  }
+  lua_pop(L, 2);
+}
+
+/* filename [args-opts] -- template */
+/* args-opts -- template */
+int lc_prepare(lua_State *L)
+{
+  struct spawn_params *params = spawn_parse(L);
+  struct template *t;
+  int i, top;
+  if (!params) return 0;
+  if (!params->argv) {
+    params->argv = lua_newuserdata(L, 2 * sizeof *params->argv);
+    params->argv[0] = params->command;
+    params->argv[1] = 0;
+  }
+  /* keep alive all the values the params refer to */
+  top = lua_gettop(L);
+  lua_createtable(L, top, 0);           /* ... anchor */
+  for (i = 1; i <= top; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i);
+  }
+  anchor_vector(L, top + 1, params->argv);
+  if (params->envp) anchor_vector(L, top + 1, params->envp);
+  if (lua_istable(L, 2)) {
+    anchor_files(L, 2);                 /* ... anchor files */
+    lua_setfield(L, -2, "files");       /* ... anchor */
+  }
+  t = lua_newuserdata(L, sizeof *t);    /* ... anchor template */
+  t->params = params;
+  t->ref = LUA_NOREF;
+  t->prebuilt = 0;
+  for (t->argc = 0; params->argv[t->argc]; t->argc++);
+  luaL_getmetatable(L, TEMPLATE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_insert(L, -2);                    /* ... template anchor */
+  t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* the pipes of the captured streams change at each spawn */
+  if (!spawn_param_captures(params) && !spawn_param_internal(params)) {
+    child_actions_t cact;
+    child_actions_init(&cact);
+    if (0 == spawn_param_actions(params, &cact, 0)) {
+      if (spawn_posix_actions(&cact, &t->redirect))
+        posix_spawn_file_actions_destroy(&t->redirect);
+      else
+        t->prebuilt = 1;
+    }
+    child_actions_destroy(&cact);
+  }
+  return 1;
+}
+
+/* template [argtab] -- proc/nil error */
+int template_spawn(lua_State *L)
+{
+  struct template *t = luaL_checkudata(L, 1, TEMPLATE_HANDLE);
+  struct spawn_params p = *t->params;
+  p.L = L;
+  check_files(L, t);
+  if (!lua_isnoneornil(L, 2)) {
+    size_t i, n;
+    const char **argv;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = lua_value_length(L, 2);
+    luaL_checkstack(L, n + 1, "too many arguments");
+    argv = lua_newuserdata(L, (t->argc + n + 1) * sizeof *argv);
+    memcpy(argv, p.argv, t->argc * sizeof *argv);
+    for (i = 0; i < n; i++) {
+      /* the element stays on the stack, since tostring can convert it */
+      lua_rawgeti(L, 2, i + 1);
+      argv[t->argc + i] = lua_tostring(L, -1);
+      if (!argv[t->argc + i])
+        return luaL_error(L, "expected string for argument %d, got %s",
+                          (int)(t->argc + i), luaL_typename(L, -1));
+    }
+    argv[t->argc + n] = 0;
+    p.argv = argv;
+  }
+  return spawn_param_execute(&p, t->prebuilt ? &t->redirect : 0);
+}
+
+/* template -- */
+int template_gc(lua_State *L)
+{
+  struct template *t = luaL_checkudata(L, 1, TEMPLATE_HANDLE);
+  if (t->prebuilt)
+    posix_spawn_file_actions_destroy(&t->redirect);
+  t->prebuilt = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+  t->ref = LUA_NOREF;
+  return 0;
+}
+
+/* Spawns a stage of lc_pipeline, with the stdin and the stdout connected to
+ * the in and out descriptors, if they are not negative.
+ */
+/* spec in out -- proc/nil error */
+static int pipeline_spawn(lua_State *L)
+{
+  int in = lua_tonumber(L, 2), out = lua_tonumber(L, 3);
+  struct spawn_params *params;
+  lua_settop(L, 1);
+  params = spawn_parse(L);
+  if (!params) return 0;
+  if (in >= 0) {
+    params->dups[0] = in;
+    params->capture[0] = 0;
+  }
+  if (out >= 0) {
+    params->dups[1] = out;
+    params->capture[1] = 0;
+  }
+  return spawn_param_execute(params, 0);   /* proc/nil error */
+}
+
+/* Kills and reaps the first n stages, when a later one can not be spawned */
+/* procs at idx */
+static void pipeline_abort(lua_State *L, int idx, int n)
+{
+  int i;
+  for (i = 1; i <= n; i++) {
+    struct process *p;
+    lua_rawgeti(L, idx, i);
+    p = lua_touserdata(L, -1);
+    process_kill_tree(p, SIGKILL, 0);
+    process_reap(p, 1);
+    lua_pop(L, 1);
+  }
+}
+
+/* {spec1, spec2, ..., pipe_size=n, wait=bool} -- procs [codes]/nil error */
+int lc_pipeline(lua_State *L)
+{
+  int i, n, size, wait, in = -1, fd[2];
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  n = lua_value_length(L, 1);
+  lua_getfield(L, 1, "pipe_size");      /* opts size */
+  size = lua_tonumber(L, -1);
+  lua_getfield(L, 1, "wait");           /* opts size wait */
+  wait = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_settop(L, 1);
+  lua_createtable(L, n, 0);             /* opts procs */
+  for (i = 1; i <= n; i++) {
+    int status;
+    fd[0] = fd[1] = -1;
+    if (i < n) {
+      if (-1 == cloexec_pipe(fd)) {
+        int err = errno;
+        close_fd(&in);
+        pipeline_abort(L, 2, i - 1);
+        errno = err;
+        return push_error(L);
+      }
+#ifdef F_SETPIPE_SZ
+      if (size > 0) fcntl(fd[1], F_SETPIPE_SZ, size);
+#endif
+    }
+    lua_pushcfunction(L, pipeline_spawn);
+    lua_rawgeti(L, 1, i);
+    lua_pushnumber(L, in);
+    lua_pushnumber(L, fd[1]);
+    status = lua_pcall(L, 3, 2, 0);     /* opts procs proc/nil error */
+    /* the stage owns its side of the pipes now */
+    close_fd(&in);
+    close_fd(&fd[1]);
+    in = fd[0];
+    if (status || lua_isnil(L, -2)) {
+      close_fd(&in);
+      pipeline_abort(L, 2, i - 1);
+      if (status) return lua_error(L);
+      return 2;
+    }
+    lua_pop(L, 1);                      /* opts procs proc */
+    lua_rawseti(L, 2, i);               /* opts procs */
+  }
+  if (!wait) return 1;
+  lua_pushcfunction(L, lc_waitall);
+  lua_pushvalue(L, 2);
+  lua_call(L, 1, 2);                    /* opts procs codes/nil error */
+  if (lua_isnil(L, -2)) return 2;
+  lua_pop(L, 1);                        /* opts procs codes */
+  return 2;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+#define COPY_CHUNK (1 << 20)
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/* Moves up to n bytes from the descriptor in to out, or all the data until the
+ * end of file if n is negative. Under linux the data is moved in the kernel
+ * with splice, when one of the two is a pipe, or else with copy_file_range or
+ * sendfile. When none of them can be used, it falls back to read and write.
+ * Returns the moved bytes, or -1.
+ */
+static long long fd_copy(int in, int out, long long n)
+{
+  enum { SPLICE, COPY_RANGE, SENDFILE, READ_WRITE } mode;
+  long long total = 0;
+  char *buf = 0;
+#ifdef __linux__
+  mode = SPLICE;
+#else
+  mode = READ_WRITE;
+#endif
+  while (n != 0) {
+    size_t len = n < 0 || n > COPY_CHUNK ? COPY_CHUNK : (size_t)n;
+    int tried = (int)mode;
+    ssize_t r = -1;
+#ifdef __linux__
+    switch (mode) {
+    case SPLICE:
+      r = splice(in, 0, out, 0, len, SPLICE_F_MOVE);
+      if (r == -1 && errno == EINVAL) mode = COPY_RANGE;
+      break;
+    case COPY_RANGE:
+#ifdef SYS_copy_file_range
+      r = syscall(SYS_copy_file_range, in, 0, out, 0, len, 0);
+#else
+      errno = ENOSYS;
+#endif
+      if (r == -1 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                      || errno == EBADF))
+        mode = SENDFILE;
+      break;
+    case SENDFILE:
+      r = sendfile(out, in, 0, len);
+      if (r == -1 && (errno == EINVAL || errno == ENOSYS))
+        mode = READ_WRITE;
+      break;
+    default:
+      break;
+    }
+#endif
+    if (mode == READ_WRITE) {
+      if (!buf && !(buf = malloc(COPY_CHUNK))) return -1;
+      r = read(in, buf, len);
+      if (r > 0 && write_all(out, buf, r) == -1) r = -1;
+    }
+    /* on failure, retry with the next method */
+    if (r == -1 && (errno == EINTR || (int)mode != tried)) continue;
+    if (r == -1) {
+      free(buf);
+      return -1;
+    }
+    if (r == 0) break;
+    total += r;
+    if (n > 0) n -= r;
+  }
+  free(buf);
+  return total;
+}
+
+/* Copies up to n bytes from the descriptor in to both out1 and out2, or all
+ * the data until the end of file if n is negative. Under linux, when all of
+ * them are pipes, the data is duplicated in the kernel with tee and then moved
+ * with splice. Returns the copied bytes, or -1.
+ */
+static long long fd_tee(int in, int out1, int out2, long long n)
+{
+  long long total = 0;
+  char *buf = 0;
+#ifdef __linux__
+  while (n != 0) {
+    size_t len = n < 0 || n > COPY_CHUNK ? COPY_CHUNK : (size_t)n;
+    ssize_t r = tee(in, out1, len, 0);
+    if (r == -1 && errno == EINTR) continue;
+    if (r == -1 && errno == EINVAL) break;
+    if (r == -1) return -1;
+    if (r == 0) return total;
+    /* tee does not consume the data, move the same bytes to out2 */
+    if (fd_copy(in, out2, r) != r) return -1;
+    total += r;
+    if (n > 0) n -= r;
+  }
+#endif
+  if (!(buf = malloc(COPY_CHUNK))) return -1;
+  while (n != 0) {
+    size_t len = n < 0 || n > COPY_CHUNK ? COPY_CHUNK : (size_t)n;
+    ssize_t r = read(in, buf, len);
+    if (r == -1 && errno == EINTR) continue;
+    if (r == -1 || (r > 0 && (write_all(out1, buf, r) == -1
+                              || write_all(out2, buf, r) == -1))) {
+      free(buf);
+      return -1;
+    }
+    if (r == 0) break;
+    total += r;
+    if (n > 0) n -= r;
+  }
+  free(buf);
+  return total;
+}
+
+/* The bytes that the stream has read ahead of its descriptor, 0 if unknown.
+ * Without access to the buffer, a seekable file still tells them by its
+ * offset.
+ */
+static long long file_buffered(FILE *f)
+{
+#if defined(__GLIBC__)
+  return f->_IO_read_end - f->_IO_read_ptr;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+  || defined(__NetBSD__)
+  return f->_r > 0 ? f->_r : 0;
+#else
+  off_t pos = lseek(fileno(f), 0, SEEK_CUR), at = ftello(f);
+  return pos == -1 || at == -1 || pos < at ? 0 : pos - at;
+#endif
+}
+
+/* Writes to the descriptors out the data read ahead by the stream, up to n
+ * bytes if n is not negative. Returns the written bytes, or -1.
+ */
+static long long file_drain(FILE *f, const int *out, int nout, long long n)
+{
+  char buf[4096];
+  long long total = 0, left = file_buffered(f);
+  if (n >= 0 && left > n) left = n;
+  while (left > 0) {
+    size_t len = left > (long long)sizeof buf ? sizeof buf : (size_t)left;
+    int i;
+    /* the bytes are in the buffer, so fread does not read the descriptor */
+    len = fread(buf, 1, len, f);
+    if (len == 0) break;
+    for (i = 0; i < nout; i++)
+      if (-1 == write_all(out[i], buf, len)) return -1;
+    total += len;
+    left -= len;
+  }
+  return total;
+}
+
+/* The descriptor of a file or of a raw side of a pipe. f is the file, or
+ * null for a raw fd; a file to be written is flushed.
+ */
+static int copy_arg(lua_State *L, int idx, const char *name, FILE **f)
+{
+  *f = 0;
+  if (to_rawfd(L, idx)) return check_rawfd(L, idx)->fd;
+  *f = check_file(L, idx, name);
+  return fileno(*f);
+}
+
+/* Moves the data of src to the n descriptors out: first the data buffered
+ * by the stream of src, if it is a file, then the one of its descriptor.
+ */
+/* src dst... [nbytes] -- nbytes/nil error */
+static int copy_to(lua_State *L, int nout)
+{
+  FILE *src, *dst;
+  int in = copy_arg(L, 1, "src", &src), out[2], i;
+  long long n = luaL_optnumber(L, nout + 2, -1), total = 0, moved;
+  for (i = 0; i < nout; i++) {
+    out[i] = copy_arg(L, i + 2, nout == 1 ? "dst" : i ? "dst2" : "dst1", &dst);
+    if (dst) fflush(dst);
+  }
+  if (src && -1 == (total = file_drain(src, out, nout, n)))
+    return push_error(L);
+  if (n >= 0) n -= total;
+  if (n != 0) {
+    moved = nout == 1 ? fd_copy(in, out[0], n) : fd_tee(in, out[0], out[1], n);
+    if (moved == -1) return push_error(L);
+    total += moved;
+  }
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+/* src dst [nbytes] -- nbytes/nil error */
+int lc_splice(lua_State *L)
+{
+  return copy_to(L, 1);
+}
+
+/* src dst1 dst2 [nbytes] -- nbytes/nil error */
+int lc_tee(lua_State *L)
+{
+  return copy_to(L, 2);
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* file -- fd */
+int lc_fileno(lua_State *L)
+{
+  lua_pushnumber(L, fileno(check_file(L, 1, "file")));
+  return 1;
+}
+
+#define POLL_READ 1
+#define POLL_WRITE 2
+#define POLL_EXIT 4
+
+/* Waits on many descriptors and processes. It uses epoll under linux, and
+ * poll elsewhere. The objects are kept in the objs table, by descriptor,
+ * and the events they are waited for in the masks one. The fds table maps
+ * back the objects of poller:add to their descriptor, since the one of a
+ * process is closed when it is reaped.
+ */
+struct poller {
+  int epfd;
+  int objs;
+  int masks;
+  int fds;
+};
+
+/* -- poller/nil error */
+int lc_poller(lua_State *L)
+{
+  struct poller *pl = lua_newuserdata(L, sizeof *pl);
+  pl->epfd = -1;
+  pl->objs = pl->masks = pl->fds = LUA_NOREF;
+  luaL_getmetatable(L, POLLER_HANDLE);
+  lua_setmetatable(L, -2);
+#ifdef __linux__
+  pl->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (pl->epfd == -1) return push_error(L);
+#endif
+  lua_newtable(L);
+  pl->objs = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  pl->masks = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  pl->fds = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static struct poller *check_poller(lua_State *L, int idx)
+{
+  struct poller *pl = luaL_checkudata(L, idx, POLLER_HANDLE);
+  if (pl->objs == LUA_NOREF) return luaL_error(L, "attempt to use a closed poller"), NULL;
+  return pl;
+}
+
+/* Returns the descriptor to wait on for the object at idx, that can be a
+ * process, a raw pipe side, a lua file or a descriptor number. For a process
+ * *mask is changed to POLL_EXIT.
+ */
+static int poller_object_fd(lua_State *L, int idx, int *mask)
+{
+  struct process *p;
+  if (lua_type(L, idx) == LUA_TNUMBER)
+    return lua_tonumber(L, idx);
+  if (to_rawfd(L, idx))
+    return check_rawfd(L, idx)->fd;
+  p = to_process(L, idx);
+  if (p) {
+    *mask = POLL_EXIT;
+    return process_pidfd(p);
+  }
+  return fileno(check_file(L, idx, "object"));
+}
+
+static int poller_mask(lua_State *L, int idx)
+{
+  const char *ev = luaL_optstring(L, idx, "r");
+  int mask = 0;
+  if (strchr(ev, 'r')) mask |= POLL_READ;
+  if (strchr(ev, 'w')) mask |= POLL_WRITE;
+  if (!mask) luaL_argerror(L, idx, "events must contain 'r' or 'w'");
+  return mask;
+}
+
+/* Sets the object of the descriptor fd in the poller tables, or removes it
+ * if mask is 0.
+ */
+/* ... obj -- ... */
+static void poller_store(lua_State *L, struct poller *pl, int fd, int mask)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->objs);
+  lua_insert(L, -2);
+  if (!mask) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_rawseti(L, -2, fd);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->masks);
+  if (mask) lua_pushnumber(L, mask);
+  else lua_pushnil(L);
+  lua_rawseti(L, -2, fd);
+  lua_pop(L, 2);
+}
+
+/* Registers the descriptor fd for the events of mask, with the object on the
+ * top of the stack. Returns 0, or -1 and errno.
+ */
+/* ... obj -- ... */
+static int poller_watch(lua_State *L, struct poller *pl, int fd, int mask)
+{
+#ifdef __linux__
+  struct epoll_event ev;
+  ev.events = (mask & POLL_WRITE ? EPOLLOUT : 0)
+    | (mask & (POLL_READ | POLL_EXIT) ? EPOLLIN : 0);
+  ev.data.fd = fd;
+  if (-1 == epoll_ctl(pl->epfd, EPOLL_CTL_ADD, fd, &ev)
+      && (errno != EEXIST || -1 == epoll_ctl(pl->epfd, EPOLL_CTL_MOD, fd, &ev))) {
+    lua_pop(L, 1);
+    return -1;
+  }
+#endif
+  poller_store(L, pl, fd, mask);
+  return 0;
+}
+
+static void poller_unwatch(lua_State *L, struct poller *pl, int fd)
+{
+#ifdef __linux__
+  epoll_ctl(pl->epfd, EPOLL_CTL_DEL, fd, 0);
+#endif
+  lua_pushnil(L);
+  poller_store(L, pl, fd, 0);
+}
+
+/* Sets the descriptor the object at idx was added with, or clears it when fd
+ * is -1.
+ */
+static void poller_set_fd(lua_State *L, struct poller *pl, int idx, int fd)
+{
+  idx = absindex(L, idx);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->fds);
+  lua_pushvalue(L, idx);
+  if (fd >= 0) lua_pushnumber(L, fd);
+  else lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* Removes the object at idx, with the descriptor it was added with. The
+ * descriptor is unwatched only if it still belongs to the object, i.e. its
+ * number was not reused by another object of the poller.
+ */
+static void poller_drop(lua_State *L, struct poller *pl, int idx)
+{
+  int fd = -1, own;
+  idx = absindex(L, idx);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->fds);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1)) fd = lua_tonumber(L, -1);
+  lua_pop(L, 2);
+  if (fd < 0) return;
+  poller_set_fd(L, pl, idx, -1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->objs);
+  lua_rawgeti(L, -1, fd);
+  own = lua_rawequal(L, -1, idx);
+  lua_pop(L, 2);
+  if (own) poller_unwatch(L, pl, fd);
+}
+
+/* Drops the processes whose pidfd was closed since they were added */
+static void poller_prune(lua_State *L, struct poller *pl)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->fds);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    struct process *p = to_process(L, -2);
+    if (p && p->pidfd != (int)lua_tonumber(L, -1))
+      poller_drop(L, pl, -2);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+/* poller obj [events] -- true/nil error */
+int poller_add(lua_State *L)
+{
+  struct poller *pl = check_poller(L, 1);
+  int mask = poller_mask(L, 3);
+  int fd = poller_object_fd(L, 2, &mask);
+  poller_prune(L, pl);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, lua_isuserdata(L, 2) && mask == POLL_EXIT
+                   ? "process already terminated or no pidfd support"
+                   : "bad descriptor");
+    return 2;
+  }
+  /* a stale object of a reused descriptor is replaced */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->objs);
+  lua_rawgeti(L, -1, fd);
+  if (!lua_isnil(L, -1) && !lua_rawequal(L, -1, 2))
+    poller_set_fd(L, pl, -1, -1);
+  lua_pop(L, 2);
+  lua_pushvalue(L, 2);
+  if (poller_watch(L, pl, fd, mask)) return push_error(L);
+  poller_set_fd(L, pl, 2, fd);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* poller obj -- true */
+int poller_remove(lua_State *L)
+{
+  struct poller *pl = check_poller(L, 1);
+  luaL_checkany(L, 2);
+  poller_drop(L, pl, 2);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Appends the object of fd to the objs array at index -2, and its events to
+ * the array at index -1.
+ */
+/* ... objs events -- ... objs events */
+static void poller_push_ready(lua_State *L, struct poller *pl, int fd,
+                              int ready, int n)
+{
+  int mask;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->masks);
+  lua_rawgeti(L, -1, fd);
+  mask = lua_tonumber(L, -1);
+  lua_pop(L, 2);
+  if (!mask) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->objs);
+  lua_rawgeti(L, -1, fd);
+  lua_rawseti(L, -4, n);
+  lua_pop(L, 1);
+  if (mask == POLL_EXIT) lua_pushliteral(L, "exit");
+  else if ((ready & mask) == (POLL_READ | POLL_WRITE)) lua_pushliteral(L, "rw");
+  else if (ready & mask & POLL_WRITE) lua_pushliteral(L, "w");
+  else lua_pushliteral(L, "r");
+  lua_rawseti(L, -2, n);
+}
+
+/* poller [timeout] -- objs events/nil error */
+int poller_wait(lua_State *L)
+{
+  struct poller *pl = check_poller(L, 1);
+  double timeout = luaL_optnumber(L, 2, -1);
+  int i, n = 0, ms = poll_ms(timeout);
+  poller_prune(L, pl);
+#ifdef __linux__
+  struct epoll_event evs[256];
+  int r = epoll_wait(pl->epfd, evs, sizeof evs / sizeof *evs, ms);
+  if (r == -1 && errno != EINTR) return push_error(L);
+  lua_newtable(L);
+  lua_newtable(L);
+  for (i = 0; i < r; i++) {
+    int ready = 0;
+    if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ready |= POLL_READ;
+    if (evs[i].events & (EPOLLOUT | EPOLLERR)) ready |= POLL_WRITE;
+    poller_push_ready(L, pl, evs[i].data.fd, ready, ++n);
+  }
+#else
+  struct pollfd *pfd;
+  int m = 0, r;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pl->masks);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    m++;
+    lua_pop(L, 1);
+  }
+  pfd = lua_newuserdata(L, (m + 1) * sizeof *pfd);
+  m = 0;
+  lua_pushnil(L);
+  while (lua_next(L, -3)) {
+    int mask = lua_tonumber(L, -1);
+    pfd[m].fd = lua_tonumber(L, -2);
+    pfd[m].events = (mask & POLL_WRITE ? POLLOUT : 0)
+      | (mask & (POLL_READ | POLL_EXIT) ? POLLIN : 0);
+    m++;
+    lua_pop(L, 1);
+  }
+  r = poll(pfd, m, ms);
+  if (r == -1 && errno != EINTR) return push_error(L);
+  lua_newtable(L);
+  lua_newtable(L);
+  for (i = 0; r > 0 && i < m; i++) {
+    int ready = 0;
+    if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) ready |= POLL_READ;
+    if (pfd[i].revents & (POLLOUT | POLLERR)) ready |= POLL_WRITE;
+    if (ready) poller_push_ready(L, pl, pfd[i].fd, ready, ++n);
+  }
+#endif
+  return 2;
+}
+
+/* poller -- */
+int poller_close(lua_State *L)
+{
+  struct poller *pl = luaL_checkudata(L, 1, POLLER_HANDLE);
+  if (pl->epfd >= 0) close(pl->epfd);
+  pl->epfd = -1;
+  luaL_unref(L, LUA_REGISTRYINDEX, pl->objs);
+  luaL_unref(L, LUA_REGISTRYINDEX, pl->masks);
+  luaL_unref(L, LUA_REGISTRYINDEX, pl->fds);
+  pl->objs = pl->masks = pl->fds = LUA_NOREF;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* The loop runs tasks, i.e. coroutines, that wait for processes and pipes
+ * with its methods. When an operation would block, the task is registered in
+ * a poller and it yields; the loop retries the operation when the poller
+ * reports it as ready, and it resumes the task with the results. So the
+ * operations yield from C only at their return, as both lua 5.1 and 5.3
+ * allow, without continuations.
+ */
+struct loop {
+  int ref;      /* {poller, tasks, timed} */
+  int tasks;
+  int watched;
+};
+
+#define LOOP_POLLER 1
+#define LOOP_TASKS 2
+#define LOOP_TIMED 3
+
+/* The waiter of a task is a table with these fields */
+#define W_CO 1
+#define W_STEP 2
+#define W_KIND 3
+#define W_OBJ 4
+#define W_DATA 5
+#define W_NUM 6
+#define W_OUT 7        /* 7, 8: the chunks of the captured stdout and stderr */
+#define W_NFDS 9
+#define W_FDS 10       /* 10, 11, 12: the watched descriptors */
+
+enum { OP_READ, OP_WRITE, OP_WAIT, OP_COMMUNICATE, OP_SLEEP };
+
+/* Like write, but a closed reader gives EPIPE without raising SIGPIPE. */
+static ssize_t write_nosigpipe(int fd, const void *buf, size_t len)
+{
+  sigset_t set, old, pending;
+  ssize_t r;
+  int sig;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  r = write(fd, buf, len);
+  if (r == -1 && errno == EPIPE) {
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE) && !sigismember(&old, SIGPIPE))
+      sigwait(&set, &sig);
+    errno = EPIPE;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  return r;
+}
+
+static void set_nonblock(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int push_pending(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "timeout");
+  return 2;
+}
+
+static int is_pending(lua_State *L, int nres)
+{
+  return nres == 2 && lua_isnil(L, -2) && lua_type(L, -1) == LUA_TSTRING
+    && !strcmp(lua_tostring(L, -1), "timeout");
+}
+
+/* The steps do the operation of a waiter without blocking, returning
+ * nil, "timeout" if it can not be completed yet.
+ */
+
+/* waiter -- data/nil [error] */
+static int step_read(lua_State *L)
+{
+  lua_rawgeti(L, 1, W_OBJ);
+  lua_rawgeti(L, 1, W_NUM);
+  lua_remove(L, 1);
+  return rawfd_read(L);
+}
+
+/* waiter -- n/nil error */
+static int step_write(lua_State *L)
+{
+  struct rawfd *f;
+  size_t len, pos;
+  const char *data;
+  lua_rawgeti(L, 1, W_OBJ);
+  f = check_rawfd(L, -1);
+  lua_rawgeti(L, 1, W_DATA);
+  data = lua_tolstring(L, -1, &len);
+  lua_rawgeti(L, 1, W_NUM);
+  pos = lua_tonumber(L, -1);
+  while (pos < len) {
+    ssize_t w = write_nosigpipe(f->fd, data + pos, len - pos);
+    if (w == -1 && errno == EINTR) continue;
+    if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (w == -1) return push_error(L);
+    pos += w;
+  }
+  lua_pushnumber(L, pos);
+  lua_rawseti(L, 1, W_NUM);
+  if (pos < len) return push_pending(L);
+  lua_pushnumber(L, len);
+  return 1;
+}
+
+/* waiter -- exitcode/nil error */
+static int step_wait(lua_State *L)
+{
+  lua_rawgeti(L, 1, W_OBJ);
+  lua_replace(L, 1);
+  return process_poll(L);
+}
+
+/* waiter -- */
+static int step_sleep(lua_State *L)
+{
+  lua_rawgeti(L, 1, W_NUM);
+  if (monotonic_time() < lua_tonumber(L, -1)) return push_pending(L);
+  return 0;
+}
+
+/* waiter -- out err exitcode/nil error */
+static int step_communicate(lua_State *L)
+{
+  struct process *p;
+  char buf[16384];
+  int i, ret;
+  lua_rawgeti(L, 1, W_OBJ);
+  p = lua_touserdata(L, -1);
+  if (p->pipes[0] >= 0) {
+    size_t len, pos;
+    const char *input;
+    lua_rawgeti(L, 1, W_DATA);
+    input = lua_tolstring(L, -1, &len);
+    lua_rawgeti(L, 1, W_NUM);
+    pos = lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    while (pos < len) {
+      ssize_t w = write_nosigpipe(p->pipes[0], input + pos, len - pos);
+      if (w > 0) pos += w;
+      /* EPIPE just means that the child does not read all the input */
+      else if (errno != EINTR) break;
+    }
+    if (pos == len || (errno != EAGAIN && errno != EWOULDBLOCK))
+      close_fd(&p->pipes[0]);
+    lua_pushnumber(L, pos);
+    lua_rawseti(L, 1, W_NUM);
+  }
+  for (i = 1; i < 3; i++) {
+    size_t n;
+    if (p->pipes[i] < 0) continue;
+    lua_rawgeti(L, 1, W_OUT + i - 1);   /* waiter proc chunks */
+    n = lua_value_length(L, -1);
+    for (;;) {
+      ssize_t r = read(p->pipes[i], buf, sizeof buf);
+      if (r == -1 && errno == EINTR) continue;
+      if (r > 0) {
+        lua_pushlstring(L, buf, r);
+        lua_rawseti(L, -2, ++n);
+        continue;
+      }
+      if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        close_fd(&p->pipes[i]);
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  if (p->pipes[0] >= 0 || p->pipes[1] >= 0 || p->pipes[2] >= 0)
+    return push_pending(L);
+  ret = process_reap(p, 0);
+  if (ret == -1) return push_error(L);
+  if (ret == 0) return push_pending(L);
+  for (i = 1; i < 3; i++) {
+    lua_rawgeti(L, 1, W_OUT + i - 1);
+    if (lua_istable(L, -1)) {
+      size_t j, n = lua_value_length(L, -1);
+      int chunks = lua_gettop(L);
+      luaL_Buffer b;
+      luaL_buffinit(L, &b);
+      for (j = 1; j <= n; j++) {
+        lua_rawgeti(L, chunks, j);
+        luaL_addvalue(&b);
+      }
+      luaL_pushresult(&b);
+      lua_replace(L, chunks);
+    }
+  }
+  lua_pushnumber(L, p->status);
+  return 3;
+}
+
+static struct loop *check_loop(lua_State *L, int idx)
+{
+  return luaL_checkudata(L, idx, LOOP_HANDLE);
+}
+
+/* loop -- loop state */
+static void loop_state(lua_State *L, struct loop *lp)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lp->ref);
+}
+
+/* -- loop/nil error */
+int lc_loop(lua_State *L)
+{
+  struct loop *lp = lua_newuserdata(L, sizeof *lp);  /* loop */
+  lp->ref = LUA_NOREF;
+  lp->tasks = lp->watched = 0;
+  luaL_getmetatable(L, LOOP_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 3, 0);             /* loop state */
+  lc_poller(L);                         /* loop state poller/nil error */
+  if (lua_isnil(L, -2)) return 2;
+  lua_rawseti(L, -2, LOOP_POLLER);
+  lua_newtable(L);
+  lua_rawseti(L, -2, LOOP_TASKS);
+  lua_newtable(L);
+  lua_rawseti(L, -2, LOOP_TIMED);
+  lp->ref = luaL_ref(L, LUA_REGISTRYINDEX);  /* loop */
+  return 1;
+}
+
+/* loop -- */
+int loop_gc(lua_State *L)
+{
+  struct loop *lp = luaL_checkudata(L, 1, LOOP_HANDLE);
+  luaL_unref(L, LUA_REGISTRYINDEX, lp->ref);
+  lp->ref = LUA_NOREF;
+  return 0;
+}
+
+/* Registers the waiter at index w in the poller, for the descriptors its
+ * operation depends on, or in the timed set if there is none.
+ */
+static void loop_watch(lua_State *L, struct loop *lp, int w)
+{
+  struct poller *pl;
+  int fds[3], masks[3], i, n = 0, kind;
+  struct process *p;
+  lua_rawgeti(L, w, W_KIND);
+  kind = lua_tonumber(L, -1);
+  lua_rawgeti(L, w, W_OBJ);
+  switch (kind) {
+  case OP_READ:
+  case OP_WRITE:
+    fds[n] = ((struct rawfd *)lua_touserdata(L, -1))->fd;
+    masks[n++] = kind == OP_READ ? POLL_READ : POLL_WRITE;
+    break;
+  case OP_COMMUNICATE:
+    p = lua_touserdata(L, -1);
+    for (i = 0; i < 3; i++) {
+      if (p->pipes[i] < 0) continue;
+      fds[n] = p->pipes[i];
+      masks[n++] = i == 0 ? POLL_WRITE : POLL_READ;
+    }
+    if (n > 0) break;
+    /*FALLTHRU*/
+  case OP_WAIT:
+    /* a process with a deadline is checked with the timed waiters */
+    p = lua_touserdata(L, -1);
+    fds[n] = p->deadline > 0 ? -1 : process_pidfd(p);
+    masks[n] = POLL_EXIT;
+    if (fds[n] >= 0) n++;
+    break;
+  }
+  lua_pop(L, 2);
+  loop_state(L, lp);                    /* ... state */
+  lua_rawgeti(L, -1, LOOP_POLLER);      /* ... state poller */
+  pl = lua_touserdata(L, -1);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pl->objs);
+    lua_rawgeti(L, -1, fds[i]);
+    if (!lua_isnil(L, -1)) {
+      int fd = fds[i];
+      while (i-- > 0) poller_unwatch(L, pl, fds[i]);
+      luaL_error(L, "descriptor %d is already waited by another task", fd);
+    }
+    lua_pop(L, 2);
+    lua_pushvalue(L, w);
+    if (poller_watch(L, pl, fds[i], masks[i])) {
+      const char *err = strerror(errno);
+      while (i-- > 0) poller_unwatch(L, pl, fds[i]);
+      luaL_error(L, "can not wait: %s", err);
+    }
+    lua_pushnumber(L, fds[i]);
+    lua_rawseti(L, w, W_FDS + i);
+  }
+  lua_pushnumber(L, n);
+  lua_rawseti(L, w, W_NFDS);
+  lp->watched += n;
+  if (n == 0) {
+    lua_rawgeti(L, -2, LOOP_TIMED);     /* ... state poller timed */
+    lua_pushvalue(L, w);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+}
+
+static void loop_unwatch(lua_State *L, struct loop *lp, int w)
+{
+  struct poller *pl;
+  int i, n;
+  loop_state(L, lp);                    /* ... state */
+  lua_rawgeti(L, -1, LOOP_POLLER);      /* ... state poller */
+  pl = lua_touserdata(L, -1);
+  lua_rawgeti(L, w, W_NFDS);
+  n = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, w, W_FDS + i);
+    poller_unwatch(L, pl, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+  }
+  lp->watched -= n;
+  lua_pushnumber(L, 0);
+  lua_rawseti(L, w, W_NFDS);
+  lua_rawgeti(L, -2, LOOP_TIMED);       /* ... state poller timed */
+  lua_pushvalue(L, w);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 3);
+}
+
+/* Resumes the task at index co with the nargs values on the top of the
+ * stack. An error of the task is raised again here.
+ */
+/* ... args -- ... */
+static void loop_resume(lua_State *L, struct loop *lp, int co, int nargs)
+{
+  lua_State *T = lua_tothread(L, co);
+  int status;
+  lua_xmove(L, T, nargs);
+  status = lua_resume_thread(T, L, nargs);
+  if (status == LUA_YIELD) {
+    lua_settop(T, 0);
+    return;
+  }
+  loop_state(L, lp);
+  lua_rawgeti(L, -1, LOOP_TASKS);
+  lua_pushvalue(L, co);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+  lp->tasks--;
+  if (status != 0) {
+    lua_xmove(T, L, 1);
+    lua_error(L);
+  }
+}
+
+/* loop fn [args...] -- */
+int loop_go(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  int nargs = lua_gettop(L) - 2;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_newthread(L);                     /* loop fn args... co */
+  lua_insert(L, 2);                     /* loop co fn args... */
+  loop_state(L, lp);
+  lua_rawgeti(L, -1, LOOP_TASKS);
+  lua_pushvalue(L, 2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+  lp->tasks++;
+  lua_pushvalue(L, 3);
+  lua_xmove(L, lua_tothread(L, 2), 1);
+  lua_remove(L, 3);                     /* loop co args... */
+  loop_resume(L, lp, 2, nargs);
+  return 0;
+}
+
+/* Does the operation described by the waiter at the top of the stack: if it
+ * can not be completed, the task yields until the loop completes it.
+ */
+/* ... waiter -- results.../yield */
+static int loop_await(lua_State *L, struct loop *lp)
+{
+  int w = lua_gettop(L), nres;
+  lua_rawgeti(L, w, W_STEP);
+  lua_pushvalue(L, w);
+  lua_call(L, 1, LUA_MULTRET);
+  nres = lua_gettop(L) - w;
+  if (!is_pending(L, nres)) return nres;
+  lua_settop(L, w);
+  loop_state(L, lp);
+  lua_rawgeti(L, -1, LOOP_TASKS);
+  lua_pushthread(L);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1))
+    return luaL_error(L, "blocking loop operation outside a task of the loop");
+  lua_settop(L, w);
+  lua_pushthread(L);
+  lua_rawseti(L, w, W_CO);
+  loop_watch(L, lp, w);
+  return lua_yield(L, 0);
+}
+
+/* ... -- ... waiter */
+static void loop_waiter(lua_State *L, int kind, lua_CFunction step, int obj)
+{
+  lua_createtable(L, W_FDS + 2, 0);
+  lua_pushcfunction(L, step);
+  lua_rawseti(L, -2, W_STEP);
+  lua_pushnumber(L, kind);
+  lua_rawseti(L, -2, W_KIND);
+  lua_pushvalue(L, obj);
+  lua_rawseti(L, -2, W_OBJ);
+  lua_pushnumber(L, 0);
+  lua_rawseti(L, -2, W_NUM);
+}
+
+/* loop rawfd [n] -- data/nil [error] */
+int loop_read(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  lua_Number n = luaL_optnumber(L, 3, LUAL_BUFFERSIZE);
+  set_nonblock(check_rawfd(L, 2)->fd);
+  lua_settop(L, 2);
+  loop_waiter(L, OP_READ, step_read, 2);
+  lua_pushnumber(L, n);
+  lua_rawseti(L, -2, W_NUM);
+  return loop_await(L, lp);
+}
+
+/* loop rawfd data -- n/nil error */
+int loop_write(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  set_nonblock(check_rawfd(L, 2)->fd);
+  luaL_checkstring(L, 3);
+  lua_settop(L, 3);
+  loop_waiter(L, OP_WRITE, step_write, 2);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, W_DATA);
+  return loop_await(L, lp);
+}
+
+/* loop proc -- exitcode/nil error */
+int loop_wait(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  luaL_checkudata(L, 2, PROCESS_HANDLE);
+  lua_settop(L, 2);
+  loop_waiter(L, OP_WAIT, step_wait, 2);
+  return loop_await(L, lp);
+}
+
+/* loop proc [input] -- out err exitcode/nil error */
+int loop_communicate(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  struct process *p = luaL_checkudata(L, 2, PROCESS_HANDLE);
+  size_t len;
+  int i;
+  luaL_optlstring(L, 3, "", &len);
+  lua_settop(L, 3);
+  loop_waiter(L, OP_COMMUNICATE, step_communicate, 2);
+  if (len == 0) close_fd(&p->pipes[0]);
+  if (lua_isnil(L, 3)) lua_pushliteral(L, "");
+  else lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, W_DATA);
+  for (i = 0; i < 3; i++) {
+    if (p->pipes[i] >= 0) set_nonblock(p->pipes[i]);
+    if (i == 0) continue;
+    if (p->pipes[i] >= 0) lua_newtable(L);
+    else lua_pushboolean(L, 0);
+    lua_rawseti(L, -2, W_OUT + i - 1);
+  }
+  return loop_await(L, lp);
+}
+
+/* loop seconds -- */
+int loop_sleep(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  double seconds = luaL_checknumber(L, 2);
+  lua_settop(L, 2);
+  loop_waiter(L, OP_SLEEP, step_sleep, 2);
+  lua_pushnumber(L, monotonic_time() + seconds);
+  lua_rawseti(L, -2, W_NUM);
+  return loop_await(L, lp);
+}
+
+/* Retries the operation of the waiter at index w, and resumes its task if it
+ * is completed. Otherwise it is registered again, since the descriptors to
+ * wait on can be changed.
+ */
+static void loop_retry(lua_State *L, struct loop *lp, int w)
+{
+  int top = lua_gettop(L), nres;
+  loop_unwatch(L, lp, w);
+  lua_rawgeti(L, w, W_CO);              /* ... co */
+  lua_rawgeti(L, w, W_STEP);
+  lua_pushvalue(L, w);
+  lua_call(L, 1, LUA_MULTRET);          /* ... co results... */
+  nres = lua_gettop(L) - top - 1;
+  if (is_pending(L, nres)) {
+    lua_settop(L, top);
+    loop_watch(L, lp, w);
+    return;
+  }
+  loop_resume(L, lp, top + 1, nres);
+  lua_settop(L, top);
+}
+
+/* loop -- true */
+int loop_run(lua_State *L)
+{
+  struct loop *lp = check_loop(L, 1);
+  lua_settop(L, 1);
+  loop_state(L, lp);                    /* loop state */
+  lua_rawgeti(L, 2, LOOP_POLLER);       /* loop state poller */
+  lua_rawgeti(L, 2, LOOP_TIMED);        /* loop state poller timed */
+  while (lp->tasks > 0) {
+    double timeout = -1, now = monotonic_time();
+    int i, n, any = 0;
+    /* the timed waiters are sleeping or waiting a process without pidfd */
+    lua_pushnil(L);
+    while (lua_next(L, 4)) {
+      double left = 0.01;
+      lua_pop(L, 1);
+      any = 1;
+      lua_rawgeti(L, -1, W_KIND);
+      if (lua_tonumber(L, -1) == OP_SLEEP) {
+        lua_rawgeti(L, -2, W_NUM);
+        left = lua_tonumber(L, -1) - now;
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+      if (left < 0) left = 0;
+      if (timeout < 0 || left < timeout) timeout = left;
+    }
+    if (!any && lp->watched == 0)
+      return luaL_error(L, "all the tasks of the loop are blocked outside of it");
+    lua_pushcfunction(L, poller_wait);
+    lua_pushvalue(L, 3);
+    lua_pushnumber(L, timeout);
+    lua_call(L, 2, 2);                  /* loop state poller timed objs events */
+    if (lua_isnil(L, -2)) return lua_error(L);
+    lua_pop(L, 1);                      /* loop state poller timed objs */
+    n = lua_value_length(L, 5);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 5, i);             /* ... objs waiter */
+      lua_rawgeti(L, -1, W_NFDS);
+      /* a waiter with many ready descriptors can be completed already */
+      if (lua_tonumber(L, -1) > 0) loop_retry(L, lp, 6);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);                      /* loop state poller timed */
+    if (!any) continue;
+    lua_newtable(L);                    /* loop state poller timed list */
+    n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 4)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, 5, ++n);
+    }
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 5, i);             /* ... list waiter */
+      lua_pushvalue(L, -1);
+      lua_rawget(L, 4);
+      if (lua_toboolean(L, -1)) loop_retry(L, lp, 6);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);                      /* loop state poller timed */
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* A worker keeps some long-lived processes, started from a template, and
+ * sends them requests on stdin while it reads the responses on stdout. The
+ * requests and the responses are framed as the decimal length of the
+ * payload, a newline and the payload. A process answers its requests in
+ * order, so the ids of the requests in flight are queued by process.
+ */
+
+struct idqueue {
+  int *v;
+  int head, count, size;
+};
+
+static int idqueue_push(struct idqueue *q, int id)
+{
+  if (q->count == q->size) {
+    int i, size = q->size ? 2 * q->size : 16;
+    int *v = malloc(size * sizeof *v);
+    if (!v) return -1;
+    for (i = 0; i < q->count; i++)
+      v[i] = q->v[(q->head + i) % q->size];
+    free(q->v);
+    q->v = v;
+    q->head = 0;
+    q->size = size;
+  }
+  q->v[(q->head + q->count++) % q->size] = id;
+  return 0;
+}
+
+static int idqueue_pop(struct idqueue *q)
+{
+  int id = q->v[q->head];
+  q->head = (q->head + 1) % q->size;
+  q->count--;
+  return id;
+}
+
+/* The bytes of the buffer are p[off] to p[off + len - 1] */
+struct bytebuf {
+  char *p;
+  size_t off, len, size;
+};
+
+/* Makes room for n more bytes at the end of the buffer */
+static char *bytebuf_reserve(struct bytebuf *b, size_t n)
+{
+  if (b->off && b->off + b->len + n > b->size) {
+    memmove(b->p, b->p + b->off, b->len);
+    b->off = 0;
+  }
+  if (b->len + n > b->size) {
+    size_t size = b->size ? b->size : 4096;
+    char *p;
+    while (size < b->len + n) size *= 2;
+    if (!(p = realloc(b->p, size))) return NULL;
+    b->p = p;
+    b->size = size;
+  }
+  return b->p + b->off + b->len;
+}
+
+static void bytebuf_drop(struct bytebuf *b, size_t n)
+{
+  b->off += n;
+  b->len -= n;
+  if (!b->len) b->off = 0;
+}
+
+struct worker_proc {
+  struct process *proc;     /* null if not running */
+  int ref;
+  struct bytebuf in, out;
+  struct idqueue ids;       /* the requests sent to the process, in order */
+};
+
+struct worker {
+  int tmpl;                 /* ref of the template of the processes */
+  int results;              /* ref of the table of the responses, by id */
+  int next_id;
+  struct idqueue done;      /* the ids of the responses, in order */
+  struct pollfd *pfds;
+  int nprocs;
+  struct worker_proc procs[1];
+};
+
+static struct worker *check_worker(lua_State *L, int idx)
+{
+  struct worker *w = luaL_checkudata(L, idx, WORKER_HANDLE);
+  if (w->tmpl == LUA_NOREF) return luaL_error(L, "attempt to use a closed worker"), NULL;
+  return w;
+}
+
+/* spec -- worker */
+int lc_worker(lua_State *L)
+{
+  struct worker *w;
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "size");           /* spec size */
+  n = lua_isnil(L, 2) ? 1 : (int)lua_tonumber(L, 2);
+  if (n < 1)
+    return luaL_error(L, "bad size option (positive number expected)");
+  lua_pop(L, 1);                        /* spec */
+  /* a copy of the spec, with stdin and stdout captured */
+  lua_pushcfunction(L, lc_prepare);     /* spec prepare */
+  lua_newtable(L);                      /* spec prepare copy */
+  for (lua_pushnil(L); lua_next(L, 1);) {
+    lua_pushvalue(L, -2);               /* spec prepare copy k v k */
+    lua_insert(L, -2);                  /* spec prepare copy k k v */
+    lua_rawset(L, 3);                   /* spec prepare copy k */
+  }
+  lua_pushnil(L);
+  lua_setfield(L, 3, "size");
+  lua_pushliteral(L, "capture");
+  lua_setfield(L, 3, "stdin");
+  lua_pushliteral(L, "capture");
+  lua_setfield(L, 3, "stdout");
+  lua_call(L, 1, 1);                    /* spec template */
+  w = lua_newuserdata(L, sizeof *w + (n - 1) * sizeof w->procs[0]
+                         + 2 * n * sizeof *w->pfds);
+  memset(w, 0, sizeof *w + (n - 1) * sizeof w->procs[0]);
+  w->pfds = (struct pollfd *)(w->procs + n);
+  w->nprocs = n;
+  w->next_id = 1;
+  for (i = 0; i < n; i++)
+    w->procs[i].ref = LUA_NOREF;
+  lua_insert(L, 2);                     /* spec worker template */
+  w->tmpl = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);                      /* spec worker results */
+  w->results = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_getmetatable(L, WORKER_HANDLE);
+  lua_setmetatable(L, 2);
+  return 1;
+}
+
+/* -- /error */
+static int worker_spawn(lua_State *L, struct worker *w, struct worker_proc *wp)
+{
+  lua_pushcfunction(L, template_spawn);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->tmpl);
+  lua_call(L, 1, 2);                    /* proc/nil error */
+  if (lua_isnil(L, -2)) {
+    lua_remove(L, -2);                  /* error */
+    return -1;
+  }
+  lua_pop(L, 1);                        /* proc */
+  wp->proc = lua_touserdata(L, -1);
+  wp->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  set_nonblock(wp->proc->pipes[0]);
+  set_nonblock(wp->proc->pipes[1]);
+  return 0;
+}
+
+/* Stores the response on top of the stack, or false for a failed request */
+static void worker_complete(lua_State *L, struct worker *w, int id)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->results);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);
+  if (idqueue_push(&w->done, id)) luaL_error(L, "not enough memory");
+}
+
+/* The process stopped talking: it is killed if still running, and all its
+ * requests fail. It is started again at the next request.
+ */
+static void worker_exited(lua_State *L, struct worker *w, struct worker_proc *wp)
+{
+  struct process *p = wp->proc;
+  close_fd(&p->pipes[0]);
+  close_fd(&p->pipes[1]);
+  if (process_reap(p, 0) == 0) {
+    kill(p->pid, SIGKILL);
+    process_reap(p, 1);
+  }
+  while (wp->ids.count) {
+    lua_pushboolean(L, 0);
+    worker_complete(L, w, idqueue_pop(&wp->ids));
+  }
+  wp->in.off = wp->in.len = 0;
+  wp->out.off = wp->out.len = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, wp->ref);
+  wp->ref = LUA_NOREF;
+  wp->proc = 0;
+}
+
+static void worker_flush(lua_State *L, struct worker *w, struct worker_proc *wp)
+{
+  while (wp->out.len) {
+    ssize_t n = write_nosigpipe(wp->proc->pipes[0], wp->out.p + wp->out.off,
+                                wp->out.len);
+    if (n > 0)
+      bytebuf_drop(&wp->out, n);
+    else if (n == -1 && errno == EINTR)
+      continue;
+    else {
+      if (n == -1 && errno != EAGAIN) worker_exited(L, w, wp);
+      return;
+    }
+  }
+}
+
+/* Completes the requests whose responses are in the input buffer. Returns -1
+ * if the process does not follow the protocol.
+ */
+static int worker_parse(lua_State *L, struct worker *w, struct worker_proc *wp)
+{
+  while (wp->in.len) {
+    char *head = wp->in.p + wp->in.off, *nl, *end;
+    unsigned long len;
+    nl = memchr(head, '\n', wp->in.len);
+    if (!nl) return wp->in.len > 20 ? -1 : 0;
+    len = strtoul(head, &end, 10);
+    if (end != nl || *head < '0' || *head > '9' || !wp->ids.count) return -1;
+    if (wp->in.len - (nl + 1 - head) < len) return 0;
+    lua_pushlstring(L, nl + 1, len);
+    worker_complete(L, w, idqueue_pop(&wp->ids));
+    bytebuf_drop(&wp->in, nl + 1 - head + len);
+  }
+  return 0;
+}
+
+/* Reads the responses available. At the end of file, the responses already
+ * received are completed before the pending requests fail.
+ */
+static void worker_read(lua_State *L, struct worker *w, struct worker_proc *wp)
+{
+  int eof = 0;
+  for (;;) {
+    char *p = bytebuf_reserve(&wp->in, 65536);
+    ssize_t n;
+    if (!p) luaL_error(L, "not enough memory");
+    n = read(wp->proc->pipes[1], p, 65536);
+    if (n > 0) {
+      wp->in.len += n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EAGAIN) break;
+    eof = 1;
+    break;
+  }
+  if (worker_parse(L, w, wp)) {
+    kill(wp->proc->pid, SIGKILL);
+    worker_exited(L, w, wp);
+  }
+  else if (eof)
+    worker_exited(L, w, wp);
+}
+
+/* Moves the data of all the processes, waiting at most ms milliseconds */
+static int worker_pump(lua_State *L, struct worker *w, int ms)
+{
+  int i, n = 0, ret;
+  struct worker_proc *wp;
+  for (i = 0; i < w->nprocs; i++) {
+    wp = &w->procs[i];
+    if (!wp->proc) continue;
+    w->pfds[n].fd = wp->proc->pipes[1];
+    w->pfds[n++].events = POLLIN;
+    w->pfds[n].fd = wp->out.len ? wp->proc->pipes[0] : -1;
+    w->pfds[n++].events = POLLOUT;
+  }
+  do ret = poll(w->pfds, n, ms);
+  while (ret == -1 && errno == EINTR);
+  if (ret <= 0) return ret;
+  for (i = 0, n = 0; i < w->nprocs; i++) {
+    wp = &w->procs[i];
+    if (!wp->proc) continue;
+    if (w->pfds[n + 1].revents && wp->out.len)
+      worker_flush(L, w, wp);
+    if (w->pfds[n].revents && wp->proc)
+      worker_read(L, w, wp);
+    n += 2;
+  }
+  return ret;
 }
 
-/* ... argtab -- ... argtab vector */
-static void spawn_param_args(struct spawn_params *p)
+static int worker_inflight(struct worker *w)
 {
-  const char **argv = make_vector(p->L);
-  if (!argv[0]) argv[0] = p->command;
-  p->argv = argv;
+  int i, n = 0;
+  for (i = 0; i < w->nprocs; i++)
+    n += w->procs[i].ids.count;
+  return n;
 }
 
-static FILE *check_file(lua_State *L, int idx, const char *argname)
+/* Pushes the response of the request id, if it is complete and not taken */
+static int worker_take(lua_State *L, struct worker *w, int id)
 {
-  FILE **pf;
-  if (idx > 0) pf = luaL_checkudata(L, idx, LUA_FILEHANDLE);
-  else {
-    idx = absindex(L, idx);
-    pf = lua_touserdata(L, idx);
-    luaL_getmetatable(L, LUA_FILEHANDLE);
-    if (!pf || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
-      luaL_error(L, "bad %s option (%s expected, got %s)",
-                 argname, LUA_FILEHANDLE, luaL_typename(L, idx));
+  lua_rawgeti(L, LUA_REGISTRYINDEX, w->results);
+  lua_rawgeti(L, -1, id);               /* results response */
+  if (lua_isnil(L, -1)) {
     lua_pop(L, 2);
+    return 0;
   }
-  if (!*pf) return luaL_error(L, "attempt to use a closed file"), NULL;
-  return *pf;
+  lua_pushnil(L);
+  lua_rawseti(L, -3, id);
+  lua_remove(L, -2);                    /* response */
+  return 1;
 }
 
-#define new_dirent(L) lua_newtable(L)
-#define DIR_HANDLE "DIR*"
+/* The milliseconds left to the deadline */
+static int worker_timeout(double deadline)
+{
+  double left = deadline - monotonic_time();
+  return left <= 0 ? 0 : poll_ms(left);
+}
 
-static void get_redirect(lua_State *L,
-                         int idx, const char *stdname, struct spawn_params *p)
+/* worker payload -- id/nil error */
+int worker_send(lua_State *L)
 {
-  lua_getfield(L, idx, stdname);
-  if (!lua_isnil(L, -1))
-    spawn_param_redirect(p, stdname, fileno(check_file(L, -1, stdname)));
-  lua_pop(L, 1);
+  struct worker *w = check_worker(L, 1);
+  struct worker_proc *wp = &w->procs[0];
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  char head[32], *p;
+  int i, hlen;
+  /* the least loaded process, that may be not running yet */
+  for (i = 1; i < w->nprocs && wp->ids.count; i++)
+    if (w->procs[i].ids.count < wp->ids.count)
+      wp = &w->procs[i];
+  if (!wp->proc && worker_spawn(L, w, wp)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  hlen = sprintf(head, "%lu\n", (unsigned long)len);
+  if (!(p = bytebuf_reserve(&wp->out, hlen + len))
+      || idqueue_push(&wp->ids, w->next_id))
+    return luaL_error(L, "not enough memory");
+  memcpy(p, head, hlen);
+  memcpy(p + hlen, s, len);
+  wp->out.len += hlen + len;
+  lua_pushnumber(L, w->next_id++);
+  worker_flush(L, w, wp);
+  return 1;
 }
 
-/* filename [args-opts] -- proc/nil error */
-/* args-opts -- proc/nil error */
-int lc_spawn(lua_State *L)
+/* worker [timeout] -- id response/id nil error/nil error */
+int worker_receive(lua_State *L)
 {
-  struct spawn_params *params;
-  int have_options;
-  switch (lua_type(L, 1)) {
-  default: return lua_report_type_error(L, 1, "string or table");
-  case LUA_TSTRING:
-    switch (lua_type(L, 2)) {
-    default: return lua_report_type_error(L, 2, "table");
-    case LUA_TNONE: have_options = 0; break;
-    case LUA_TTABLE: have_options = 1; break;
+  struct worker *w = check_worker(L, 1);
+  double timeout = luaL_optnumber(L, 2, -1);
+  double deadline = monotonic_time() + timeout;
+  for (;;) {
+    while (w->done.count) {
+      int id = idqueue_pop(&w->done);
+      if (!worker_take(L, w, id)) continue;
+      lua_pushnumber(L, id);
+      lua_insert(L, -2);                /* id response */
+      if (lua_toboolean(L, -1)) return 2;
+      lua_pop(L, 1);
+      lua_pushnil(L);
+      lua_pushliteral(L, "worker exited");
+      return 3;
     }
-    break;
-  case LUA_TTABLE:
-    have_options = 1;
-    lua_getfield(L, 1, "command");      /* opts ... cmd */
-    if (!lua_isnil(L, -1)) {
-      /* convert {command=command,arg1,...} to command {arg1,...} */
-      lua_insert(L, 1);                 /* cmd opts ... */
+    if (!worker_inflight(w)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "no pending requests");
+      return 2;
     }
-    else {
-      /* convert {arg0,arg1,...} to arg0 {arg1,...} */
-      size_t i, n = lua_value_length(L, 1);
-      lua_rawgeti(L, 1, 1);             /* opts ... nil cmd */
-      lua_insert(L, 1);                 /* cmd opts ... nil */
-      for (i = 2; i <= n; i++) {
-        lua_rawgeti(L, 2, i);           /* cmd opts ... nil argi */
-        lua_rawseti(L, 2, i - 1);       /* cmd opts ... nil */
-      }
-      lua_rawseti(L, 2, n);             /* cmd opts ... */
+    if (timeout >= 0 && monotonic_time() >= deadline)
+      return push_pending(L);
+    if (-1 == worker_pump(L, w, timeout < 0 ? -1 : worker_timeout(deadline)))
+      return push_error(L);
+  }
+}
+
+/* worker payload [timeout] -- response/nil error */
+int worker_call(lua_State *L)
+{
+  struct worker *w = check_worker(L, 1);
+  double timeout = luaL_optnumber(L, 3, -1);
+  double deadline = monotonic_time() + timeout;
+  int id;
+  lua_settop(L, 2);
+  if (worker_send(L) != 1) return 2;
+  id = (int)lua_tonumber(L, -1);
+  while (!worker_take(L, w, id)) {
+    if (timeout >= 0 && monotonic_time() >= deadline)
+      return push_pending(L);
+    if (-1 == worker_pump(L, w, timeout < 0 ? -1 : worker_timeout(deadline)))
+      return push_error(L);
+  }
+  if (lua_toboolean(L, -1)) return 1;
+  lua_pushnil(L);
+  lua_pushliteral(L, "worker exited");
+  return 2;
+}
+
+static void worker_release(lua_State *L, struct worker *w, int wait)
+{
+  int i;
+  for (i = 0; i < w->nprocs; i++) {
+    struct worker_proc *wp = &w->procs[i];
+    if (wp->proc) {
+      close_fd(&wp->proc->pipes[0]);
+      close_fd(&wp->proc->pipes[1]);
+      if (wait) process_reap(wp->proc, 1);
+      else process_finish(wp->proc);
     }
-    if (lua_type(L, 1) != LUA_TSTRING)
-      return luaL_error(L, "bad command option (string expected, got %s)",
-                        luaL_typename(L, 1));
-    break;
+    luaL_unref(L, LUA_REGISTRYINDEX, wp->ref);
+    wp->ref = LUA_NOREF;
+    wp->proc = 0;
+    free(wp->in.p);
+    free(wp->out.p);
+    free(wp->ids.v);
+    memset(wp, 0, sizeof *wp);
+    wp->ref = LUA_NOREF;
   }
-  params = spawn_param_init(L);
-  /* get filename to execute */
-  spawn_param_filename(params, lua_tostring(L, 1));
-  /* get arguments, environment, and redirections */
-  if (have_options) {
-    lua_getfield(L, 2, "args");         /* cmd opts ... argtab */
-    switch (lua_type(L, -1)) {
-    default:
-      return luaL_error(L, "bad args option (table expected, got %s)",
-                        luaL_typename(L, -1));
-    case LUA_TNIL:
-      lua_pop(L, 1);                    /* cmd opts ... */
-      lua_pushvalue(L, 2);              /* cmd opts ... opts */
-      if (0) /*FALLTHRU*/
-    case LUA_TTABLE:
-      if (lua_value_length(L, 2) > 0)
-        return
-          luaL_error(L, "cannot specify both the args option and array values");
-      spawn_param_args(params);         /* cmd opts ... */
-      break;
+  free(w->done.v);
+  memset(&w->done, 0, sizeof w->done);
+  luaL_unref(L, LUA_REGISTRYINDEX, w->tmpl);
+  luaL_unref(L, LUA_REGISTRYINDEX, w->results);
+  w->tmpl = w->results = LUA_NOREF;
+}
+
+/* Closes the stdin of the processes and waits for their end. */
+/* worker -- */
+int worker_close(lua_State *L)
+{
+  struct worker *w = luaL_checkudata(L, 1, WORKER_HANDLE);
+  if (w->tmpl != LUA_NOREF) worker_release(L, w, 1);
+  return 0;
+}
+
+/* worker -- */
+int worker_gc(lua_State *L)
+{
+  struct worker *w = luaL_checkudata(L, 1, WORKER_HANDLE);
+  if (w->tmpl != LUA_NOREF) worker_release(L, w, 0);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* A fork server is a small helper process that spawns processes on request.
+ * The requests travel on a unix socket, with the descriptors of the child
+ * attached. The helper is the Lua interpreter running forkserver_serve: it
+ * is started while the parent is still small, so its forks stay cheap
+ * however large the parent grows.
+ */
+
+#define FS_MAX_FDS 64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Followed by the command, the arguments, the environment and the cgroup
+ * path, as null terminated strings.
+ */
+struct forkserver_request {
+  uint32_t id;
+  int32_t nargs;
+  int32_t nenv;             /* -1 for the environment of the server */
+  int32_t nfds;
+  int32_t targets[FS_MAX_FDS];  /* of the attached descriptors */
+  int32_t close_fds;
+  int32_t has_cgroup;
+  struct child_setup setup;
+};
+
+static struct forkserver *check_forkserver(lua_State *L, int idx)
+{
+  struct forkserver *fs = luaL_checkudata(L, idx, FORKSERVER_HANDLE);
+  if (fs->fd < 0) return luaL_error(L, "attempt to use a closed fork server"), NULL;
+  return fs;
+}
+
+/* Pushes the code run by the interpreter of the server, that loads the
+ * module from the cpath of this state.
+ */
+/* -- code */
+static void forkserver_code(lua_State *L)
+{
+  int top = lua_gettop(L);
+  const char *cpath = 0;
+  char eq[8] = "", close[sizeof eq + 2];
+  size_t level;
+  lua_getglobal(L, "package");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "cpath");
+    cpath = lua_tostring(L, -1);
+  }
+  if (cpath) {
+    /* a long bracket that does not appear in the path */
+    for (level = 0; level < sizeof eq - 1; level++) {
+      memset(eq, '=', level);
+      eq[level] = 0;
+      sprintf(close, "]%s]", eq);
+      if (!strstr(cpath, close)) break;
     }
-    lua_getfield(L, 2, "env");          /* cmd opts ... envtab */
-    switch (lua_type(L, -1)) {
-    default:
-      return luaL_error(L, "bad env option (table expected, got %s)",
-                        luaL_typename(L, -1));
-    case LUA_TNIL:
+    lua_pushfstring(L, "package.cpath = [%s[%s]%s] ", eq, cpath, eq);
+  }
+  else
+    lua_pushliteral(L, "");
+  lua_pushliteral(L, "require('luachild').forkserver_serve(3)");
+  lua_concat(L, 2);
+  lua_replace(L, top + 1);
+  lua_settop(L, top + 1);
+}
+
+/* [interpreter] -- server/nil error */
+int lc_forkserver(lua_State *L)
+{
+  const char *interp = luaL_optstring(L, 1, "lua");
+  struct forkserver *fs;
+  int sv[2];
+  lua_settop(L, 1);
+#ifdef SOCK_CLOEXEC
+  if (-1 == socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+#else
+  if (-1 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+#endif
+    return push_error(L);
+  closeonexec(sv[0]);
+  closeonexec(sv[1]);
+  fs = lua_newuserdata(L, sizeof *fs);  /* interp server */
+  memset(fs, 0, sizeof *fs);
+  fs->fd = sv[0];
+  fs->ref = LUA_NOREF;
+  fs->next_id = 1;
+  luaL_getmetatable(L, FORKSERVER_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_pushcfunction(L, lc_spawn);       /* interp server spawn */
+  lua_createtable(L, 3, 2);             /* interp server spawn spec */
+  lua_pushstring(L, interp);
+  lua_rawseti(L, -2, 1);
+  lua_pushliteral(L, "-e");
+  lua_rawseti(L, -2, 2);
+  forkserver_code(L);                   /* ... spec code */
+  lua_rawseti(L, -2, 3);
+  lua_newtable(L);                      /* ... spec fds */
+  lua_pushnumber(L, sv[1]);
+  lua_rawseti(L, -2, 3);
+  lua_setfield(L, -2, "fds");
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "close_fds");
+  lua_call(L, 1, 2);                    /* interp server proc/nil error */
+  close(sv[1]);
+  if (lua_isnil(L, -2)) {
+    close_fd(&fs->fd);
+    return 2;
+  }
+  lua_pop(L, 1);                        /* interp server proc */
+  fs->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static char *forkserver_put(char *s, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  memcpy(s, str, len);
+  return s + len;
+}
+
+/* Sends the request, with the descriptors fds attached. Returns 0 or an errno
+ * value.
+ */
+static int forkserver_send(int sock, const struct forkserver_request *req,
+                           size_t len, const int *fds)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(FS_MAX_FDS * sizeof(int))];
+  } cm;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = (void *)req;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (req->nfds) {
+    struct cmsghdr *c;
+    memset(&cm, 0, sizeof cm);
+    msg.msg_control = cm.space;
+    msg.msg_controllen = CMSG_SPACE(req->nfds * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(req->nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, req->nfds * sizeof(int));
+  }
+  do n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while (n == -1 && errno == EINTR);
+  return n == -1 ? errno : 0;
+}
+
+/* Like lc_spawn, but the process is started by the server. The process is
+ * not a child of this one: it is waited for through the server.
+ */
+/* server spec -- proc/nil error */
+int forkserver_spawn(lua_State *L)
+{
+  struct forkserver *fs = check_forkserver(L, 1);
+  struct spawn_params *p;
+  struct forkserver_request *req;
+  struct forkserver_reply r;
+  struct process *proc;
+  const char **argv, **envp, *argv0[2], *command;
+  int i, ret, fds[FS_MAX_FDS], child[3] = {-1, -1, -1};
+  size_t len;
+  char *s;
+  double start = monotonic_time();
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_insert(L, 1);                     /* spec server */
+  p = spawn_parse(L);                   /* cmd opts server ... */
+  if (!p) return 0;
+  if (3 + p->nfdmap > FS_MAX_FDS)
+    return luaL_error(L, "too many descriptors for a fork server (at most %d)",
+                      FS_MAX_FDS);
+  if (!(command = resolve_command(L, p->command))) {
+    stats_spawn(start, p->command, 0, 0);
+    return push_error(L);
+  }
+  argv = p->argv;
+  if (!argv) {
+    argv = argv0;
+    argv[0] = p->command;
+    argv[1] = 0;
+  }
+  envp = p->envblock ? envblock_vector(p->envblock) : p->envp;
+  if (!envp && state_envblock(L, 0)) envp = state_environ(L);
+  len = sizeof *req + strlen(command) + 1;
+  for (i = 0; argv[i]; i++) len += strlen(argv[i]) + 1;
+  for (i = 0; envp && envp[i]; i++) len += strlen(envp[i]) + 1;
+  if (p->setup.cgroup) len += strlen(p->setup.cgroup) + 1;
+  req = lua_newuserdata(L, len);
+  memset(req, 0, sizeof *req);
+  req->id = fs->next_id++;
+  req->nenv = envp ? 0 : -1;
+  req->close_fds = p->close_fds;
+  req->has_cgroup = p->setup.cgroup != 0;
+  req->setup = p->setup;
+  req->setup.cgroup = 0;
+  s = forkserver_put((char *)(req + 1), command);
+  for (i = 0; argv[i]; i++, req->nargs++) s = forkserver_put(s, argv[i]);
+  for (i = 0; envp && envp[i]; i++, req->nenv++) s = forkserver_put(s, envp[i]);
+  if (p->setup.cgroup) forkserver_put(s, p->setup.cgroup);
+  proc = process_new(L);
+  ret = spawn_param_pipes(p, proc->pipes, child);
+  if (ret == 0) {
+    for (i = 0; i < 3; i++)
+      if ((fds[req->nfds] = spawn_param_source(p, child, i)) >= 0)
+        req->targets[req->nfds++] = i;
+    for (i = 0; i < p->nfdmap; i++) {
+      fds[req->nfds] = p->fdmap[i].fd;
+      req->targets[req->nfds++] = p->fdmap[i].target;
+    }
+    ret = forkserver_send(fs->fd, req, len, fds);
+  }
+  for (i = 0; i < 3; i++)
+    close_fd(&child[i]);
+  while (ret == 0) {
+    if (-1 == forkserver_recv(fs, &r, 0))
+      ret = errno;
+    else if (r.kind == FS_SPAWNED && r.id == req->id) {
+      if (r.pid < 0) ret = -r.pid;
       break;
-    case LUA_TTABLE:
-      spawn_param_env(params);          /* cmd opts ... */
+    }
+  }
+  if (ret != 0) {
+    for (i = 0; i < 3; i++)
+      close_fd(&proc->pipes[i]);
+    stats_spawn(start, p->command, 0, 0);
+    errno = ret;
+    return push_error(L);
+  }
+  stats_spawn(start, p->command, r.pid, 1);
+  proc->pid = r.pid;
+  proc->server = fs;
+  spawn_param_deadline(p, proc, start);
+  lua_pushvalue(L, 3);
+  proc->server_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static void forkserver_release(lua_State *L, struct forkserver *fs, int wait)
+{
+  close_fd(&fs->fd);
+  free(fs->exits);
+  fs->exits = 0;
+  fs->nexits = fs->size = 0;
+  if (fs->ref != LUA_NOREF) {
+    struct process *p;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fs->ref);
+    p = lua_touserdata(L, -1);
+    if (wait) process_reap(p, 1);
+    else process_finish(p);
+    lua_pop(L, 1);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, fs->ref);
+  fs->ref = LUA_NOREF;
+}
+
+/* Stops the server and waits for its end. The processes it started keep
+ * running, but they can not be waited for anymore.
+ */
+/* server -- */
+int forkserver_close(lua_State *L)
+{
+  struct forkserver *fs = luaL_checkudata(L, 1, FORKSERVER_HANDLE);
+  forkserver_release(L, fs, 1);
+  return 0;
+}
+
+/* server -- */
+int forkserver_gc(lua_State *L)
+{
+  struct forkserver *fs = luaL_checkudata(L, 1, FORKSERVER_HANDLE);
+  forkserver_release(L, fs, 0);
+  return 0;
+}
+
+/* The server side. The exits of the children are noticed with a self pipe
+ * written by the SIGCHLD handler; the server is a process of its own, so the
+ * static is not shared by lua states.
+ */
+static int forkserver_sigfd[2] = {-1, -1};
+
+static void forkserver_sigchld(int sig)
+{
+  int e = errno;
+  (void)sig;
+  if (write(forkserver_sigfd[1], "", 1)) {}
+  errno = e;
+}
+
+/* Reports the exits of the children. Returns -1 on error. */
+static int forkserver_report(int sock)
+{
+  struct forkserver_reply r;
+  int status;
+  pid_t pid;
+  memset(&r, 0, sizeof r);
+  r.kind = FS_EXITED;
+  while ((pid = wait4(-1, &status, WNOHANG, &r.usage)) > 0) {
+    r.pid = pid;
+    r.status = status;
+    if (-1 == send(sock, &r, sizeof r, MSG_NOSIGNAL)) return -1;
+  }
+  return 0;
+}
+
+/* Checks the request of len bytes and points the vectors to its strings.
+ * vec must have room for nargs + nenv + 2 entries. Returns 0 or an errno
+ * value.
+ */
+static int forkserver_unpack(struct forkserver_request *req, size_t len,
+                             int nfds, const char **command, const char **vec)
+{
+  const char *s = (const char *)(req + 1), *end = (const char *)req + len;
+  int i, n;
+  if (len < sizeof *req || req->nfds != nfds || req->nargs < 1
+      || req->nenv < -1)
+    return EPROTO;
+  req->setup.cgroup = 0;
+  for (i = 0; i < nfds; i++)
+    if (req->targets[i] < 0) return EPROTO;
+  n = 1 + req->nargs + (req->nenv > 0 ? req->nenv : 0) + !!req->has_cgroup;
+  for (i = 0; i < n; i++) {
+    const char *e = memchr(s, 0, end - s);
+    if (!e) return EPROTO;
+    if (i == 0)
+      *command = s;
+    else if (i <= req->nargs + (req->nenv > 0 ? req->nenv : 0))
+      vec[i - 1 + (i > req->nargs)] = s;
+    else
+      req->setup.cgroup = s;
+    s = e + 1;
+  }
+  return 0;
+}
+
+/* Receives a request and spawns its process. Returns 0 at the end of the
+ * requests, -1 on error.
+ */
+static int forkserver_serve_one(int sock, char **buf, size_t *size)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(FS_MAX_FDS * sizeof(int))];
+  } cm;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *c;
+  struct forkserver_request *req;
+  struct forkserver_reply r;
+  struct spawn_params p;
+  struct spawn_fdmap map[FS_MAX_FDS];
+  child_actions_t act;
+  const char *command = 0, **vec;
+  int i, ret, nfds = 0, fds[FS_MAX_FDS];
+  pid_t pid = 0;
+  ssize_t n;
+  /* peek at the request, until the buffer is large enough for it */
+  for (;;) {
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = *buf;
+    iov.iov_len = *size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    n = recvmsg(sock, &msg, MSG_PEEK);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return (int)n;
+    if (!(msg.msg_flags & MSG_TRUNC)) break;
+    if (!(req = realloc(*buf, 2 * *size))) return -1;
+    *buf = (char *)req;
+    *size *= 2;
+  }
+  msg.msg_control = cm.space;
+  msg.msg_controllen = sizeof cm.space;
+  do n = recvmsg(sock, &msg, 0);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0) return (int)n;
+  for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    int k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    memcpy(fds + nfds, CMSG_DATA(c), k * sizeof(int));
+    nfds += k;
+  }
+  for (i = 0; i < nfds; i++)
+    closeonexec(fds[i]);
+  req = (struct forkserver_request *)*buf;
+  vec = n < (ssize_t)sizeof *req ? 0
+        : malloc((req->nargs + (req->nenv > 0 ? req->nenv : 0) + 2) * sizeof *vec);
+  ret = vec ? forkserver_unpack(req, n, nfds, &command, vec) : EPROTO;
+  if (ret == 0) {
+    vec[req->nargs] = 0;
+    if (req->nenv >= 0) vec[req->nargs + 1 + req->nenv] = 0;
+    memset(&p, 0, sizeof p);
+    p.dups[0] = p.dups[1] = p.dups[2] = -1;
+    p.fdmap = map;
+    for (i = 0; i < nfds; i++) {
+      if (req->targets[i] < 3)
+        p.dups[req->targets[i]] = fds[i];
+      else {
+        map[p.nfdmap].fd = fds[i];
+        map[p.nfdmap++].target = req->targets[i];
+      }
+    }
+    p.close_fds = req->close_fds;
+    child_actions_init(&act);
+    ret = spawn_param_actions(&p, &act, 0);
+    if (ret == 0)
+      ret = child_spawnp(&pid, command, &act, &req->setup, (char *const *)vec,
+                         req->nenv >= 0 ? (char *const *)vec + req->nargs + 1
+                                        : environ);
+    if (ret == -1) ret = errno;
+    child_actions_destroy(&act);
+  }
+  free(vec);
+  for (i = 0; i < nfds; i++)
+    close(fds[i]);
+  memset(&r, 0, sizeof r);
+  r.kind = FS_SPAWNED;
+  r.id = n >= (ssize_t)sizeof *req ? req->id : 0;
+  r.pid = ret ? -ret : pid;
+  return send(sock, &r, sizeof r, MSG_NOSIGNAL) == -1 ? -1 : 1;
+}
+
+/* Serves the requests arriving on the socket fd, until it is closed. */
+/* fd -- */
+int lc_forkserver_serve(lua_State *L)
+{
+  int sock = (int)luaL_checknumber(L, 1), i, ret;
+  size_t size = 4096;
+  char *buf = malloc(size), c[64];
+  struct sigaction sa;
+  struct pollfd pfd[2];
+  if (!buf || -1 == cloexec_pipe(forkserver_sigfd)) {
+    free(buf);
+    return push_error(L);
+  }
+  for (i = 0; i < 2; i++)
+    fcntl(forkserver_sigfd[i], F_SETFL, O_NONBLOCK);
+  closeonexec(sock);
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = forkserver_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, 0);
+  pfd[0].fd = sock;
+  pfd[1].fd = forkserver_sigfd[0];
+  pfd[0].events = pfd[1].events = POLLIN;
+  for (ret = 1; ret > 0;) {
+    if (-1 == poll(pfd, 2, -1)) {
+      if (errno == EINTR) continue;
       break;
     }
-    get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
-    get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
-    get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    if (pfd[1].revents) {
+      while (read(forkserver_sigfd[0], c, sizeof c) > 0);
+      if (-1 == forkserver_report(sock)) break;
+    }
+    if (pfd[0].revents)
+      ret = forkserver_serve_one(sock, &buf, &size);
+  }
+  free(buf);
+  close(sock);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+#ifdef __linux__
+#include "luachild_shm.h"
+
+#ifndef SYS_memfd_create
+#define SYS_memfd_create 319
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+/* A shared memory channel. fd is the memfd, or -1 on the attached side. */
+struct shmchannel {
+  struct lc_shm c;
+  int fd;
+};
+
+static struct shmchannel *check_shmchannel(lua_State *L, int idx)
+{
+  struct shmchannel *ch = luaL_checkudata(L, idx, SHMCHANNEL_HANDLE);
+  if (!ch->c.h) return luaL_error(L, "attempt to use a closed channel"), NULL;
+  return ch;
+}
+
+static struct shmchannel *shmchannel_new(lua_State *L)
+{
+  struct shmchannel *ch = lua_newuserdata(L, sizeof *ch);
+  ch->c.h = 0;
+  ch->fd = -1;
+  luaL_getmetatable(L, SHMCHANNEL_HANDLE);
+  lua_setmetatable(L, -2);
+  return ch;
+}
+
+/* The timeout in milliseconds, -1 if missing or negative. A long one is
+ * clamped like in poll_ms, so that it does not overflow to "forever".
+ */
+static int shm_timeout(lua_State *L, int idx)
+{
+  double timeout = luaL_optnumber(L, idx, -1);
+  if (timeout < 0) return -1;
+  if (timeout >= (INT_MAX - 1) / 1000.0) return INT_MAX;
+  return (int)(timeout * 1000 + 0.5);
+}
+
+static int shm_error(lua_State *L)
+{
+  switch (errno) {
+  case EAGAIN: lua_pushnil(L); lua_pushliteral(L, "timeout"); return 2;
+  case EPIPE: lua_pushnil(L); lua_pushliteral(L, "closed"); return 2;
+  default: return push_error(L);
+  }
+}
+
+/* [size] -- channel/nil error */
+int lc_shmchannel(lua_State *L)
+{
+  lua_Number want = luaL_optnumber(L, 1, 65536);
+  struct lc_shm_header h;
+  struct shmchannel *ch;
+  uint32_t size = 256;
+  if (want > (1 << 30))
+    return luaL_error(L, "bad channel size (at most %d expected)", 1 << 30);
+  while (size < want) size *= 2;
+  ch = shmchannel_new(L);
+  ch->fd = syscall(SYS_memfd_create, "luachild", MFD_CLOEXEC);
+  if (ch->fd == -1) return push_error(L);
+  memset(&h, 0, sizeof h);
+  h.magic = LC_SHM_MAGIC;
+  h.size = size;
+  if (-1 == ftruncate(ch->fd, lc_shm_map_size(size))
+      || sizeof h != pwrite(ch->fd, &h, sizeof h, 0)
+      || lc_shm_attach(&ch->c, ch->fd, LC_SHM_OWNER))
+    return push_error(L);
+  return 1;
+}
+
+/* fd -- channel/nil error */
+int lc_shmattach(lua_State *L)
+{
+  int fd = get_fd(L, 1, "fd");
+  struct shmchannel *ch = shmchannel_new(L);
+  if (lc_shm_attach(&ch->c, fd, LC_SHM_PEER)) {
+    ch->c.h = 0;
+    return push_error(L);
+  }
+  return 1;
+}
+
+/* channel msg [timeout] -- true/nil error */
+int shmchannel_send(lua_State *L)
+{
+  struct shmchannel *ch = check_shmchannel(L, 1);
+  size_t len;
+  const char *msg = luaL_checklstring(L, 2, &len);
+  if (len > UINT32_MAX) {
+    errno = EMSGSIZE;
+    return push_error(L);
+  }
+  if (lc_shm_send(&ch->c, msg, len, shm_timeout(L, 3)))
+    return shm_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* channel [timeout] -- msg/nil error */
+int shmchannel_recv(lua_State *L)
+{
+  struct shmchannel *ch = check_shmchannel(L, 1);
+  int len = lc_shm_next(&ch->c, shm_timeout(L, 2));
+  uint32_t off = 0;
+  luaL_Buffer b;
+  if (len < 0) return shm_error(L);
+  /* the payload is copied straight to the string when it does not wrap */
+  if (((ch->c.in->tail + 4) & ch->c.mask) + len <= ch->c.mask + 1) {
+    lua_pushlstring(L, (const char *)ch->c.in_data
+                       + ((ch->c.in->tail + 4) & ch->c.mask), len);
+    lc_shm_drop(&ch->c, len);
+    return 1;
+  }
+  luaL_buffinit(L, &b);
+  while (off < (uint32_t)len) {
+    char *p = luaL_prepbuffer(&b);
+    uint32_t n = (uint32_t)len - off < LUAL_BUFFERSIZE
+               ? (uint32_t)len - off : LUAL_BUFFERSIZE;
+    lc_shm_peek(&ch->c, p, off, n);
+    luaL_addsize(&b, n);
+    off += n;
+  }
+  lc_shm_drop(&ch->c, len);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* channel -- fd */
+int shmchannel_fileno(lua_State *L)
+{
+  struct shmchannel *ch = check_shmchannel(L, 1);
+  if (ch->fd == -1) return luaL_error(L, "the channel was not created here");
+  lua_pushnumber(L, ch->fd);
+  return 1;
+}
+
+/* channel -- */
+int shmchannel_close(lua_State *L)
+{
+  struct shmchannel *ch = luaL_checkudata(L, 1, SHMCHANNEL_HANDLE);
+  if (ch->c.h) {
+    lc_shm_close(&ch->c);
+    lc_shm_detach(&ch->c);
   }
-  return spawn_param_execute(params);   /* proc/nil error */
+  close_fd(&ch->fd);
+  return 0;
+}
+
+#else
+
+/* [size] -- nil error */
+int lc_shmchannel(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "not supported");
+  return 2;
 }
 
+int lc_shmattach(lua_State *L) { return lc_shmchannel(L); }
+int shmchannel_send(lua_State *L) { return lc_shmchannel(L); }
+int shmchannel_recv(lua_State *L) { return lc_shmchannel(L); }
+int shmchannel_fileno(lua_State *L) { return lc_shmchannel(L); }
+int shmchannel_close(lua_State *L) { return 0; }
+
+#endif
+
 #endif // USE_POSIX
 
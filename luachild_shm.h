@@ -0,0 +1,292 @@
+/*
+Shared memory channel of luachild, for the child side.
+
+A channel created by lc.shmchannel is a memfd holding two single-producer,
+single-consumer ring buffers of messages, one for each direction, with futex
+wakeups. A child gets the memfd through the fds option of lc.spawn, then
+attaches to it as the peer:
+
+  #include "luachild_shm.h"
+
+  struct lc_shm ch;
+  char buf[256];
+  int n;
+  if (lc_shm_attach(&ch, 3, LC_SHM_PEER)) return 1;
+  while ((n = lc_shm_recv(&ch, buf, sizeof buf, -1)) >= 0)
+    lc_shm_send(&ch, buf, n, -1);
+  lc_shm_detach(&ch);
+
+The timeouts are in milliseconds: -1 waits forever, 0 does not wait. The
+functions return -1 and set errno on error: EAGAIN on timeout, EPIPE if the
+channel was closed by the other side, EMSGSIZE if a message does not fit the
+ring or the buffer, EPROTO if the peer wrote a corrupt length. Only linux is supported. The same code is used by the
+module, so both sides always agree on the layout.
+*/
+
+#ifndef _LUA_CHILD_SHM_H_
+#define _LUA_CHILD_SHM_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LC_SHM_MAGIC 0x6c637368 /* "lcsh" */
+#define LC_SHM_LINE 64
+#define LC_SHM_SPIN 200
+#define LC_SHM_SLICE 100 /* ms between the checks of the closed flag */
+
+#define LC_SHM_OWNER 0  /* the side that created the channel */
+#define LC_SHM_PEER 1
+
+/* head and tail are free-running byte counters, on their own cache lines */
+struct lc_shm_ring {
+  uint32_t head;          /* written by the producer */
+  uint32_t reader_waits;
+  char pad1[LC_SHM_LINE - 8];
+  uint32_t tail;          /* written by the consumer */
+  uint32_t writer_waits;
+  char pad2[LC_SHM_LINE - 8];
+};
+
+/* The memfd holds the header, then the data of ring[0] and of ring[1].
+ * ring[0] goes from the owner to the peer.
+ */
+struct lc_shm_header {
+  uint32_t magic;
+  uint32_t size;          /* bytes of each ring, a power of two */
+  uint32_t closed;
+  char pad[LC_SHM_LINE - 12];
+  struct lc_shm_ring ring[2];
+};
+
+struct lc_shm {
+  struct lc_shm_header *h;
+  size_t map_size;
+  struct lc_shm_ring *out, *in;
+  unsigned char *out_data, *in_data;
+  uint32_t mask;
+};
+
+static inline size_t lc_shm_map_size(uint32_t size)
+{
+  return sizeof(struct lc_shm_header) + 2 * (size_t)size;
+}
+
+/* Maps the channel of the memfd fd; the fd can be closed afterwards. */
+static inline int lc_shm_attach(struct lc_shm *c, int fd, int side)
+{
+  struct stat st;
+  void *m;
+  if (-1 == fstat(fd, &st)) return -1;
+  if ((size_t)st.st_size < sizeof(struct lc_shm_header)) {
+    errno = EINVAL;
+    return -1;
+  }
+  m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) return -1;
+  c->h = m;
+  c->map_size = st.st_size;
+  if (c->h->magic != LC_SHM_MAGIC
+      || lc_shm_map_size(c->h->size) != c->map_size) {
+    munmap(m, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  c->out = &c->h->ring[side];
+  c->in = &c->h->ring[!side];
+  c->out_data = (unsigned char *)(c->h + 1) + (size_t)side * c->h->size;
+  c->in_data = (unsigned char *)(c->h + 1) + (size_t)!side * c->h->size;
+  c->mask = c->h->size - 1;
+  return 0;
+}
+
+static inline void lc_shm_detach(struct lc_shm *c)
+{
+  if (c->h) munmap(c->h, c->map_size);
+  c->h = 0;
+}
+
+static inline void lc_shm_wake(uint32_t *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, 0x7fffffff, 0, 0, 0);
+}
+
+/* Tells the other side that no more messages will be exchanged */
+static inline void lc_shm_close(struct lc_shm *c)
+{
+  __atomic_store_n(&c->h->closed, 1, __ATOMIC_SEQ_CST);
+  lc_shm_wake(&c->out->tail);
+  lc_shm_wake(&c->in->head);
+  lc_shm_wake(&c->out->head);
+  lc_shm_wake(&c->in->tail);
+}
+
+static inline int64_t lc_shm_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Waits until *addr changes from val, or the deadline (ms, -1 for none).
+ * The wait is cut in slices, since closing does not change *addr.
+ */
+static inline int lc_shm_wait(uint32_t *addr, uint32_t *waits, uint32_t val,
+                              int64_t deadline)
+{
+  struct timespec ts;
+  int64_t left = LC_SHM_SLICE;
+  if (deadline >= 0) {
+    left = deadline - lc_shm_now_ms();
+    if (left <= 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (left > LC_SHM_SLICE) left = LC_SHM_SLICE;
+  }
+  ts.tv_sec = left / 1000;
+  ts.tv_nsec = (left % 1000) * 1000000;
+  __atomic_store_n(waits, 1, __ATOMIC_SEQ_CST);
+  /* the other side may have changed the value before seeing the flag */
+  if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val)
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, 0, 0);
+  __atomic_store_n(waits, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static inline void lc_shm_publish(uint32_t *addr, uint32_t *waits, uint32_t val)
+{
+  __atomic_store_n(addr, val, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waits, __ATOMIC_SEQ_CST))
+    lc_shm_wake(addr);
+}
+
+/* Messages are a 4 byte length and the payload, padded to 4 bytes */
+static inline uint32_t lc_shm_frame(uint32_t len)
+{
+  return 4 + ((len + 3) & ~(uint32_t)3);
+}
+
+static inline void lc_shm_copy_in(unsigned char *data, uint32_t mask,
+                                  uint32_t pos, const void *src, uint32_t len)
+{
+  uint32_t off = pos & mask, first = mask + 1 - off;
+  if (first > len) first = len;
+  memcpy(data + off, src, first);
+  memcpy(data, (const char *)src + first, len - first);
+}
+
+static inline void lc_shm_copy_out(const unsigned char *data, uint32_t mask,
+                                   uint32_t pos, void *dst, uint32_t len)
+{
+  uint32_t off = pos & mask, first = mask + 1 - off;
+  if (first > len) first = len;
+  memcpy(dst, data + off, first);
+  memcpy((char *)dst + first, data, len - first);
+}
+
+static inline int64_t lc_shm_deadline(int timeout_ms)
+{
+  return timeout_ms < 0 ? -1 : lc_shm_now_ms() + timeout_ms;
+}
+
+static inline int lc_shm_send(struct lc_shm *c, const void *msg, uint32_t len,
+                              int timeout_ms)
+{
+  struct lc_shm_ring *r = c->out;
+  uint32_t frame = lc_shm_frame(len), head = r->head, tail;
+  int64_t deadline = -2;
+  int spin = 0;
+  if (len > c->mask + 1 - 4 || frame > c->mask + 1) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  for (;;) {
+    if (__atomic_load_n(&c->h->closed, __ATOMIC_RELAXED)) {
+      errno = EPIPE;
+      return -1;
+    }
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail + frame <= c->mask + 1) break;
+    if (timeout_ms == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (spin++ < LC_SHM_SPIN) continue;
+    if (deadline == -2) deadline = lc_shm_deadline(timeout_ms);
+    if (lc_shm_wait(&r->tail, &r->writer_waits, tail, deadline)) return -1;
+  }
+  lc_shm_copy_in(c->out_data, c->mask, head, &len, 4);
+  lc_shm_copy_in(c->out_data, c->mask, head + 4, msg, len);
+  lc_shm_publish(&r->head, &r->reader_waits, head + frame);
+  return 0;
+}
+
+/* Waits for a message and returns its length, without consuming it. The
+ * length is written by the peer, so one that does not fit the ring or the
+ * published data fails with EPROTO.
+ */
+static inline int lc_shm_next(struct lc_shm *c, int timeout_ms)
+{
+  struct lc_shm_ring *r = c->in;
+  uint32_t tail = r->tail, head, len;
+  int64_t deadline = -2;
+  int spin = 0;
+  for (;;) {
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head != tail) break;
+    if (__atomic_load_n(&c->h->closed, __ATOMIC_ACQUIRE)) {
+      errno = EPIPE;
+      return -1;
+    }
+    if (timeout_ms == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (spin++ < LC_SHM_SPIN) continue;
+    if (deadline == -2) deadline = lc_shm_deadline(timeout_ms);
+    if (lc_shm_wait(&r->head, &r->reader_waits, head, deadline)) return -1;
+  }
+  lc_shm_copy_out(c->in_data, c->mask, tail, &len, 4);
+  if (len > c->mask + 1 - 4 || lc_shm_frame(len) > head - tail) {
+    errno = EPROTO;
+    return -1;
+  }
+  return (int)len;
+}
+
+/* Copies len bytes of the next message, from the offset off */
+static inline void lc_shm_peek(struct lc_shm *c, void *buf, uint32_t off,
+                               uint32_t len)
+{
+  lc_shm_copy_out(c->in_data, c->mask, c->in->tail + 4 + off, buf, len);
+}
+
+/* Consumes the next message, that is len bytes long */
+static inline void lc_shm_drop(struct lc_shm *c, uint32_t len)
+{
+  struct lc_shm_ring *r = c->in;
+  lc_shm_publish(&r->tail, &r->writer_waits, r->tail + lc_shm_frame(len));
+}
+
+static inline int lc_shm_recv(struct lc_shm *c, void *buf, uint32_t cap,
+                              int timeout_ms)
+{
+  int len = lc_shm_next(c, timeout_ms);
+  if (len < 0) return -1;
+  if ((uint32_t)len > cap) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  lc_shm_peek(c, buf, 0, len);
+  lc_shm_drop(c, len);
+  return len;
+}
+
+#endif // _LUA_CHILD_SHM_H_
@@ -0,0 +1,208 @@
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luachild.h"
+
+/* The counters are shared by all the lua states of the host process, so they
+ * are updated with relaxed atomic operations.
+ */
+#ifdef _MSC_VER
+#include <windows.h>
+typedef volatile LONG64 stat_t;
+#define stat_add(c, n) InterlockedExchangeAdd64(&(c), (n))
+#define stat_get(c) InterlockedCompareExchange64(&(c), 0, 0)
+#define stat_set(c, n) InterlockedExchange64(&(c), (n))
+#define stat_cas(c, old, n) \
+  (InterlockedCompareExchange64(&(c), (n), (old)) == (old))
+#else
+typedef long long stat_t;
+#define stat_add(c, n) __atomic_fetch_add(&(c), (n), __ATOMIC_RELAXED)
+#define stat_get(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#define stat_set(c, n) __atomic_store_n(&(c), (n), __ATOMIC_RELAXED)
+#define stat_cas(c, old, n) \
+  __atomic_compare_exchange_n(&(c), &(old), (n), 0, __ATOMIC_RELAXED, \
+                              __ATOMIC_RELAXED)
+#endif
+
+/* Log-linear histogram of nanoseconds, as in HDR histograms: values below
+ * HIST_SUB have a bucket each, then each power of two is split in HIST_SUB
+ * buckets, so a value is known within 1/HIST_SUB of itself. The values from
+ * 2^HIST_TOP ns (about 18 minutes) go in the last bucket.
+ */
+#define HIST_BITS 4
+#define HIST_SUB (1 << HIST_BITS)
+#define HIST_TOP 40
+#define HIST_BUCKETS ((HIST_TOP - HIST_BITS + 1) * HIST_SUB)
+
+struct histogram {
+  stat_t count, sum, max;
+  stat_t buckets[HIST_BUCKETS];
+};
+
+static struct {
+  stat_t spawns, spawn_errors, exits, live;
+  stat_t waits, wait_timeouts;
+  stat_t pipes, pipe_errors;
+  struct histogram spawn_time, wait_time;
+} stats;
+
+static int hist_index(long long ns)
+{
+  int e = HIST_BITS;
+  if (ns < HIST_SUB) return ns < 0 ? 0 : (int)ns;
+  if (ns >= (1LL << HIST_TOP)) return HIST_BUCKETS - 1;
+  while (ns >> (e + 1)) e++;
+  return (e - HIST_BITS + 1) * HIST_SUB
+    + (int)((ns >> (e - HIST_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value of the bucket i */
+static long long hist_upper(int i)
+{
+  int e = i / HIST_SUB + HIST_BITS - 1;
+  if (i < HIST_SUB) return i;
+  return ((long long)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_BITS)) - 1;
+}
+
+static void hist_record(struct histogram *h, double seconds)
+{
+  long long ns = (long long)(seconds * 1e9), max = stat_get(h->max);
+  stat_add(h->count, 1);
+  stat_add(h->sum, ns);
+  stat_add(h->buckets[hist_index(ns)], 1);
+  while (ns > max && !stat_cas(h->max, max, ns))
+    max = stat_get(h->max);
+}
+
+static void hist_reset(struct histogram *h)
+{
+  int i;
+  stat_set(h->count, 0);
+  stat_set(h->sum, 0);
+  stat_set(h->max, 0);
+  for (i = 0; i < HIST_BUCKETS; i++)
+    stat_set(h->buckets[i], 0);
+}
+
+/* Sets the field name to the seconds of the q-quantile of the n values. The
+ * buckets are read once, so the quantiles are consistent with each other
+ * even while other threads record.
+ */
+static void push_quantile(lua_State *L, const long long *b, long long n,
+                          double q, long long max, const char *name)
+{
+  long long rank = (long long)(q * n + 0.5), seen = 0, v = 0;
+  int i;
+  if (rank < 1) rank = 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += b[i];
+    if (seen >= rank) break;
+  }
+  if (i < HIST_BUCKETS) v = hist_upper(i);
+  if (v > max) v = max;
+  lua_pushnumber(L, v / 1e9);
+  lua_setfield(L, -2, name);
+}
+
+/* -- {count=n, total=s, mean=s, max=s, p50=s, p90=s, p99=s, p999=s} */
+static void push_histogram(lua_State *L, struct histogram *h)
+{
+  long long b[HIST_BUCKETS], n = 0, max = stat_get(h->max);
+  long long sum = stat_get(h->sum);
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    n += b[i] = stat_get(h->buckets[i]);
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, n);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, sum / 1e9);
+  lua_setfield(L, -2, "total");
+  lua_pushnumber(L, n ? sum / 1e9 / n : 0);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, max / 1e9);
+  lua_setfield(L, -2, "max");
+  push_quantile(L, b, n, 0.5, max, "p50");
+  push_quantile(L, b, n, 0.9, max, "p90");
+  push_quantile(L, b, n, 0.99, max, "p99");
+  push_quantile(L, b, n, 0.999, max, "p999");
+}
+
+/* The module reports its events here, for the counters and for the tracer */
+
+void stats_spawn(double start, const char *command, long pid, int ok)
+{
+  trace_spawn(start, command, pid, ok);
+  if (!ok) {
+    stat_add(stats.spawn_errors, 1);
+    return;
+  }
+  stat_add(stats.spawns, 1);
+  stat_add(stats.live, 1);
+  hist_record(&stats.spawn_time, monotonic_time() - start);
+}
+
+void stats_exit(long pid, int code)
+{
+  trace_exit(pid, code);
+  stat_add(stats.exits, 1);
+  stat_add(stats.live, -1);
+}
+
+void stats_wait(double start, long pid, int timedout)
+{
+  trace_wait(start, pid, timedout);
+  stat_add(stats.waits, 1);
+  if (timedout) stat_add(stats.wait_timeouts, 1);
+  hist_record(&stats.wait_time, monotonic_time() - start);
+}
+
+void stats_pipe(int ok)
+{
+  if (ok) trace_pipe();
+  if (ok) stat_add(stats.pipes, 1);
+  else stat_add(stats.pipe_errors, 1);
+}
+
+static void set_counter(lua_State *L, stat_t *c, const char *name)
+{
+  lua_pushnumber(L, stat_get(*c));
+  lua_setfield(L, -2, name);
+}
+
+/* -- stats */
+int lc_stats(lua_State *L)
+{
+  lua_createtable(L, 0, 10);
+  set_counter(L, &stats.spawns, "spawns");
+  set_counter(L, &stats.spawn_errors, "spawn_errors");
+  set_counter(L, &stats.exits, "exits");
+  set_counter(L, &stats.live, "live");
+  set_counter(L, &stats.waits, "waits");
+  set_counter(L, &stats.wait_timeouts, "wait_timeouts");
+  set_counter(L, &stats.pipes, "pipes");
+  set_counter(L, &stats.pipe_errors, "pipe_errors");
+  push_histogram(L, &stats.spawn_time);
+  lua_setfield(L, -2, "spawn_time");
+  push_histogram(L, &stats.wait_time);
+  lua_setfield(L, -2, "wait_time");
+  return 1;
+}
+
+/* live is a gauge of the children not yet waited, so it is kept */
+/* -- */
+int lc_stats_reset(lua_State *L)
+{
+  (void)L;
+  stat_set(stats.spawns, 0);
+  stat_set(stats.spawn_errors, 0);
+  stat_set(stats.exits, 0);
+  stat_set(stats.waits, 0);
+  stat_set(stats.wait_timeouts, 0);
+  stat_set(stats.pipes, 0);
+  stat_set(stats.pipe_errors, 0);
+  hist_reset(&stats.spawn_time);
+  hist_reset(&stats.wait_time);
+  return 0;
+}
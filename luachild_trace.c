@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luachild.h"
+
+#ifdef USE_WINDOWS
+#include <windows.h>
+typedef HANDLE trace_thread_t;
+#define host_pid() ((long)GetCurrentProcessId())
+#define thread_id() ((long)GetCurrentThreadId())
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#define thread_id() ((long)syscall(SYS_gettid))
+#else
+#define thread_id() ((long)getpid())
+#endif
+typedef pthread_t trace_thread_t;
+#define host_pid() ((long)getpid())
+#endif
+
+#ifdef _MSC_VER
+#define atomic_load(v) InterlockedCompareExchange((volatile LONG *)&(v), 0, 0)
+#define atomic_store(v, n) InterlockedExchange((volatile LONG *)&(v), (n))
+#define atomic_add(v, n) InterlockedExchangeAdd((volatile LONG *)&(v), (n))
+#define atomic_cas(v, old, n) \
+  (InterlockedCompareExchange((volatile LONG *)&(v), (n), (old)) == (LONG)(old))
+#else
+#define atomic_load(v) __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define atomic_store(v, n) __atomic_store_n(&(v), (n), __ATOMIC_SEQ_CST)
+#define atomic_add(v, n) __atomic_fetch_add(&(v), (n), __ATOMIC_SEQ_CST)
+#define atomic_cas(v, old, n) \
+  __atomic_compare_exchange_n(&(v), &(old), (n), 0, __ATOMIC_SEQ_CST, \
+                              __ATOMIC_SEQ_CST)
+#endif
+
+#define TRACE_SLOTS 4096          /* a power of two */
+#define TRACE_NAME 64
+#define TRACE_PERIOD_MS 20        /* between the flushes of the writer */
+
+enum { TRACE_SPAWN, TRACE_SPAWN_ERROR, TRACE_EXIT, TRACE_WAIT, TRACE_PIPE };
+enum { TRACE_OFF, TRACE_BUSY, TRACE_ON };
+
+/* An event is ready to be written when seq is its position + 1, and the slot
+ * is free for the position p when seq is p, as in the bounded queue of
+ * Dmitry Vyukov. So the threads that record never wait for each other, and
+ * an event is dropped only when the writer is TRACE_SLOTS events behind.
+ */
+struct trace_event {
+  unsigned seq;
+  int kind;
+  int code;
+  long tid, pid;
+  double ts, dur;
+  char name[TRACE_NAME];
+};
+
+static struct {
+  int state;
+  int writers;                    /* threads recording an event */
+  unsigned head;                  /* the next position to record */
+  unsigned tail;                  /* the next position to write */
+  unsigned dropped, written;
+  unsigned generation;            /* of the trace, counting the starts */
+  long pid;
+  FILE *f;
+  trace_thread_t thread;
+  struct trace_event ring[TRACE_SLOTS];
+} trace;
+
+static void trace_record(int kind, double ts, double dur, long pid, int code,
+                         const char *name)
+{
+  struct trace_event *e;
+  unsigned pos;
+  atomic_add(trace.writers, 1);
+  if (atomic_load(trace.state) != TRACE_ON) {
+    atomic_add(trace.writers, -1);
+    return;
+  }
+  for (;;) {
+    pos = atomic_load(trace.head);
+    e = &trace.ring[pos & (TRACE_SLOTS - 1)];
+    if (atomic_load(e->seq) != pos) {
+      /* a full ring, or a slot just taken by another thread */
+      if ((int)(atomic_load(e->seq) - pos) < 0) {
+        atomic_add(trace.dropped, 1);
+        atomic_add(trace.writers, -1);
+        return;
+      }
+      continue;
+    }
+    if (atomic_cas(trace.head, pos, pos + 1)) break;
+  }
+  e->kind = kind;
+  e->code = code;
+  e->tid = thread_id();
+  e->pid = pid;
+  e->ts = ts * 1e6;
+  e->dur = dur * 1e6;
+  e->name[0] = 0;
+  if (name) {
+    strncpy(e->name, name, TRACE_NAME - 1);
+    e->name[TRACE_NAME - 1] = 0;
+  }
+  atomic_store(e->seq, pos + 1);
+  atomic_add(trace.writers, -1);
+}
+
+void trace_spawn(double start, const char *command, long pid, int ok)
+{
+  double now = monotonic_time();
+  trace_record(ok ? TRACE_SPAWN : TRACE_SPAWN_ERROR, start, now - start, pid,
+               0, command);
+}
+
+void trace_exit(long pid, int code)
+{
+  trace_record(TRACE_EXIT, monotonic_time(), 0, pid, code, 0);
+}
+
+void trace_wait(double start, long pid, int timedout)
+{
+  trace_record(TRACE_WAIT, start, monotonic_time() - start, pid, timedout, 0);
+}
+
+void trace_pipe(void)
+{
+  trace_record(TRACE_PIPE, monotonic_time(), 0, 0, 0, 0);
+}
+
+static void write_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+    else if (c < 0x20) fprintf(f, "\\u%04x", c);
+    else fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+/* Writes an object of the Trace Event Format, read by Perfetto and by
+ * chrome://tracing. The children are on their own track, as threads of the
+ * traced program named after the command, from the spawn to the exit.
+ */
+static void write_event(FILE *f, long pid, struct trace_event *e)
+{
+  const char *sep = trace.written++ ? ",\n" : "";
+  switch (e->kind) {
+  case TRACE_SPAWN:
+    fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,"
+            "\"tid\":%ld,\"args\":{\"name\":", sep, pid, e->pid);
+    write_string(f, e->name);
+    fprintf(f, "}},\n{\"ph\":\"X\",\"name\":\"spawn\",\"pid\":%ld,"
+            "\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pid\":%ld,"
+            "\"command\":", pid, e->tid, e->ts, e->dur, e->pid);
+    write_string(f, e->name);
+    fprintf(f, "}},\n{\"ph\":\"B\",\"name\":");
+    write_string(f, e->name);
+    fprintf(f, ",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f}",
+            pid, e->pid, e->ts + e->dur);
+    break;
+  case TRACE_SPAWN_ERROR:
+    fprintf(f, "%s{\"ph\":\"X\",\"name\":\"spawn\",\"pid\":%ld,\"tid\":%ld,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"error\":true,\"command\":",
+            sep, pid, e->tid, e->ts, e->dur);
+    write_string(f, e->name);
+    fprintf(f, "}}");
+    break;
+  case TRACE_EXIT:
+    fprintf(f, "%s{\"ph\":\"E\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,"
+            "\"args\":{\"exitcode\":%d}}", sep, pid, e->pid, e->ts, e->code);
+    break;
+  case TRACE_WAIT:
+    fprintf(f, "%s{\"ph\":\"X\",\"name\":\"wait\",\"pid\":%ld,\"tid\":%ld,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pid\":%ld,\"timeout\":%s}}",
+            sep, pid, e->tid, e->ts, e->dur, e->pid,
+            e->code ? "true" : "false");
+    break;
+  case TRACE_PIPE:
+    fprintf(f, "%s{\"ph\":\"i\",\"s\":\"t\",\"name\":\"pipe\",\"pid\":%ld,"
+            "\"tid\":%ld,\"ts\":%.3f}", sep, pid, e->tid, e->ts);
+    break;
+  }
+}
+
+/* Writes the events recorded so far, then frees their slots */
+static void trace_flush(void)
+{
+  for (;;) {
+    struct trace_event *e = &trace.ring[trace.tail & (TRACE_SLOTS - 1)];
+    if (atomic_load(e->seq) != trace.tail + 1) break;
+    write_event(trace.f, trace.pid, e);
+    atomic_store(e->seq, trace.tail + TRACE_SLOTS);
+    trace.tail++;
+  }
+  fflush(trace.f);
+}
+
+#ifdef USE_WINDOWS
+static DWORD WINAPI trace_writer(LPVOID arg)
+{
+  (void)arg;
+  while (atomic_load(trace.state) == TRACE_ON) {
+    trace_flush();
+    Sleep(TRACE_PERIOD_MS);
+  }
+  return 0;
+}
+#else
+static void *trace_writer(void *arg)
+{
+  struct timespec ts = {0, TRACE_PERIOD_MS * 1000000L};
+  (void)arg;
+  while (atomic_load(trace.state) == TRACE_ON) {
+    trace_flush();
+    nanosleep(&ts, 0);
+  }
+  return 0;
+}
+#endif
+
+/* path -- true/nil error */
+int lc_trace_start(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  int off = TRACE_OFF, err;
+  unsigned i;
+  if (!atomic_cas(trace.state, off, TRACE_BUSY)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "trace already started");
+    return 2;
+  }
+  if (!(trace.f = fopen(path, "w"))) {
+    err = errno;
+    atomic_store(trace.state, TRACE_OFF);
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+  }
+#ifndef USE_WINDOWS
+  fcntl(fileno(trace.f), F_SETFD, FD_CLOEXEC);
+#endif
+  fputs("[\n", trace.f);
+  for (i = 0; i < TRACE_SLOTS; i++)
+    trace.ring[i].seq = i;
+  trace.head = trace.tail = 0;
+  trace.dropped = trace.written = 0;
+  trace.pid = host_pid();
+  atomic_add(trace.generation, 1);
+  atomic_store(trace.state, TRACE_ON);
+#ifdef USE_WINDOWS
+  trace.thread = CreateThread(0, 0, trace_writer, 0, 0, 0);
+  err = trace.thread ? 0 : EAGAIN;
+#else
+  err = pthread_create(&trace.thread, 0, trace_writer, 0);
+#endif
+  if (err) {
+    atomic_store(trace.state, TRACE_OFF);
+    fclose(trace.f);
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+  }
+  /* the sentinel stops the trace when the state is closed */
+  *(unsigned *)lua_newuserdata(L, sizeof(unsigned)) = trace.generation;
+  luaL_getmetatable(L, TRACE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, "luachild.trace");
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* The events recorded by other threads while stopping are waited, so that no
+ * slot is left half written for the next trace. The state must be
+ * TRACE_BUSY. Returns non zero if the file could not be written.
+ */
+static int trace_finish(void)
+{
+  int failed;
+  while (atomic_load(trace.writers) > 0)
+    ;
+#ifdef USE_WINDOWS
+  WaitForSingleObject(trace.thread, INFINITE);
+  CloseHandle(trace.thread);
+#else
+  pthread_join(trace.thread, 0);
+#endif
+  trace_flush();
+  fputs("\n]\n", trace.f);
+  failed = ferror(trace.f);
+  failed = fclose(trace.f) || failed;
+  atomic_store(trace.state, TRACE_OFF);
+  return failed;
+}
+
+/* -- written dropped/nil error */
+int lc_trace_stop(lua_State *L)
+{
+  int on = TRACE_ON;
+  if (!atomic_cas(trace.state, on, TRACE_BUSY)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "trace not started");
+    return 2;
+  }
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, "luachild.trace");
+  if (trace_finish()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "error writing the trace");
+    return 2;
+  }
+  lua_pushnumber(L, trace.written);
+  lua_pushnumber(L, trace.dropped);
+  return 2;
+}
+
+/* Stops the trace started by the state, if it was not stopped yet. A trace
+ * started later by another state is left alone.
+ */
+/* sentinel -- */
+int trace_gc(lua_State *L)
+{
+  unsigned generation = *(unsigned *)luaL_checkudata(L, 1, TRACE_HANDLE);
+  int on = TRACE_ON;
+  if (atomic_load(trace.generation) != generation
+      || !atomic_cas(trace.state, on, TRACE_BUSY))
+    return 0;
+  if (trace.generation != generation) {
+    atomic_store(trace.state, TRACE_ON);
+    return 0;
+  }
+  trace_finish();
+  return 0;
+}
@@ -34,7 +34,11 @@ THE SOFTWARE.
 #define NOGDI 1
 
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
+#define PSAPI_VERSION 2 /* GetProcessMemoryInfo from kernel32 */
+#include <psapi.h>
+#include <tlhelp32.h>
 #include <fcntl.h>
 
 #include "lua.h"
@@ -86,25 +90,38 @@ static int push_error(lua_State *L) {
  return windows_pusherror(L, GetLastError(), -2);
 }
 
-/* ----------------------------------------------------------------------------- */
+double monotonic_time(void)
+{
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / freq.QuadPart;
+}
 
-/* name value -- true/nil error
- * name nil -- true/nil error */
-int lc_setenv(lua_State *L)
+/* -- seconds */
+int lc_clock(lua_State *L)
 {
-  const char *nam = luaL_checkstring(L, 1);
-  const char *val = lua_tostring(L, 2);
-  if (!SetEnvironmentVariable(nam, val))
-    return push_error(L);
-  lua_pushboolean(L, 1);
+  lua_pushnumber(L, monotonic_time());
   return 1;
 }
 
+int cpu_count(void)
+{
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
+}
+
+const char spawn_backend[] = "CreateProcess";
+
+/* ----------------------------------------------------------------------------- */
+
 /* -- environment-table */
 int lc_environ(lua_State *L)
 {
   const char *nam, *val, *end;
-  const char *envs = GetEnvironmentStrings();
+  struct envblock *e = state_envblock(L, 0);
+  const char *envs = e ? envblock_string(e) : GetEnvironmentStrings();
   if (!envs) return push_error(L);
   lua_newtable(L);
   for (nam = envs; *nam; nam = end + 1) {
@@ -116,19 +133,150 @@ int lc_environ(lua_State *L)
   return 1;
 }
 
+/* A pipe side without the stdio buffering, see lc_pipe */
+struct rawfd {
+  HANDLE h;
+  char *buf;
+  size_t cap;
+};
+
+/* -- rawfd */
+static struct rawfd *rawfd_new(lua_State *L, HANDLE h)
+{
+  struct rawfd *f = lua_newuserdata(L, sizeof *f);
+  f->h = h;
+  f->buf = 0;
+  f->cap = 0;
+  luaL_getmetatable(L, FD_HANDLE);
+  lua_setmetatable(L, -2);
+  return f;
+}
+
+static struct rawfd *check_rawfd(lua_State *L, int idx)
+{
+  struct rawfd *f = luaL_checkudata(L, idx, FD_HANDLE);
+  if (!f->h) return luaL_error(L, "attempt to use a closed fd"), NULL;
+  return f;
+}
+
+/* Returns the rawfd at index idx, or null if it is something else. */
+static struct rawfd *to_rawfd(lua_State *L, int idx)
+{
+  struct rawfd *f = lua_touserdata(L, idx);
+  idx = absindex(L, idx);
+  if (!f || !lua_getmetatable(L, idx)) return 0;
+  luaL_getmetatable(L, FD_HANDLE);
+  if (!lua_rawequal(L, -1, -2)) f = 0;
+  lua_pop(L, 2);
+  return f;
+}
+
+/* -- in out/nil error */
+/* {raw=bool} -- in out/nil error */
 int lc_pipe(lua_State *L)
 {
-  if (!file_handler_creator(L, "COMSPEC", 1)) return 0;
+  int raw = 0;
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "raw");
+    raw = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  if (!raw && !file_handler_creator(L, "COMSPEC", 1)) return 0;
   HANDLE ph[2];
-  if (!CreatePipe(ph + 0, ph + 1, 0, 0))
+  BOOL ok = CreatePipe(ph + 0, ph + 1, 0, 0);
+  stats_pipe(ok);
+  if (!ok)
     return push_error(L);
   SetHandleInformation(ph[0], HANDLE_FLAG_INHERIT, 0);
   SetHandleInformation(ph[1], HANDLE_FLAG_INHERIT, 0);
+  if (raw) {
+    rawfd_new(L, ph[0]);
+    rawfd_new(L, ph[1]);
+    return 2;
+  }
   lua_pushcfile(L, _fdopen(_open_osfhandle((long)ph[0], _O_RDONLY), "r"));
   lua_pushcfile(L, _fdopen(_open_osfhandle((long)ph[1], _O_WRONLY), "w"));
   return 2;
 }
 
+/* rawfd [n] -- data/nil [error] */
+int rawfd_read(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  lua_Integer size = luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
+  size_t n;
+  DWORD r;
+  luaL_argcheck(L, size > 0, 2, "positive size expected");
+  n = (size_t)size;
+  if (n > f->cap) {
+    char *buf = realloc(f->buf, n);
+    if (!buf) return luaL_error(L, "not enough memory");
+    f->buf = buf;
+    f->cap = n;
+  }
+  if (!ReadFile(f->h, f->buf, (DWORD)n, &r, 0)) {
+    if (GetLastError() == ERROR_BROKEN_PIPE) return lua_pushnil(L), 1;
+    return push_error(L);
+  }
+  if (r == 0) return lua_pushnil(L), 1;
+  lua_pushlstring(L, f->buf, r);
+  return 1;
+}
+
+/* rawfd data -- n/nil error */
+int rawfd_write(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  size_t len, done = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+  while (done < len) {
+    DWORD w;
+    if (!WriteFile(f->h, data + done, (DWORD)(len - done), &w, 0))
+      return push_error(L);
+    done += w;
+  }
+  lua_pushnumber(L, done);
+  return 1;
+}
+
+/* rawfd -- handle */
+int rawfd_fileno(lua_State *L)
+{
+  lua_pushlightuserdata(L, check_rawfd(L, 1)->h);
+  return 1;
+}
+
+/* rawfd -- true */
+int rawfd_close(lua_State *L)
+{
+  struct rawfd *f = check_rawfd(L, 1);
+  CloseHandle(f->h);
+  f->h = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* rawfd -- */
+int rawfd_gc(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (f->h) CloseHandle(f->h);
+  f->h = 0;
+  free(f->buf);
+  f->buf = 0;
+  f->cap = 0;
+  return 0;
+}
+
+/* rawfd -- str */
+int rawfd_tostring(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (!f->h) lua_pushliteral(L, "fd (closed)");
+  else lua_pushfstring(L, "fd (%p)", f->h);
+  return 1;
+}
+
 /* ----------------------------------------------------------------------------- */
 
 /* -- in out/nil error */
@@ -136,7 +284,12 @@ struct spawn_params {
   lua_State *L;
   const char *cmdline;
   const char *environment;
+  struct envblock *envblock;
   STARTUPINFO si;
+  int capture[3];
+  DWORD flags;        /* creation flags, like the priority class */
+  DWORD_PTR cpus;     /* affinity mask, 0 to inherit the one of the parent */
+  double timeout;     /* seconds before the kill, -1 for none */
 };
 
 static int need_quote(const char *s, size_t l){
@@ -199,7 +352,12 @@ static struct spawn_params *spawn_param_init(lua_State *L)
   struct spawn_params *p = lua_newuserdata(L, sizeof *p);
   p->L = L;
   p->cmdline = p->environment = 0;
+  p->envblock = 0;
   p->si = si;
+  p->capture[0] = p->capture[1] = p->capture[2] = 0;
+  p->flags = 0;
+  p->cpus = 0;
+  p->timeout = -1;
   return p;
 }
 
@@ -215,8 +373,9 @@ static void spawn_param_filename(struct spawn_params *p)
   p->cmdline = lua_tostring(L, 1);
 }
 
+/* The array elements after index first are the arguments. */
 /* cmd ... argtab -- cmdline ... */
-static void spawn_param_args(struct spawn_params *p)
+static void spawn_param_args(struct spawn_params *p, int first)
 {
   lua_State *L = p->L;
   int argtab = lua_gettop(L);
@@ -228,7 +387,7 @@ static void spawn_param_args(struct spawn_params *p)
   lua_pushvalue(L, 1);            /* cmd opts ... argtab nil b... cmd */
   luaL_addvalue(&b);              /* cmd opts ... argtab nil b... */
   /* concatenate the arg array to a string */
-  for (i = 1; i <= n; i++) {
+  for (i = first + 1; i <= n; i++) {
     const char *s;
     lua_rawgeti(L, argtab, i);    /* cmd opts ... argtab nil b... arg */
     lua_replace(L, argtab + 1);   /* cmd opts ... argtab arg b... */
@@ -281,66 +440,618 @@ static void spawn_param_env(struct spawn_params *p)
   lua_settop(L, envtab + 1);
 }
 
-static void spawn_param_redirect(struct spawn_params *p, const char *stdname, HANDLE h)
+static int std_index(const char *stdname)
+{
+  switch (stdname[3]) {
+  case 'i': return 0;
+  case 'o': return 1;
+  default: return 2;
+  }
+}
+
+static void set_std_handle(STARTUPINFO *si, int i, HANDLE h)
 {
   SetHandleInformation(h, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
-  if (!(p->si.dwFlags & STARTF_USESTDHANDLES)) {
-    p->si.hStdInput  = GetStdHandle(STD_INPUT_HANDLE);
-    p->si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-    p->si.hStdError  = GetStdHandle(STD_ERROR_HANDLE);
-    p->si.dwFlags |= STARTF_USESTDHANDLES;
+  if (!(si->dwFlags & STARTF_USESTDHANDLES)) {
+    si->hStdInput  = GetStdHandle(STD_INPUT_HANDLE);
+    si->hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    si->hStdError  = GetStdHandle(STD_ERROR_HANDLE);
+    si->dwFlags |= STARTF_USESTDHANDLES;
   }
-  switch (stdname[3]) {
-  case 'i': p->si.hStdInput = h; break;
-  case 'o': p->si.hStdOutput = h; break;
-  case 'e': p->si.hStdError = h; break;
+  switch (i) {
+  case 0: si->hStdInput = h; break;
+  case 1: si->hStdOutput = h; break;
+  case 2: si->hStdError = h; break;
   }
 }
 
+/* ... envblock -- ... envblock */
+static void spawn_param_envblock(struct spawn_params *p, struct envblock *e)
+{
+  p->envblock = e;
+}
+
+static void spawn_param_redirect(struct spawn_params *p, const char *stdname, HANDLE h)
+{
+  set_std_handle(&p->si, std_index(stdname), h);
+}
+
+static void spawn_param_capture(struct spawn_params *p, const char *stdname)
+{
+  p->capture[std_index(stdname)] = 1;
+}
+
+/* Creates the pipes of the captured streams. The parent side is stored in
+ * pipes, the child side in child and in the startup info si.
+ */
+static BOOL spawn_param_pipes(struct spawn_params *p, STARTUPINFO *si,
+                              HANDLE *pipes, HANDLE *child)
+{
+  int i;
+  HANDLE ph[2];
+  for (i = 0; i < 3; i++) {
+    if (!p->capture[i]) continue;
+    if (!CreatePipe(ph + 0, ph + 1, 0, 0)) return FALSE;
+    pipes[i] = ph[i == 0 ? 1 : 0];
+    child[i] = ph[i == 0 ? 0 : 1];
+    set_std_handle(si, i, child[i]);
+  }
+  return TRUE;
+}
+
 struct process {
   int status;
   HANDLE hProcess;
   DWORD dwProcessId;
+  HANDLE pipes[3];
+  double start, end;
+  double deadline;    /* when it is killed, 0 for never */
+  int timedout;       /* it was killed at the deadline */
+  int reported;       /* it was returned by waitany */
 };
 
+static void process_set_status(struct process *p, DWORD exitcode)
+{
+  p->end = monotonic_time();
+  p->status = exitcode;
+  stats_exit(p->dwProcessId, exitcode);
+}
+
+static void close_handle(HANDLE *h)
+{
+  if (*h) CloseHandle(*h);
+  *h = 0;
+}
+
+static int pid_find(const DWORD *pids, size_t n, DWORD pid)
+{
+  while (n-- > 0)
+    if (pids[n] == pid) return 1;
+  return 0;
+}
+
+/* Terminates the descendants of root, found in a snapshot of the processes */
+static void terminate_descendants(DWORD root, UINT code)
+{
+  HANDLE snap = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+  PROCESSENTRY32 pe;
+  size_t n = 1, cap = 64, i;
+  DWORD *tree, *larger;
+  BOOL more, grown = TRUE;
+  if (snap == INVALID_HANDLE_VALUE) return;
+  if (!(tree = malloc(cap * sizeof *tree))) {
+    CloseHandle(snap);
+    return;
+  }
+  tree[0] = root;
+  while (grown) {
+    grown = FALSE;
+    pe.dwSize = sizeof pe;
+    for (more = Process32First(snap, &pe); more; more = Process32Next(snap, &pe)) {
+      if (pid_find(tree, n, pe.th32ProcessID)
+          || !pid_find(tree, n, pe.th32ParentProcessID))
+        continue;
+      if (n == cap) {
+        if (!(larger = realloc(tree, 2 * cap * sizeof *tree))) break;
+        tree = larger;
+        cap *= 2;
+      }
+      tree[n++] = pe.th32ProcessID;
+      grown = TRUE;
+    }
+  }
+  for (i = 1; i < n; i++) {
+    HANDLE h = OpenProcess(PROCESS_TERMINATE, FALSE, tree[i]);
+    if (h) {
+      TerminateProcess(h, code);
+      CloseHandle(h);
+    }
+  }
+  free(tree);
+  CloseHandle(snap);
+}
+
+/* There are no signals: the process is terminated with the exit code 128
+ * plus the signal number, as a killed posix process is reported.
+ */
+static BOOL process_kill_tree(struct process *p, int sig, int tree)
+{
+  BOOL ok = TerminateProcess(p->hProcess, 128 + sig);
+  if (tree) terminate_descendants(p->dwProcessId, 128 + sig);
+  return ok;
+}
+
+/* Kills the process and its descendants when its deadline has passed */
+static void process_expire(struct process *p)
+{
+  if (p->deadline == 0 || monotonic_time() < p->deadline) return;
+  p->deadline = 0;
+  p->timedout = 1;
+  process_kill_tree(p, 9, 1);
+}
+
+/* ms, or less if the deadline of p comes first */
+static DWORD deadline_ms(struct process *p, DWORD ms)
+{
+  double left;
+  if (p->deadline == 0) return ms;
+  left = p->deadline - monotonic_time();
+  if (left <= 0) return 0;
+  if (ms == INFINITE || left * 1000 + 1 < ms) return (DWORD)(left * 1000) + 1;
+  return ms;
+}
+
+/* Spawns the process described by p. The params are not changed, so they can
+ * be reused.
+ */
 static int spawn_param_execute(struct spawn_params *p)
 {
   lua_State *L = p->L;
   char *c, *e;
+  STARTUPINFO si = p->si;
   PROCESS_INFORMATION pi;
   BOOL ret;
+  DWORD error;
+  int i;
+  HANDLE child[3] = {0, 0, 0};
   struct process *proc = lua_newuserdata(L, sizeof *proc);
   luaL_getmetatable(L, PROCESS_HANDLE);
   lua_setmetatable(L, -2);
   proc->status = -1;
+  proc->hProcess = 0;
+  proc->pipes[0] = proc->pipes[1] = proc->pipes[2] = 0;
+  proc->start = proc->end = monotonic_time();
+  proc->deadline = p->timeout >= 0 ? proc->start + p->timeout : 0;
+  proc->timedout = proc->reported = 0;
   c = strdup(p->cmdline);
   e = (char *)p->environment; /* strdup(p->environment); */
+  if (p->envblock && !(e = (char *)envblock_string(p->envblock)))
+    return luaL_error(L, "not enough memory");
+  if (!e && state_envblock(L, 0)
+      && !(e = (char *)envblock_string(state_envblock(L, 0))))
+    return luaL_error(L, "not enough memory");
   /* XXX does CreateProcess modify its environment argument? */
-  ret = CreateProcess(0, c, 0, 0, TRUE, 0, e, 0, &p->si, &pi);
+  ret = spawn_param_pipes(p, &si, proc->pipes, child)
+    && CreateProcess(0, c, 0, 0, TRUE,
+                     p->flags | (p->cpus ? CREATE_SUSPENDED : 0),
+                     e, 0, &si, &pi);
+  error = GetLastError();
+  /* the affinity can be set only on a created process */
+  if (ret) {
+    if (p->cpus && !SetProcessAffinityMask(pi.hProcess, p->cpus)) {
+      error = GetLastError();
+      TerminateProcess(pi.hProcess, 111);
+      CloseHandle(pi.hProcess);
+      ret = FALSE;
+    }
+    else if (p->cpus)
+      ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+  }
   /* if (e) free(e); */
   free(c);
+  for (i = 0; i < 3; i++) {
+    close_handle(&child[i]);
+    if (!ret) close_handle(&proc->pipes[i]);
+  }
+  stats_spawn(proc->start, p->cmdline, ret ? pi.dwProcessId : 0, ret);
   if (!ret)
-    return push_error(L);
+    return windows_pusherror(L, error, -2);
   proc->hProcess = pi.hProcess;
   proc->dwProcessId = pi.dwProcessId;
   return 1;
 }
 
-/* proc -- exitcode/nil error */
+static double filetime_seconds(FILETIME ft)
+{
+  ULARGE_INTEGER t;
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+  return t.QuadPart / 1e7;
+}
+
+/* Context switches are not counted by windows, so nvcsw and nivcsw are
+ * missing.
+ */
+/* -- usage */
+static void push_usage(lua_State *L, struct process *p)
+{
+  FILETIME creation, exit, kernel, user;
+  PROCESS_MEMORY_COUNTERS mem;
+  lua_createtable(L, 0, 5);
+  if (p->hProcess && GetProcessTimes(p->hProcess, &creation, &exit, &kernel, &user)) {
+    lua_pushnumber(L, filetime_seconds(user));
+    lua_setfield(L, -2, "utime");
+    lua_pushnumber(L, filetime_seconds(kernel));
+    lua_setfield(L, -2, "stime");
+  }
+  if (p->hProcess && GetProcessMemoryInfo(p->hProcess, &mem, sizeof mem)) {
+    lua_pushnumber(L, mem.PeakWorkingSetSize / 1024);
+    lua_setfield(L, -2, "maxrss");
+    lua_pushnumber(L, mem.PageFaultCount);
+    lua_setfield(L, -2, "minflt");
+  }
+  lua_pushnumber(L, p->end - p->start);
+  lua_setfield(L, -2, "wall");
+  if (p->timedout) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "timedout");
+  }
+}
+
+/* proc [timeout [usage]] -- exitcode [usage]/nil error */
 int process_wait(lua_State *L)
 {
   struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  double timeout = luaL_optnumber(L, 2, -1), start = monotonic_time();
+  int usage = lua_toboolean(L, 3);
   if (p->status == -1) {
     DWORD exitcode;
-    if (WAIT_FAILED == WaitForSingleObject(p->hProcess, INFINITE)
+    DWORD ms = timeout < 0 ? INFINITE : (DWORD)(timeout * 1000);
+    DWORD ret = WaitForSingleObject(p->hProcess, deadline_ms(p, ms));
+    if (ret == WAIT_TIMEOUT && p->deadline > 0
+        && monotonic_time() >= p->deadline) {
+      process_expire(p);
+      ret = WaitForSingleObject(p->hProcess, INFINITE);
+    }
+    if (ms != 0) stats_wait(start, p->dwProcessId, ret == WAIT_TIMEOUT);
+    if (ret == WAIT_TIMEOUT) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
+    }
+    if (WAIT_FAILED == ret
         || !GetExitCodeProcess(p->hProcess, &exitcode))
       return push_error(L);
-    p->status = exitcode;
+    process_set_status(p, exitcode);
   }
   lua_pushnumber(L, p->status);
+  if (!usage) return 1;
+  push_usage(L, p);
+  return 2;
+}
+
+/* proc -- usage/nil error */
+int process_usage(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  if (p->status == -1) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "process not terminated");
+    return 2;
+  }
+  push_usage(L, p);
+  return 1;
+}
+
+/* proc [usage] -- exitcode [usage]/nil "timeout"/nil error */
+int process_poll(lua_State *L)
+{
+  int usage = lua_toboolean(L, 2);
+  lua_settop(L, 1);
+  lua_pushnumber(L, 0);
+  lua_pushboolean(L, usage);
+  return process_wait(L);
+}
+
+/* proc -- handle */
+int process_fd(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  lua_pushlightuserdata(L, p->hProcess);
   return 1;
 }
 
+static const struct {
+  const char *name;
+  int sig;
+} signal_names[] = {
+  {"HUP", 1}, {"INT", 2}, {"QUIT", 3}, {"KILL", 9}, {"TERM", 15}, {0, 0}
+};
+
+/* A signal number, or a name like "TERM" or "SIGTERM", 15 if missing */
+static int check_signal(lua_State *L, int idx)
+{
+  const char *name;
+  int i;
+  if (lua_isnoneornil(L, idx)) return 15;
+  if (lua_type(L, idx) == LUA_TNUMBER) return (int)lua_tonumber(L, idx);
+  name = luaL_checkstring(L, idx);
+  if (!strncmp(name, "SIG", 3)) name += 3;
+  for (i = 0; signal_names[i].name; i++)
+    if (!strcmp(name, signal_names[i].name)) return signal_names[i].sig;
+  return luaL_error(L, "bad signal '%s'", lua_tostring(L, idx));
+}
+
+static int push_kill(lua_State *L, int tree)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int sig = check_signal(L, 2);
+  if (p->status != -1 || WAIT_OBJECT_0 == WaitForSingleObject(p->hProcess, 0)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "process already terminated");
+    return 2;
+  }
+  if (!process_kill_tree(p, sig, tree))
+    return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* proc [signal] -- true/nil error */
+int process_kill(lua_State *L)
+{
+  return push_kill(L, 0);
+}
+
+/* proc [signal] -- true/nil error */
+int process_killtree(lua_State *L)
+{
+  return push_kill(L, 1);
+}
+
+/* proc -- */
+int process_gc(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int i;
+  close_handle(&p->hProcess);
+  for (i = 0; i < 3; i++)
+    close_handle(&p->pipes[i]);
+  return 0;
+}
+
+/* One captured stream of process_communicate, served by its own thread */
+struct stream {
+  HANDLE h;
+  const char *input;
+  char *data;
+  size_t len, cap;
+  DWORD error;
+};
+
+static DWORD WINAPI stream_write(LPVOID arg)
+{
+  struct stream *s = arg;
+  while (s->len > 0) {
+    DWORD done;
+    if (!WriteFile(s->h, s->input, s->len > 65536 ? 65536 : (DWORD)s->len, &done, 0))
+      break; /* the child does not read all the input */
+    s->input += done;
+    s->len -= done;
+  }
+  return 0;
+}
+
+static DWORD WINAPI stream_read(LPVOID arg)
+{
+  struct stream *s = arg;
+  for (;;) {
+    DWORD done;
+    if (s->cap - s->len < 4096) {
+      size_t cap = s->cap ? 2 * s->cap : 4096;
+      char *data = realloc(s->data, cap);
+      if (!data) {
+        s->error = ERROR_NOT_ENOUGH_MEMORY;
+        break;
+      }
+      s->data = data;
+      s->cap = cap;
+    }
+    if (!ReadFile(s->h, s->data + s->len, (DWORD)(s->cap - s->len), &done, 0)) {
+      if (GetLastError() != ERROR_BROKEN_PIPE)
+        s->error = GetLastError();
+      break;
+    }
+    if (done == 0) break;
+    s->len += done;
+  }
+  return 0;
+}
+
+/* proc [input] -- out err exitcode/nil error */
+int process_communicate(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  struct stream st[3];
+  HANDLE threads[3];
+  DWORD n = 0, error = NO_ERROR, exitcode;
+  int i, captured[3];
+  memset(st, 0, sizeof st);
+  st[0].input = luaL_optlstring(L, 2, "", &st[0].len);
+  for (i = 0; i < 3; i++) {
+    captured[i] = p->pipes[i] != 0;
+    if (!captured[i]) continue;
+    st[i].h = p->pipes[i];
+    threads[n] = CreateThread(0, 0, i == 0 ? stream_write : stream_read, &st[i], 0, 0);
+    if (!threads[n]) {
+      error = GetLastError();
+      break;
+    }
+    n++;
+  }
+  /* the child killed at the deadline closes the pipes */
+  while (n > 0 && WAIT_TIMEOUT
+         == WaitForMultipleObjects(n, threads, TRUE, deadline_ms(p, INFINITE)))
+    process_expire(p);
+  while (n > 0) CloseHandle(threads[--n]);
+  for (i = 0; i < 3; i++) {
+    close_handle(&p->pipes[i]);
+    if (error == NO_ERROR) error = st[i].error;
+  }
+  if (error == NO_ERROR && p->status == -1) {
+    if (WAIT_FAILED == WaitForSingleObject(p->hProcess, INFINITE)
+        || !GetExitCodeProcess(p->hProcess, &exitcode))
+      error = GetLastError();
+    else
+      process_set_status(p, exitcode);
+  }
+  for (i = 1; i < 3; i++) {
+    if (error == NO_ERROR && captured[i])
+      lua_pushlstring(L, st[i].data ? st[i].data : "", st[i].len);
+    else
+      lua_pushboolean(L, 0);
+    free(st[i].data);
+  }
+  if (error != NO_ERROR)
+    return windows_pusherror(L, error, -2);
+  lua_pushnumber(L, p->status);
+  return 3;
+}
+
+/* Tells if the stream (1 for stdout, 2 for stderr) of the process is captured */
+int process_captured(lua_State *L, int idx, int stream)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  return p->pipes[stream] != 0;
+}
+
+/* Reads from a captured stream of the process, waiting for some data.
+ * Returns the bytes read, or 0 at the end of the stream, when the pipe is
+ * closed. Errors are raised.
+ */
+long process_read(lua_State *L, int idx, int stream, char *buf, size_t len)
+{
+  struct process *p = luaL_checkudata(L, idx, PROCESS_HANDLE);
+  DWORD done = 0;
+  if (!p->pipes[stream]) return 0;
+  if (!ReadFile(p->pipes[stream], buf, (DWORD)len, &done, 0)) {
+    if (GetLastError() != ERROR_BROKEN_PIPE)
+      return windows_pusherror(L, GetLastError(), -2), lua_error(L);
+    done = 0;
+  }
+  if (done == 0) close_handle(&p->pipes[stream]);
+  return done;
+}
+
+static struct process *to_process(lua_State *L, int idx)
+{
+  int top = lua_gettop(L);
+  struct process *p = lua_touserdata(L, idx);
+  idx = absindex(L, idx);
+  luaL_getmetatable(L, PROCESS_HANDLE);
+  if (!p || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
+    p = 0;
+  lua_settop(L, top);
+  return p;
+}
+
+/* Waits for the processes in the array at index 1, until one (any) or all of
+ * them are terminated.
+ */
+static int wait_processes(lua_State *L, int any)
+{
+  size_t i, n;
+  double timeout;
+  DWORD start = GetTickCount();
+  struct process **ps;
+  HANDLE *hs;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  timeout = luaL_optnumber(L, 2, -1);
+  lua_settop(L, 2);
+  n = lua_value_length(L, 1);
+  if (any && n == 0)
+    return luaL_argerror(L, 1, "empty process list");
+  ps = lua_newuserdata(L, n * sizeof *ps + 1);
+  hs = lua_newuserdata(L, MAXIMUM_WAIT_OBJECTS * sizeof *hs);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    ps[i] = to_process(L, -1);
+    if (!ps[i])
+      return luaL_error(L, "bad process at index %d (%s expected, got %s)",
+                        (int)i + 1, PROCESS_HANDLE, luaL_typename(L, -1));
+    lua_pop(L, 1);
+  }
+  for (;;) {
+    DWORD m = 0, ms = INFINITE;
+    size_t running = 0;
+    for (i = 0; i < n; i++) {
+      if (any && ps[i]->reported) continue;
+      if (ps[i]->status == -1) {
+        DWORD exitcode, ret = WaitForSingleObject(ps[i]->hProcess, 0);
+        if (ret == WAIT_FAILED)
+          return push_error(L);
+        if (ret == WAIT_TIMEOUT) {
+          process_expire(ps[i]);
+          if (m < MAXIMUM_WAIT_OBJECTS) hs[m++] = ps[i]->hProcess;
+          running++;
+          continue;
+        }
+        if (!GetExitCodeProcess(ps[i]->hProcess, &exitcode))
+          return push_error(L);
+        process_set_status(ps[i], exitcode);
+      }
+      if (any) {
+        ps[i]->reported = 1;
+        lua_rawgeti(L, 1, i + 1);
+        lua_pushnumber(L, ps[i]->status);
+        lua_pushnumber(L, i + 1);
+        return 3;
+      }
+    }
+    if (!running && any) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "no process left");
+      return 2;
+    }
+    if (!running) {
+      lua_createtable(L, n, 0);
+      for (i = 0; i < n; i++) {
+        lua_pushnumber(L, ps[i]->status);
+        lua_rawseti(L, -2, i + 1);
+      }
+      return 1;
+    }
+    if (timeout >= 0) {
+      DWORD elapsed = GetTickCount() - start;
+      if (elapsed >= (DWORD)(timeout * 1000)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+      }
+      ms = (DWORD)(timeout * 1000) - elapsed;
+    }
+    for (i = 0; i < n; i++)
+      if (ps[i]->status == -1) ms = deadline_ms(ps[i], ms);
+    /* only MAXIMUM_WAIT_OBJECTS handles can be waited at once */
+    if (running > m && (ms == INFINITE || ms > 50)) ms = 50;
+    if (WAIT_FAILED == WaitForMultipleObjects(m, hs, FALSE, ms))
+      return push_error(L);
+  }
+}
+
+/* procs [timeout] -- proc exitcode index/nil "timeout"/nil error */
+int lc_waitany(lua_State *L)
+{
+  return wait_processes(L, 1);
+}
+
+/* procs [timeout] -- exitcodes/nil "timeout"/nil error */
+int lc_waitall(lua_State *L)
+{
+  return wait_processes(L, 0);
+}
+
 /* proc -- string */
 int process_tostring(lua_State *L)
 {
@@ -373,22 +1084,83 @@ static void get_redirect(lua_State *L,
                          int idx, const char *stdname, struct spawn_params *p)
 {
   lua_getfield(L, idx, stdname);
-  if (!lua_isnil(L, -1))
+  if (lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "capture"))
+    spawn_param_capture(p, stdname);
+  else if (to_rawfd(L, -1))
+    spawn_param_redirect(p, stdname, check_rawfd(L, -1)->h);
+  else if (!lua_isnil(L, -1))
     spawn_param_redirect(p, stdname, file_handle(check_file(L, -1, stdname)));
   lua_pop(L, 1);
 }
 
-/* filename [args-opts] -- proc/nil error */
-/* args-opts -- proc/nil error */
-int lc_spawn(lua_State *L)
+/* Reads the options that set up the child. Only the affinity, the priority
+ * and the process group have a meaning here.
+ */
+static void get_setup(lua_State *L, int idx, struct spawn_params *p)
+{
+  static const char *const unsupported[] = {
+    "rlimits", "ioprio", "cgroup", "fds", "inherit", "session", 0
+  };
+  int i;
+  for (i = 0; unsupported[i]; i++) {
+    lua_getfield(L, idx, unsupported[i]);
+    if (!lua_isnil(L, -1))
+      luaL_error(L, "the %s option is not supported on windows", unsupported[i]);
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, idx, "nice");
+  if (!lua_isnil(L, -1)) {
+    lua_Number nice;
+    if (lua_type(L, -1) != LUA_TNUMBER)
+      luaL_error(L, "bad nice option (number expected, got %s)",
+                 luaL_typename(L, -1));
+    nice = lua_tonumber(L, -1);
+    p->flags = nice <= -10 ? HIGH_PRIORITY_CLASS
+             : nice < 0 ? ABOVE_NORMAL_PRIORITY_CLASS
+             : nice == 0 ? NORMAL_PRIORITY_CLASS
+             : nice < 10 ? BELOW_NORMAL_PRIORITY_CLASS
+             : IDLE_PRIORITY_CLASS;
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "pgroup");
+  if (lua_toboolean(L, -1))
+    p->flags |= CREATE_NEW_PROCESS_GROUP;
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "cpus");
+  if (!lua_isnil(L, -1)) {
+    size_t n;
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad cpus option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    n = lua_value_length(L, -1);
+    for (i = 1; i <= (int)n; i++) {
+      lua_Number cpu;
+      lua_rawgeti(L, -1, i);
+      cpu = lua_tonumber(L, -1);
+      if (lua_type(L, -1) != LUA_TNUMBER || cpu < 0
+          || cpu >= 8 * sizeof p->cpus)
+        luaL_error(L, "bad cpu %d in cpus option", i);
+      p->cpus |= (DWORD_PTR)1 << (int)cpu;
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+/* Parses the arguments of lc_spawn. Everything the params refer to is left
+ * on the stack.
+ */
+/* filename [args-opts] -- cmdline opts ... */
+/* args-opts -- cmdline opts ... */
+static struct spawn_params *spawn_parse(lua_State *L)
 {
   struct spawn_params *params;
-  int have_options;
+  int have_options, first = 0;
   switch (lua_type(L, 1)) {
-  default: return lua_report_type_error(L, 1, "string or table");
+  default: return lua_report_type_error(L, 1, "string or table"), NULL;
   case LUA_TSTRING:
     switch (lua_type(L, 2)) {
-    default: return lua_report_type_error(L, 2, "table");
+    default: return lua_report_type_error(L, 2, "table"), NULL;
     case LUA_TNONE: have_options = 0; break;
     case LUA_TTABLE: have_options = 1; break;
     }
@@ -396,24 +1168,16 @@ int lc_spawn(lua_State *L)
   case LUA_TTABLE:
     have_options = 1;
     lua_getfield(L, 1, "command");      /* opts ... cmd */
-    if (!lua_isnil(L, -1)) {
-      /* convert {command=command,arg1,...} to command {arg1,...} */
-      lua_insert(L, 1);                 /* cmd opts ... */
-    }
-    else {
-      /* convert {arg0,arg1,...} to arg0 {arg1,...} */
-      size_t i, n = lua_value_length(L, 1);
-      lua_rawgeti(L, 1, 1);             /* opts ... nil cmd */
-      lua_insert(L, 1);                 /* cmd opts ... nil */
-      for (i = 2; i <= n; i++) {
-        lua_rawgeti(L, 2, i);           /* cmd opts ... nil argi */
-        lua_rawseti(L, 2, i - 1);       /* cmd opts ... nil */
-      }
-      lua_rawseti(L, 2, n);             /* cmd opts ... */
+    if (lua_isnil(L, -1)) {
+      /* {arg0,arg1,...}: the command is arg0, the arguments follow it */
+      lua_pop(L, 1);                    /* opts ... */
+      lua_rawgeti(L, 1, 1);             /* opts ... cmd */
+      first = 1;
     }
+    lua_insert(L, 1);                   /* cmd opts ... */
     if (lua_type(L, 1) != LUA_TSTRING)
       return luaL_error(L, "bad command option (string expected, got %s)",
-                        luaL_typename(L, 1));
+                        luaL_typename(L, 1)), NULL;
     break;
   }
   params = spawn_param_init(L);
@@ -425,35 +1189,339 @@ int lc_spawn(lua_State *L)
     switch (lua_type(L, -1)) {
     default:
       return luaL_error(L, "bad args option (table expected, got %s)",
-                        luaL_typename(L, -1));
+                        luaL_typename(L, -1)), NULL;
     case LUA_TNIL:
       lua_pop(L, 1);                    /* cmd opts ... */
       lua_pushvalue(L, 2);              /* cmd opts ... opts */
-      if (0) /*FALLTHRU*/
+      spawn_param_args(params, first);  /* cmd opts ... */
+      break;
     case LUA_TTABLE:
-      if (lua_value_length(L, 2) > 0)
+      if (lua_value_length(L, 2) > (size_t)first)
         return
-          luaL_error(L, "cannot specify both the args option and array values");
-      spawn_param_args(params);         /* cmd opts ... */
+          luaL_error(L, "cannot specify both the args option and array values"), NULL;
+      spawn_param_args(params, 0);      /* cmd opts ... */
       break;
     }
     lua_getfield(L, 2, "env");          /* cmd opts ... envtab */
     switch (lua_type(L, -1)) {
     default:
-      return luaL_error(L, "bad env option (table expected, got %s)",
-                        luaL_typename(L, -1));
+      return luaL_error(L, "bad env option (table or %s expected, got %s)",
+                        ENVBLOCK_HANDLE, luaL_typename(L, -1)), NULL;
     case LUA_TNIL:
       break;
     case LUA_TTABLE:
       spawn_param_env(params);          /* cmd opts ... */
       break;
+    case LUA_TUSERDATA:
+      spawn_param_envblock(params, check_envblock(L, -1));
+      break;
     }
     get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
     get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
     get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    get_setup(L, 2, params);                /* cmd opts ... */
+    lua_getfield(L, 2, "timeout");          /* cmd opts ... timeout */
+    if (!lua_isnil(L, -1)) {
+      if (lua_type(L, -1) != LUA_TNUMBER || lua_tonumber(L, -1) < 0)
+        return luaL_error(L, "bad timeout option (non negative number expected)"), NULL;
+      params->timeout = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);                          /* cmd opts ... */
   }
+  return params;
+}
+
+/* filename [args-opts] -- proc/nil error */
+/* args-opts -- proc/nil error */
+int lc_spawn(lua_State *L)
+{
+  struct spawn_params *params = spawn_parse(L);
+  if (!params) return 0;
   return spawn_param_execute(params);   /* proc/nil error */
 }
 
+/* A spawn spec parsed once by lc_prepare, to be spawned many times */
+struct template {
+  struct spawn_params *params;
+  int ref;
+};
+
+/* filename [args-opts] -- template */
+/* args-opts -- template */
+int lc_prepare(lua_State *L)
+{
+  struct spawn_params *params = spawn_parse(L);
+  struct template *t;
+  int i, top;
+  if (!params) return 0;
+  /* keep alive all the values the params refer to */
+  top = lua_gettop(L);
+  lua_createtable(L, top, 0);           /* ... anchor */
+  for (i = 1; i <= top; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i);
+  }
+  t = lua_newuserdata(L, sizeof *t);    /* ... anchor template */
+  t->params = params;
+  t->ref = LUA_NOREF;
+  luaL_getmetatable(L, TEMPLATE_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_insert(L, -2);                    /* ... template anchor */
+  t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+/* template [argtab] -- proc/nil error */
+int template_spawn(lua_State *L)
+{
+  struct template *t = luaL_checkudata(L, 1, TEMPLATE_HANDLE);
+  struct spawn_params p = *t->params;
+  p.L = L;
+  if (!lua_isnoneornil(L, 2)) {
+    size_t i, n;
+    luaL_Buffer b;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = lua_value_length(L, 2);
+    lua_pushnil(L);                     /* template argtab nil */
+    luaL_buffinit(L, &b);               /* template argtab nil b... */
+    luaL_addstring(&b, p.cmdline);
+    for (i = 1; i <= n; i++) {
+      const char *s;
+      lua_rawgeti(L, 2, i);             /* template argtab nil b... arg */
+      lua_replace(L, 3);                /* template argtab arg b... */
+      luaL_addchar(&b, ' ');
+      s = lua_tostring(L, 3);
+      if (!s)
+        return luaL_error(L, "expected string for argument %d, got %s",
+                          (int)i, luaL_typename(L, 3));
+      add_argument(&b, s);
+    }
+    luaL_pushresult(&b);                /* template argtab arg cmdline */
+    p.cmdline = lua_tostring(L, -1);
+  }
+  return spawn_param_execute(&p);       /* proc/nil error */
+}
+
+/* template -- */
+int template_gc(lua_State *L)
+{
+  struct template *t = luaL_checkudata(L, 1, TEMPLATE_HANDLE);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+  t->ref = LUA_NOREF;
+  return 0;
+}
+
+/* Spawns a stage of lc_pipeline, with the stdin and the stdout connected to
+ * the in and out handles, if they are not null.
+ */
+/* spec in out -- proc/nil error */
+static int pipeline_spawn(lua_State *L)
+{
+  HANDLE in = lua_touserdata(L, 2), out = lua_touserdata(L, 3);
+  struct spawn_params *params;
+  lua_settop(L, 1);
+  params = spawn_parse(L);
+  if (!params) return 0;
+  if (in) {
+    set_std_handle(&params->si, 0, in);
+    params->capture[0] = 0;
+  }
+  if (out) {
+    set_std_handle(&params->si, 1, out);
+    params->capture[1] = 0;
+  }
+  return spawn_param_execute(params);   /* proc/nil error */
+}
+
+/* {spec1, spec2, ..., pipe_size=n, wait=bool} -- procs [codes]/nil error */
+int lc_pipeline(lua_State *L)
+{
+  int i, n, wait;
+  DWORD size;
+  HANDLE in = 0, ph[2];
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  n = lua_value_length(L, 1);
+  lua_getfield(L, 1, "pipe_size");      /* opts size */
+  size = lua_tonumber(L, -1);
+  lua_getfield(L, 1, "wait");           /* opts size wait */
+  wait = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_settop(L, 1);
+  lua_createtable(L, n, 0);             /* opts procs */
+  for (i = 1; i <= n; i++) {
+    int status;
+    ph[0] = ph[1] = 0;
+    if (i < n && !CreatePipe(ph + 0, ph + 1, 0, size)) {
+      DWORD error = GetLastError();
+      close_handle(&in);
+      return windows_pusherror(L, error, -2);
+    }
+    lua_pushcfunction(L, pipeline_spawn);
+    lua_rawgeti(L, 1, i);
+    lua_pushlightuserdata(L, in);
+    lua_pushlightuserdata(L, ph[1]);
+    status = lua_pcall(L, 3, 2, 0);     /* opts procs proc/nil error */
+    /* the stage owns its side of the pipes now */
+    close_handle(&in);
+    close_handle(&ph[1]);
+    in = ph[0];
+    if (status) {
+      close_handle(&in);
+      return lua_error(L);
+    }
+    if (lua_isnil(L, -2)) {
+      close_handle(&in);
+      return 2;
+    }
+    lua_pop(L, 1);                      /* opts procs proc */
+    lua_rawseti(L, 2, i);               /* opts procs */
+  }
+  if (!wait) return 1;
+  lua_pushcfunction(L, lc_waitall);
+  lua_pushvalue(L, 2);
+  lua_call(L, 1, 2);                    /* opts procs codes/nil error */
+  if (lua_isnil(L, -2)) return 2;
+  lua_pop(L, 1);                        /* opts procs codes */
+  return 2;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+#define COPY_CHUNK (1 << 16)
+
+static BOOL write_all(HANDLE h, const char *buf, DWORD len)
+{
+  DWORD w;
+  while (len > 0) {
+    if (!WriteFile(h, buf, len, &w, 0)) return FALSE;
+    buf += w;
+    len -= w;
+  }
+  return TRUE;
+}
+
+/* Copies up to n bytes from the handle in to out1 and, if it is not null, to
+ * out2, or all the data until the end of file if n is negative. Returns the
+ * copied bytes, or -1.
+ */
+static long long handle_copy(HANDLE in, HANDLE out1, HANDLE out2, long long n)
+{
+  long long total = 0;
+  char *buf = malloc(COPY_CHUNK);
+  if (!buf) return -1;
+  while (n != 0) {
+    DWORD r, len = n < 0 || n > COPY_CHUNK ? COPY_CHUNK : (DWORD)n;
+    if (!ReadFile(in, buf, len, &r, 0)) {
+      if (GetLastError() == ERROR_BROKEN_PIPE) break;
+      total = -1;
+      break;
+    }
+    if (r == 0) break;
+    if (!write_all(out1, buf, r) || (out2 && !write_all(out2, buf, r))) {
+      total = -1;
+      break;
+    }
+    total += r;
+    if (n > 0) n -= r;
+  }
+  free(buf);
+  return total;
+}
+
+/* src dst [nbytes] -- nbytes/nil error */
+int lc_splice(lua_State *L)
+{
+  FILE *src = check_file(L, 1, "src");
+  FILE *dst = check_file(L, 2, "dst");
+  long long n = luaL_optnumber(L, 3, -1);
+  fflush(dst);
+  n = handle_copy(file_handle(src), file_handle(dst), 0, n);
+  if (n == -1) return push_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+/* src dst1 dst2 [nbytes] -- nbytes/nil error */
+int lc_tee(lua_State *L)
+{
+  FILE *src = check_file(L, 1, "src");
+  FILE *dst1 = check_file(L, 2, "dst1");
+  FILE *dst2 = check_file(L, 3, "dst2");
+  long long n = luaL_optnumber(L, 4, -1);
+  fflush(dst1);
+  fflush(dst2);
+  n = handle_copy(file_handle(src), file_handle(dst1), file_handle(dst2), n);
+  if (n == -1) return push_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* file -- handle */
+int lc_fileno(lua_State *L)
+{
+  lua_pushlightuserdata(L, file_handle(check_file(L, 1, "file")));
+  return 1;
+}
+
+/* The anonymous pipes of windows can not be waited together with the
+ * processes, so there is no poller, nor loop.
+ */
+/* -- nil error */
+int lc_poller(lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "not supported on windows");
+  return 2;
+}
+
+int poller_add(lua_State *L) { return lc_poller(L); }
+int poller_remove(lua_State *L) { return lc_poller(L); }
+int poller_wait(lua_State *L) { return lc_poller(L); }
+int poller_close(lua_State *L) { return 0; }
+
+/* -- nil error */
+int lc_loop(lua_State *L) { return lc_poller(L); }
+
+int loop_go(lua_State *L) { return lc_poller(L); }
+int loop_run(lua_State *L) { return lc_poller(L); }
+int loop_read(lua_State *L) { return lc_poller(L); }
+int loop_write(lua_State *L) { return lc_poller(L); }
+int loop_wait(lua_State *L) { return lc_poller(L); }
+int loop_communicate(lua_State *L) { return lc_poller(L); }
+int loop_sleep(lua_State *L) { return lc_poller(L); }
+int loop_gc(lua_State *L) { return 0; }
+
+/* The shared memory channel needs memfd and futex */
+/* [size] -- nil error */
+int lc_shmchannel(lua_State *L) { return lc_poller(L); }
+
+int lc_shmattach(lua_State *L) { return lc_poller(L); }
+int shmchannel_send(lua_State *L) { return lc_poller(L); }
+int shmchannel_recv(lua_State *L) { return lc_poller(L); }
+int shmchannel_fileno(lua_State *L) { return lc_poller(L); }
+int shmchannel_close(lua_State *L) { return 0; }
+
+/* The worker waits on the pipes of many processes, like the loop */
+/* spec -- nil error */
+int lc_worker(lua_State *L) { return lc_poller(L); }
+
+int worker_send(lua_State *L) { return lc_poller(L); }
+int worker_receive(lua_State *L) { return lc_poller(L); }
+int worker_call(lua_State *L) { return lc_poller(L); }
+int worker_close(lua_State *L) { return 0; }
+int worker_gc(lua_State *L) { return 0; }
+
+/* There is no fork to make cheaper */
+/* [interpreter] -- nil error */
+int lc_forkserver(lua_State *L) { return lc_poller(L); }
+
+int lc_forkserver_serve(lua_State *L) { return lc_poller(L); }
+int forkserver_spawn(lua_State *L) { return lc_poller(L); }
+int forkserver_close(lua_State *L) { return 0; }
+int forkserver_gc(lua_State *L) { return 0; }
+
 #endif // USE_WINDOWS
 
@@ -68,6 +68,12 @@ got = lc.environ()['TESTVAR']
 
 test(nil, got)
 
+lc.setenv('TESTVAR', 'child')
+test(os.getenv('TESTVAR'), nil)
+local p = lc.spawn{lua, '-e', 'io.write(os.getenv("TESTVAR"))', stdout = 'capture'}
+test(p:communicate(), 'child')
+lc.setenv('TESTVAR')
+
 -- Pipe
 
 expect = 'hello world ' .. tostring(math.random())
@@ -88,6 +94,26 @@ got = r:read("*l")
 
 test(expect, got)
 
+-- Raw pipe
+
+expect = 'hello world ' .. tostring(math.random())
+
+local r,w = lc.pipe{raw = true}
+test(w:write(expect), #expect)
+w:close()
+test(r:read(1000), expect)
+test(r:read(1000), nil)
+test(pcall(r.read, r, 0), false)
+test(pcall(r.read, r, -1), false)
+r:close()
+
+if lc.spawn_backend ~= 'CreateProcess' then
+  local r,w = lc.pipe{raw = true, nonblock = true}
+  local got, err = r:read()
+  test(got, nil)
+  test(err, 'timeout')
+end
+
 -- Spawn
 
 expect = 'hello world ' .. tostring(math.random())
@@ -113,6 +139,12 @@ got = r:read("*l")
 
 test(expect, got)
 
+local r,w = lc.pipe{raw = true}
+local p=lc.spawn{lua,'-e','io.write("' .. expect .. '")',stdout=w}
+w:close()
+p:wait()
+test(r:read(), expect)
+
 -- Spawn env
 
 expect = 'hello world ' .. tostring(math.random())
@@ -136,6 +168,72 @@ got = r:read("*l")
 
 test(expect:gsub('[\n\r]*$',''), got:gsub('[\n\r]*$',''))
 
+expect = 'hello world ' .. tostring(math.random())
+
+local e = lc.envblock{PATH=os.getenv("PATH"),LD_LIBRARY_PATH=os.getenv("LD_LIBRARY_PATH"),TESTVAR='x'}
+e:set('TESTVAR', expect)
+e:set('OTHERVAR', 'y')
+e:unset('OTHERVAR')
+test(e:get('TESTVAR'), expect)
+test(e:get('OTHERVAR'), nil)
+local r,w = lc.pipe()
+local p=lc.spawn{lua,'-e','print(os.getenv("TESTVAR"), os.getenv("OTHERVAR"))', stdout=w, env=e}
+w:close()
+p:wait()
+got = r:read("*l")
+
+test(expect .. '\tnil', got:gsub('[\n\r]*$',''))
+
+local e = lc.envblock()
+test(e:get('TESTVAR'), lc.environ()['TESTVAR'])
+
+-- Command search
+
+local dir = os.tmpname()
+os.remove(dir)
+lc.spawn{'mkdir', dir}:wait()
+local path = lc.environ()['PATH']
+lc.setenv('PATH', dir .. ':' .. path)
+test(lc.spawn{'lc-test-command'}, nil)
+local f = io.open(dir .. '/lc-test-command', 'w')
+f:write('#!/bin/sh\necho found\n')
+f:close()
+lc.spawn{'chmod', '+x', dir .. '/lc-test-command'}:wait()
+local p = lc.spawn{'lc-test-command', stdout = 'capture'}
+test(p:communicate(), 'found\n')
+os.remove(dir .. '/lc-test-command')
+test(lc.spawn{'lc-test-command'}, nil)
+lc.setenv('PATH', path)
+os.remove(dir)
+
+-- a directory of the PATH created later is searched as well
+local dir = os.tmpname()
+os.remove(dir)
+lc.setenv('PATH', dir .. ':' .. path)
+test(lc.spawn{'true'}:wait(), 0)
+lc.spawn{'mkdir', dir}:wait()
+local f = io.open(dir .. '/true', 'w')
+f:write('#!/bin/sh\necho later\n')
+f:close()
+lc.spawn{'chmod', '+x', dir .. '/true'}:wait()
+local p = lc.spawn{'true', stdout = 'capture'}
+test(p:communicate(), 'later\n')
+lc.setenv('PATH', path)
+os.remove(dir .. '/true')
+os.remove(dir)
+
+-- the relative directories are searched from the current one
+local f = io.open('lc-test-command', 'w')
+f:write('#!/bin/sh\necho here\n')
+f:close()
+lc.spawn{'chmod', '+x', 'lc-test-command'}:wait()
+test(lc.spawn{'lc-test-command'}, nil)
+lc.setenv('PATH', '.:' .. path)
+local p = lc.spawn{'lc-test-command', stdout = 'capture'}
+test(p:communicate(), 'here\n')
+lc.setenv('PATH', path)
+os.remove('lc-test-command')
+
 -- Sub-process result
 
 local function readall()
@@ -156,6 +254,511 @@ local result = p:wait()
 
 test(result, 123)
 
+-- Wait with timeout
+
+local p=lc.spawn{lua,'-e','local t=os.time() while os.time()-t<2 do end os.exit(7)'}
+local result, err = p:poll()
+test(result, nil)
+test(err, 'timeout')
+result, err = p:wait(0.1)
+test(result, nil)
+test(err, 'timeout')
+test(select('#', p:wait(5)), 1)
+result = p:wait(5)
+test(result, 7)
+test(p:poll(), 7)
+local result, usage = p:wait(nil, true)
+test(result, 7)
+test(type(usage.utime), 'number')
+test(usage.wall >= 1, true)
+test(p:usage().wall, usage.wall)
+-- a timeout too long for poll is clamped
+test(lc.spawn{lua, '-e', 'os.exit(4)'}:wait(1e10), 4)
+
+-- Wait any/all
+
+local slow = lc.spawn{lua,'-e','local t=os.time() while os.time()-t<2 do end os.exit(2)'}
+local fast = lc.spawn{lua,'-e','os.exit(1)'}
+local procs = {slow, fast}
+local p, result, index = lc.waitany(procs)
+test(p, fast)
+test(result, 1)
+test(index, 2)
+result, err = lc.waitall(procs, 0.1)
+test(result, nil)
+test(err, 'timeout')
+result = lc.waitall(procs)
+test(result[1], 2)
+test(result[2], 1)
+-- each process is returned once
+local p, result, index = lc.waitany(procs)
+test(p, slow)
+test(index, 1)
+local p, err = lc.waitany(procs)
+test(p, nil)
+test(err, 'no process left')
+
+-- Pool
+
+local jobs = {}
+for i = 1, 6 do
+  jobs[i] = {lua, '-e', 'os.exit(' .. i .. ')'}
+end
+jobs[7] = {'this_command_does_not_exist_' .. tostring(math.random())}
+local result = lc.pool{jobs = jobs, max = 3}
+for i = 1, 6 do
+  test(result[i].exitcode, i)
+  test(type(result[i].time), 'number')
+  test(result[i].time, result[i].usage.wall)
+end
+test(result[7].error ~= nil or result[7].exitcode ~= 0, true)
+
+-- Capture
+
+local p = lc.spawn{lua, '-e', 'local s = io.read("*a") io.stderr:write(s:upper()) io.write(s, s) os.exit(3)',
+  stdin = 'capture', stdout = 'capture', stderr = 'capture'}
+expect = string.rep('hello world ', 100000)
+local out, err, result = p:communicate(expect)
+test(out, expect .. expect)
+test(err, expect:upper())
+test(result, 3)
+
+local p = lc.spawn{lua, '-e', 'print("hello")', stdout = 'capture'}
+local out, err, result = p:communicate()
+test(out:gsub('[\n\r]*$',''), 'hello')
+test(err, false)
+test(result, 0)
+
+-- Lines
+
+local code = 'for i = 1, 100000 do io.write("line ", i, "\\n") end'
+local p = lc.spawn{lua, '-e', code, stdout = 'capture'}
+local n = 0
+for l in p:lines() do
+  n = n + 1
+  if l ~= 'line ' .. n then break end
+end
+test(n, 100000)
+test(p:wait(), 0)
+local p = lc.spawn{lua, '-e', 'io.stderr:write(string.rep("x", 200000), "\\nlast")', stderr = 'capture'}
+local got = {}
+for l in p:lines{stream = 'stderr'} do got[#got + 1] = l end
+test(#got, 2)
+test(#got[1], 200000)
+test(got[2], 'last')
+test(p:wait(), 0)
+local p = lc.spawn{lua, '-e', code, stdout = 'capture'}
+local n, batches = 0, 0
+for t in p:lines{batch = 1000} do
+  batches = batches + 1
+  if #t > 1000 or t[1] ~= 'line ' .. n + 1 then break end
+  n = n + #t
+end
+test(n, 100000)
+test(batches >= 100, true)
+p:wait()
+test(pcall(p.lines, p, {stream = 'stdin'}), false)
+test(pcall(p.lines, p, {batch = 0}), false)
+
+-- Prepared templates
+
+local spec = {lua, '-e', 'io.write("a")', stdout = 'capture'}
+local t = lc.prepare(spec)
+test(#spec, 3)
+test(spec[1], lua)
+local out = t:spawn():communicate()
+test(out, 'a')
+local out, err, result = t:spawn{'-e', 'io.write("b")', '-e', 'os.exit(2)'}:communicate()
+test(out, 'ab')
+test(result, 2)
+local t = lc.prepare{lua, '-e', 'os.exit(5)'}
+test(t:spawn():wait(), 5)
+local result = lc.pool{jobs = {t, t}}
+test(result[1].exitcode, 5)
+test(result[2].exitcode, 5)
+local f = io.open('tmp.out.txt', 'wb')
+local t = lc.prepare{lua, '-e', 'io.write("c")', stdout = f}
+f = nil
+collectgarbage()
+test(t:spawn():wait(), 0)
+local f = io.open('tmp.out.txt', 'rb')
+test(f:read('*a'), 'c')
+f:close()
+local f = io.open('tmp.out.txt', 'wb')
+local t = lc.prepare{lua, '-e', 'io.write("c")', stdout = f}
+f:close()
+test(pcall(t.spawn, t), false)
+
+-- Poller
+
+local poller = lc.poller()
+if poller then
+  local r, w = lc.pipe{raw = true}
+  local p = lc.spawn{lua, '-e', 'local t=os.clock() while os.clock()-t<0.3 do end io.write("x")', stdout = w}
+  w:close()
+  test(poller:add(r, 'r'), true)
+  local objs, events = poller:wait(0)
+  test(#objs, 0)
+  objs, events = poller:wait(5)
+  test(objs[1], r)
+  test(events[1], 'r')
+  test(r:read(), 'x')
+  poller:remove(r)
+  if p:fd() then
+    test(poller:add(p), true)
+    objs, events = poller:wait(5)
+    test(objs[1], p)
+    test(events[1], 'exit')
+  end
+  test(p:wait(), 0)
+  test(poller:remove(p), true)
+  test(#poller:wait(0), 0)
+  poller:close()
+end
+
+-- Loop
+
+local loop = lc.loop()
+if loop then
+  local done = {}
+  for i = 1, 3 do
+    loop:go(function()
+      local p = lc.spawn{lua, '-e', 'io.write(io.read("*a"):upper()) os.exit(' .. i .. ')',
+        stdin = 'capture', stdout = 'capture'}
+      local out, err, result = loop:communicate(p, 'hello')
+      test(out, 'HELLO')
+      test(err, false)
+      test(result, i)
+      done[#done + 1] = i
+    end)
+  end
+  loop:go(function()
+    local r, w = lc.pipe{raw = true}
+    loop:go(function()
+      loop:sleep(0.1)
+      test(loop:write(w, 'hello'), 5)
+      w:close()
+    end)
+    test(loop:read(r), 'hello')
+    test(loop:read(r), nil)
+    test(loop:wait(lc.spawn{lua, '-e', 'os.exit(4)'}), 4)
+    done[#done + 1] = 4
+  end)
+  test(loop:run(), true)
+  test(#done, 4)
+end
+
+-- Pipeline
+
+local procs, codes = lc.pipeline{
+  {lua, '-e', 'io.write("hello") os.exit(1)'},
+  {lua, '-e', 'io.write(io.read("*a"):upper())'},
+  {lua, '-e', 'os.exit(#io.read("*a"))'},
+}
+test(#procs, 3)
+test(codes[1], 1)
+test(codes[2], 0)
+test(codes[3], 5)
+
+local procs = lc.pipeline{
+  {lua, '-e', 'io.write(string.rep("x", 1000000))'},
+  {lua, '-e', 'io.write(#io.read("*a"))', stdout = 'capture'},
+  pipe_size = 1048576, wait = false,
+}
+local out, err, result = procs[2]:communicate()
+test(out, '1000000')
+test(result, 0)
+
+-- the stages already spawned are killed and waited, when a later one fails
+local live = lc.stats().live
+local procs, err = lc.pipeline{
+  {lua, '-e', 'while true do end'},
+  {'luachild-missing-command'},
+}
+test(procs, nil)
+test(type(err), 'string')
+test(lc.stats().live, live)
+
+-- Splice and tee
+
+expect = string.rep('hello world ', 1000)
+local f = io.open('tmp.out.txt', 'wb')
+f:write(expect)
+f:close()
+local r, w = lc.pipe()
+local p = lc.spawn{lua, '-e', 'io.write(io.read("*a"))', stdin = r, stdout = 'capture'}
+r:close()
+local f = io.open('tmp.out.txt', 'rb')
+test(lc.splice(f, w), #expect)
+f:close()
+w:close()
+test(p:communicate(), expect)
+
+local r, w = lc.pipe()
+local r2, w2 = lc.pipe()
+local p = lc.spawn{lua, '-e', 'io.write(io.read("*a"))', stdin = r2, stdout = 'capture'}
+r2:close()
+w:write(expect)
+w:close()
+local f = io.open('tmp.out.txt', 'wb')
+test(lc.tee(r, w2, f), #expect)
+w2:close()
+f:close()
+test(p:communicate(), expect)
+test(readall(), expect)
+
+-- the data buffered by a read is moved first, also to a raw pipe side
+do
+  local f = io.open('tmp.out.txt', 'wb')
+  f:write('one\ntwo\nthree\n')
+  f:close()
+  f = io.open('tmp.out.txt', 'rb')
+  test(f:read('*l'), 'one')
+  local r, w = lc.pipe{raw = true}
+  test(lc.splice(f, w), 10)
+  f:close()
+  w:close()
+  test(r:read(100), 'two\nthree\n')
+  r:close()
+end
+
+-- Close fds
+
+test(type(lc.spawn_backend), 'string')
+local p = lc.spawn{lua, '-e', 'print("hello")', stdout = 'capture', close_fds = true}
+local out, err, result = p:communicate()
+test(out:gsub('[\n\r]*$',''), 'hello')
+test(result, 0)
+
+-- Descriptor mapping
+
+local r3, w3 = lc.pipe()
+local r4, w4 = lc.pipe()
+local p = lc.spawn{lua, '-e', 'io.open("/dev/fd/3", "w"):write("three") io.open("/dev/fd/4", "w"):write("four")',
+  fds = {[3] = w4, [4] = w3}, close_fds = true}
+w3:close()
+w4:close()
+test(p:wait(), 0)
+test(r3:read('*a'), 'four')
+test(r4:read('*a'), 'three')
+r3:close()
+r4:close()
+local r, w = lc.pipe()
+local n = string.format("%d", lc.fileno(w))
+local p = lc.spawn{lua, '-e', 'io.open("/dev/fd/'..n..'", "w"):write("inherited")',
+  inherit = {w}, close_fds = true}
+w:close()
+test(p:wait(), 0)
+test(r:read('*a'), 'inherited')
+r:close()
+test(pcall(lc.spawn, {lua, fds = {[1] = io.stdout}}), false)
+
+-- Shared memory channel
+
+local ch = lc.shmchannel(1024)
+local peer = lc.shmattach(ch:fileno())
+test(ch:send('hello'), true)
+test(peer:recv(0), 'hello')
+test(select(2, peer:recv(0)), 'timeout')
+ch:send('huge')
+test(peer:recv(1e300), 'huge')
+local msg = string.rep('0123456789', 50)
+for i = 1, 10 do
+  ch:send(msg .. i)
+  test(peer:recv(0), msg .. i)
+end
+test(ch:send(string.rep('x', 2048)), nil)
+peer:close()
+test(select(2, ch:send('x')), 'closed')
+ch:close()
+local ch = lc.shmchannel()
+local p = lc.spawn{lua, '-e', 'local lc = require "luachild" local ch = lc.shmattach(3) local m = ch:recv() while m do ch:send(m:upper()) m = ch:recv() end',
+  fds = {[3] = ch:fileno()}}
+for i = 1, 100 do
+  ch:send('msg' .. i)
+  test(ch:recv(5), 'MSG' .. i)
+end
+ch:close()
+test(p:wait(), 0)
+
+-- Worker
+
+local script = 'while true do local h = io.read("*l") if not h then break end local n = tonumber(h) local m = n > 0 and io.read(n) or "" if m == "die" then os.exit(3) end io.write(#m, "\\n", m:upper()) io.flush() end'
+local w = lc.worker{lua, '-e', script, size = 2}
+test(w:call('hello'), 'HELLO')
+local ids = {}
+for i = 1, 10 do ids[w:send('m' .. i)] = 'M' .. i end
+for i = 1, 10 do
+  local id, response = w:receive(5)
+  test(response, ids[id])
+end
+test(select(2, w:receive()), 'no pending requests')
+test(select(2, w:call('die')), 'worker exited')
+test(w:call(''), '')
+test(w:call('again'), 'AGAIN')
+w:close()
+test(pcall(w.call, w, 'x'), false)
+
+-- the responses written before the exit are not lost
+do
+  local w = lc.worker{lua, '-e', 'for i = 1, 2 do io.read(tonumber(io.read("*l"))) end io.write("2\\nr1", "2\\nr2")', size = 1}
+  local id1, id2 = w:send('a'), w:send('b')
+  lc.spawn{lua, '-e', 'local t = os.clock() while os.clock() - t < 0.3 do end'}:wait()
+  local id, response = w:receive(5)
+  test(id, id1)
+  test(response, 'r1')
+  id, response = w:receive(5)
+  test(id, id2)
+  test(response, 'r2')
+  w:close()
+end
+
+-- a worker collected without close does not leave zombies
+local live = lc.stats().live
+local w = lc.worker{lua, '-e', script, size = 2}
+test(w:call('x'), 'X')
+w = nil
+collectgarbage()
+collectgarbage()
+test(lc.stats().live, live)
+
+-- Fork server
+
+local fs = lc.forkserver(lua)
+local p = fs:spawn{lua, '-e', 'io.write(io.read("*a"):upper()) os.exit(3)', stdin = 'capture', stdout = 'capture'}
+local out, err, result = p:communicate('hello')
+test(out, 'HELLO')
+test(result, 3)
+test(type(p:usage().utime), 'number')
+local r, w = lc.pipe()
+p = fs:spawn{lua, '-e', 'local f = io.open("/dev/fd/5", "w") f:write("mapped") f:close()', fds = {[5] = w}, close_fds = true}
+w:close()
+test(p:wait(), 0)
+test(r:read(100), 'mapped')
+r:close()
+local ps = {}
+for i = 1, 4 do ps[i] = fs:spawn{lua, '-e', 'os.exit(' .. i .. ')'} end
+local codes = lc.waitall(ps, 5)
+for i = 1, 4 do test(codes[i], i) end
+local p, err = fs:spawn{'/nonexistent/command'}
+test(p, nil)
+test(type(err), 'string')
+fs:close()
+test(pcall(fs.spawn, fs, {lua}), false)
+
+-- a server collected without close is reaped as well
+local live = lc.stats().live
+local fs = lc.forkserver(lua)
+test(fs:spawn{lua, '-e', ''}:wait(), 0)
+fs = nil
+collectgarbage()
+collectgarbage()
+test(lc.stats().live, live)
+
+-- Kill and timeout
+
+local p = lc.spawn{lua, '-e', 'while true do end'}
+test(p:kill('KILL'), true)
+test(p:wait(), 128 + 9)
+test(p:kill(), nil)
+test(pcall(p.kill, p, 'NOSUCHSIGNAL'), false)
+local t = lc.clock()
+local p = lc.spawn{lua, '-e', 'while true do end', timeout = 0.2}
+test(p:wait(), 128 + 9)
+test(lc.clock() - t < 5, true)
+test(p:usage().timedout, true)
+local p = lc.spawn{lua, '-e', 'io.write("a") io.flush() while true do end',
+                  stdout = 'capture', timeout = 0.2}
+local out, err, code = p:communicate()
+test(out, 'a')
+test(code, 128 + 9)
+local p = lc.spawn{lua, '-e', 'os.exit(4)', timeout = 10}
+test(p:wait(), 4)
+test(p:usage().timedout, nil)
+test(pcall(lc.spawn, {lua, timeout = 'x'}), false)
+if lc.spawn_backend ~= 'CreateProcess' then
+  -- the shell and its background child are killed together
+  local p = lc.spawn{'/bin/sh', '-c', lua .. ' -e "while true do end" & wait',
+                    session = true, stdout = 'capture'}
+  test(p:wait(0.1), nil)
+  test(p:killtree('KILL'), true)
+  test(p:wait(), 128 + 9)
+  test(p:communicate(), '')
+end
+
+-- Stats
+
+lc.stats_reset()
+local live = lc.stats().live
+local ps = {}
+for i = 1, 5 do ps[i] = lc.spawn{lua, '-e', 'os.exit(0)'} end
+test(lc.stats().live, live + 5)
+for i = 1, 5 do ps[i]:wait() end
+test(lc.spawn{'luachild-no-such-command'}, nil)
+local p = lc.spawn{lua, '-e', 'io.read()', stdin = 'capture'}
+test(p:wait(0.01), nil)
+p:communicate('')
+lc.pipe()
+local s = lc.stats()
+test(s.spawns, 6)
+test(s.spawn_errors, 1)
+test(s.exits, 6)
+test(s.live, live)
+test(s.waits, 6)
+test(s.wait_timeouts, 1)
+test(s.pipes, 1)
+test(s.spawn_time.count, 6)
+test(s.spawn_time.p50 <= s.spawn_time.p99, true)
+test(s.spawn_time.p99 <= s.spawn_time.max, true)
+test(s.wait_time.max >= 0.01, true)
+lc.stats_reset()
+test(lc.stats().spawns, 0)
+test(lc.stats().spawn_time.count, 0)
+
+-- Trace
+
+local path = os.tmpname()
+test(lc.trace_start(path), true)
+test(lc.trace_start(path), nil)
+local p = lc.spawn{lua, '-e', 'os.exit(3)'}
+test(p:wait(), 3)
+local written, dropped = lc.trace_stop()
+test(written, 3)
+test(dropped, 0)
+test(lc.trace_stop(), nil)
+local f = io.open(path, 'rb')
+local trace = f:read('*a')
+f:close()
+os.remove(path)
+test(trace:sub(1, 1), '[')
+test(trace:match('"ph":"B"[^}]*"tid":(%d+)'), trace:match('"ph":"E"[^}]*"tid":(%d+)'))
+test(trace:match('"exitcode":(%d+)'), '3')
+test(trace:match('"ph":"X","name":"wait"') ~= nil, true)
+
+-- a trace not stopped is closed with the state
+local path = os.tmpname()
+local p = lc.spawn{lua, '-e', string.format('local lc = require "luachild" lc.trace_start(%q) lc.spawn{%q, "-e", ""}:wait()', path, lua)}
+test(p:wait(), 0)
+local f = io.open(path, 'rb')
+local trace = f:read('*a')
+f:close()
+os.remove(path)
+test(trace:match('%]%s*$') ~= nil, true)
+test(trace:match('"exitcode":(%d+)'), '0')
+
+-- Resource limits and scheduling
+
+local p = lc.spawn{lua, '-e', 'local t = {} for i = 1, 16 do t[i] = io.open("test.lua") end print(#t)',
+  stdout = 'capture', close_fds = true, rlimits = {nofile = 8}, nice = 5, cpus = {0}}
+local out, err, result = p:communicate()
+test(tonumber(out) < 16, true)
+test(result, 0)
+local p, err = lc.spawn{lua, '-e', '', rlimits = {nofile = {16, 8}}}
+test(p, nil)
+test(type(err), 'string')
+test(pcall(lc.spawn, {lua, rlimits = {bogus = 1}}), false)
+test(pcall(lc.spawn, {lua, nice = 'low'}), false)
+
 -- Passing any character to the child process
 
 for c = 0, 255 do